@@ -0,0 +1,90 @@
+#include "Affinity.hpp"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int parseCpuList(std::string value, std::vector<int> &cpus) {
+  std::vector<int> parsed;
+  size_t position = 0;
+
+  while (position < value.size()) {
+    size_t end = value.find(',', position);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    std::string range = value.substr(position, end - position);
+    position = end + 1;
+
+    int first, last;
+    char extra;
+    int fields = sscanf(range.c_str(), "%d-%d%c", &first, &last, &extra);
+    if (fields == 1 && sscanf(range.c_str(), "%d%c", &first, &extra) == 1) {
+      last = first;
+    } else if (fields != 2) {
+      return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      parsed.push_back(cpu);
+    }
+  }
+
+  if (parsed.empty()) {
+    return -1;
+  }
+  cpus = parsed;
+  return 0;
+}
+
+int pinCurrentThread(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return 0;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  int error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int cpuNode(int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *directory = opendir(path.c_str());
+  if (directory == nullptr) {
+    return 0;
+  }
+
+  int node = 0;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != nullptr) {
+    if (strncmp(entry->d_name, "node", 4) == 0 &&
+        sscanf(entry->d_name + 4, "%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(directory);
+  return node;
+}
+
+int incomingCpu(int socketFD) {
+  int cpu = -1;
+  socklen_t length = sizeof cpu;
+  if (getsockopt(socketFD, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) != 0) {
+    return -1;
+  }
+  return cpu;
+}
@@ -0,0 +1,24 @@
+#ifndef _AFFINITY_HPP_
+#define _AFFINITY_HPP_
+
+#include <string>
+#include <vector>
+
+// Parses a CPU list such as "0,2,4-7" into cpus. Returns 0 on success or
+// -1 if value is malformed.
+int parseCpuList(std::string value, std::vector<int> &cpus);
+
+// Restricts the calling thread to cpus; an empty list leaves it free.
+// Linux places pages on the node of the thread that first touches them,
+// so a thread pinned before it allocates gets node-local memory. Returns 0
+// on success or -1 with errno set.
+int pinCurrentThread(const std::vector<int> &cpus);
+
+// NUMA node of cpu, or 0 when the system doesn't report one
+int cpuNode(int cpu);
+
+// CPU that processed the packets of a connected socket (SO_INCOMING_CPU),
+// or -1 if unknown
+int incomingCpu(int socketFD);
+
+#endif
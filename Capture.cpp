@@ -0,0 +1,157 @@
+#include "Capture.hpp"
+
+static const char CAPTURE_MAGIC[8] = {'I', 'R', 'C', 'C', 'A', 'P', '1', '\0'};
+
+TrafficCapture::~TrafficCapture() { close(); }
+
+int TrafficCapture::open(const std::string &path, int64_t now) {
+  if (file != nullptr) {
+    return 0;
+  }
+
+  file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return -1;
+  }
+
+  CaptureFileHeader header;
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC);
+  header.startTime = now;
+  if (fwrite(&header, sizeof header, 1, file) != 1) {
+    int error = errno;
+    fclose(file);
+    file = nullptr;
+    errno = error;
+    return -1;
+  }
+
+  startTime = now;
+  isCapturing = true;
+  writerThread = new std::thread(&TrafficCapture::_write, this);
+  return 0;
+}
+
+void TrafficCapture::close() {
+  if (writerThread == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    isCapturing = false;
+  }
+  hasRecords.notify_one();
+  writerThread->join();
+  delete writerThread;
+  writerThread = nullptr;
+
+  fwrite(pending.data(), 1, pending.size(), file);
+  pending.clear();
+  fclose(file);
+  file = nullptr;
+}
+
+bool TrafficCapture::isOpen() { return isCapturing; }
+
+uint32_t TrafficCapture::newConnection() { return nextConnection++; }
+
+void TrafficCapture::append(CaptureRecordType type, uint32_t connection,
+                            int64_t now, const char *data, size_t length) {
+  CaptureRecordHeader header;
+  header.time = now - startTime;
+  header.connection = connection;
+  header.length = (uint16_t)length;
+  header.type = type;
+  header.padding = 0;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!isCapturing) {
+    return;
+  }
+  if (pending.size() + sizeof header + length > CAPTURE_BUFFER_LIMIT) {
+    dropped++;
+    return;
+  }
+  pending.append((const char *)&header, sizeof header);
+  pending.append(data, length);
+  records++;
+}
+
+void TrafficCapture::data(uint32_t connection, int64_t now, const char *data,
+                          size_t length) {
+  while (length > 0) {
+    size_t chunk = std::min(length, (size_t)UINT16_MAX);
+    append(CAPTURE_DATA, connection, now, data, chunk);
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void TrafficCapture::disconnect(uint32_t connection, int64_t now) {
+  append(CAPTURE_CLOSE, connection, now, nullptr, 0);
+}
+
+size_t TrafficCapture::recorded() { return records; }
+
+size_t TrafficCapture::droppedRecords() { return dropped; }
+
+// Swaps the buffer out under the lock and writes it without
+void TrafficCapture::_write() {
+  std::string writing;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (isCapturing) {
+    hasRecords.wait_for(lock,
+                        std::chrono::milliseconds(CAPTURE_FLUSH_INTERVAL));
+    writing.swap(pending);
+    lock.unlock();
+    if (!writing.empty()) {
+      fwrite(writing.data(), 1, writing.size(), file);
+      fflush(file);
+      writing.clear();
+    }
+    lock.lock();
+  }
+}
+
+CaptureReader::~CaptureReader() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+int CaptureReader::open(const std::string &path, std::string &error) {
+  file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    error = "Could not open " + path + ": " + std::string(strerror(errno));
+    return -1;
+  }
+
+  CaptureFileHeader header;
+  if (fread(&header, sizeof header, 1, file) != 1 ||
+      memcmp(header.magic, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC) != 0) {
+    error = path + " is not a capture file";
+    return -1;
+  }
+  return 0;
+}
+
+int CaptureReader::next(CaptureRecord &record) {
+  CaptureRecordHeader header;
+  size_t read = fread(&header, 1, sizeof header, file);
+  if (read == 0) {
+    return 0;
+  }
+  if (read != sizeof header ||
+      (header.type != CAPTURE_DATA && header.type != CAPTURE_CLOSE)) {
+    return -1;
+  }
+
+  record.type = (CaptureRecordType)header.type;
+  record.time = header.time;
+  record.connection = header.connection;
+  record.data.resize(header.length);
+  if (header.length > 0 &&
+      fread(&record.data[0], 1, header.length, file) != header.length) {
+    return -1;
+  }
+  return 1;
+}
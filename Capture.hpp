@@ -0,0 +1,97 @@
+#ifndef _CAPTURE_HPP_
+#define _CAPTURE_HPP_
+
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Bytes of records waiting for the writer past which new ones are dropped
+#define CAPTURE_BUFFER_LIMIT (64 << 20)
+// Milliseconds the writer waits for records before writing what it has
+#define CAPTURE_FLUSH_INTERVAL 100
+
+// Start of a capture file
+struct CaptureFileHeader {
+  char magic[8];
+  // TokenBucket::now() when the capture started; record times count from it
+  int64_t startTime;
+};
+
+enum CaptureRecordType : uint8_t {
+  // Bytes read from a connection, as read
+  CAPTURE_DATA = 1,
+  // The connection was closed
+  CAPTURE_CLOSE = 2
+};
+
+// Header of every record, followed by length bytes of data
+struct CaptureRecordHeader {
+  // Nanoseconds since CaptureFileHeader::startTime
+  int64_t time;
+  uint32_t connection;
+  uint16_t length;
+  uint8_t type;
+  uint8_t padding;
+};
+
+struct CaptureRecord {
+  CaptureRecordType type;
+  int64_t time;
+  uint32_t connection;
+  std::string data;
+};
+
+// Records what connections send to the server, as read from their sockets,
+// with the time it was read and an ID per connection. Any thread may
+// record: records are appended to a buffer under a short lock and a
+// background thread writes them out, so the listen loop never waits on the
+// disk.
+class TrafficCapture {
+private:
+  FILE *file = nullptr;
+  int64_t startTime = 0;
+  std::atomic<bool> isCapturing{false};
+  std::atomic<uint32_t> nextConnection{1};
+  std::atomic<size_t> records{0};
+  std::atomic<size_t> dropped{0};
+  std::mutex mutex;
+  std::condition_variable hasRecords;
+  std::string pending;
+  std::thread *writerThread = nullptr;
+
+  void append(CaptureRecordType type, uint32_t connection, int64_t now,
+              const char *data, size_t length);
+  void _write();
+
+public:
+  ~TrafficCapture();
+  // Truncates path, writes the file header and starts the writer. Returns
+  // 0, or -1 with errno set.
+  int open(const std::string &path, int64_t now);
+  // Writes what is buffered and closes the file
+  void close();
+  bool isOpen();
+  // ID for a connection seen for the first time
+  uint32_t newConnection();
+  // Splits length bytes read at time now in records of at most UINT16_MAX
+  void data(uint32_t connection, int64_t now, const char *data,
+            size_t length);
+  void disconnect(uint32_t connection, int64_t now);
+  size_t recorded();
+  size_t droppedRecords();
+};
+
+// Reads the records of a capture file in order
+class CaptureReader {
+private:
+  FILE *file = nullptr;
+
+public:
+  ~CaptureReader();
+  // Returns 0, or -1 with error set if path isn't a capture file
+  int open(const std::string &path, std::string &error);
+  // Returns 1 with record filled, 0 at the end of the file or -1 if the
+  // file ends inside a record
+  int next(CaptureRecord &record);
+};
+
+#endif
@@ -1,9 +1,7 @@
 #include "Client.hpp"
-#include "Socket.hpp"
 #include "interface.hpp"
+#include "util.hpp"
 #include <bits/stdc++.h>
-#include <regex>
-#include <sys/socket.h>
 
 Client::Client(std::string address) {
   this->address = address;
@@ -13,26 +11,59 @@ Client::Client(std::string address) {
 Client::Client() { init(); }
 
 void Client::init() {
-  delete this->socket;
-  delete this->clientInfo;
-  isConnectedMutex.lock();
-  this->_isConnected = false;
-  isConnectedMutex.unlock();
-  this->socket = new MySocket(AF_INET, SOCK_STREAM, 0);
-  clientInfo = new SocketWithInfo(socket, true);
+  ClientEvents events;
+
+  events.onNickname = [](ClientConnection *connection, std::string) {
+    GUI::updatePrompt(&connection->info);
+  };
+
+  events.onJoined = [](ClientConnection *connection, std::string channel) {
+    GUI::updatePrompt(&connection->info);
+    GUI::log("Joined channel " + channel + " as " +
+             (connection->info.isAdmin ? "admin" : "user") +
+             " successfully!");
+  };
+
+  events.onKicked = [](ClientConnection *connection, std::string channel) {
+    GUI::updatePrompt(&connection->info);
+    GUI::log("You have been kicked from " + channel + "!");
+  };
+
+  events.onMuted = [](ClientConnection *, std::string channel, bool isMuted) {
+    GUI::log(std::string("You have been ") +
+             (isMuted ? "muted" : "unmuted") + " in " + channel + "!");
+  };
+
+  events.onMessage = [](ClientConnection *, std::string sender,
+                        std::string text) {
+    GUI::addToWindow(sender + ": " + text);
+  };
+
+  events.onNotice = [](ClientConnection *, std::string text) {
+    GUI::addToWindow(text);
+  };
+
+  events.onDisconnected = [this](ClientConnection *) {
+    isConnectedMutex.lock();
+    this->connection = nullptr;
+    isConnectedMutex.unlock();
+    GUI::log("Server disconnected!");
+    GUI::log("Closing client...");
+    this->shouldBeListening = false;
+    GUI::GetInstance("")->prepareClose("Press any key to exit...");
+  };
+
+  this->core = new ClientCore(events);
 }
 
 int Client::start() {
 
   GUI::log("Attempting to connect to " + address + ":" + DEFAULT_PORT);
 
-  socket->setBlocking(false);
+  int status;
+  ClientConnection *connection = core->connect(address, DEFAULT_PORT, status);
 
-  int status = socket->socketConnect(address, DEFAULT_PORT);
-
-  socket->setBlocking(true);
-
-  if (status != 0) {
+  if (connection == nullptr) {
 
     std::string errorStr = gai_strerror(status);
 
@@ -43,16 +74,11 @@ int Client::start() {
     GUI::log("Error connecting to " + address + ":" + DEFAULT_PORT + ": " +
              errorStr);
 
-    this->stop();
-
-    init();
-
     return status;
   }
 
-  sendMessage("/whoami");
-
   isConnectedMutex.lock();
+  this->connection = connection;
   this->_isConnected = true;
   isConnectedMutex.unlock();
 
@@ -67,28 +93,18 @@ int Client::start(std::string address) {
   return start();
 }
 
-std::string Client::readMessage() {
-  std::string message;
-  this->socket->socketRead(message, MAX_MSG_SIZE + 100);
-  return message;
-}
-
-int Client::safeReadMessage(std::string &message) {
-  return this->socket->socketSafeRead(message, MAX_MSG_SIZE + 100, 1);
-}
-
 void Client::sendMessage(std::string message) {
-  this->socket->socketWrite(message);
+  std::lock_guard<std::mutex> lock(isConnectedMutex);
+  if (connection != nullptr) {
+    connection->send(message);
+  }
 }
 
 void Client::messageServer(std::string message) {
-  while (message.length() > MAX_MSG_SIZE) {
-    std::string subMessage = message.substr(0, MAX_MSG_SIZE);
-    message = message.substr(MAX_MSG_SIZE, message.length());
-    this->sendMessage("/m " + subMessage);
+  std::lock_guard<std::mutex> lock(isConnectedMutex);
+  if (connection != nullptr) {
+    connection->message(message);
   }
-
-  this->sendMessage("/m " + message);
 }
 
 int Client::stop() {
@@ -97,12 +113,17 @@ int Client::stop() {
 
   if (listenThread != nullptr) {
     listenThread->join();
+    delete listenThread;
+    listenThread = nullptr;
   }
 
   isConnectedMutex.lock();
   this->_isConnected = false;
+  if (connection != nullptr) {
+    core->close(connection);
+    connection = nullptr;
+  }
   isConnectedMutex.unlock();
-  this->socket->close();
   return 0;
 }
 bool Client::isConnected(bool shouldLog) {
@@ -118,13 +139,14 @@ bool Client::isConnected(bool shouldLog) {
 }
 
 bool Client::hasChannel(bool shouldLog) {
-  if (clientInfo->channel == "") {
-    if (shouldLog) {
-      GUI::log("You must be in a channel to use this command!");
-    }
-    return false;
+  isConnectedMutex.lock();
+  bool hasChannel = connection != nullptr && connection->info.channel != "";
+  isConnectedMutex.unlock();
+
+  if (!hasChannel && shouldLog) {
+    GUI::log("You must be in a channel to use this command!");
   }
-  return true;
+  return hasChannel;
 }
 
 void Client::startListening() {
@@ -132,88 +154,13 @@ void Client::startListening() {
   this->listenThread = new std::thread(&Client::_listen, this);
 }
 
-bool Client::checkMute() { return clientInfo->isMuted; }
+bool Client::checkMute() {
+  std::lock_guard<std::mutex> lock(isConnectedMutex);
+  return connection != nullptr && connection->info.isMuted;
+}
 
 void Client::_listen() {
-  std::string message;
-  while (this->shouldBeListening) {
-
-    isConnectedMutex.lock();
-
-    bool conn = this->_isConnected;
-
-    isConnectedMutex.unlock();
-
-    if (conn) {
-      if (safeReadMessage(message) >= 0) {
-        if (message == "") {
-          GUI::log("Server disconnected!");
-          GUI::log("Closing client...");
-          this->shouldBeListening = false;
-          GUI::GetInstance("")->prepareClose("Press any key to exit...");
-        } else if (message[0] == '/') {
-          std::regex regex("/youare (.+)");
-          std::smatch match;
-          std::regex_search(message, match, regex);
-          if (match.size() > 1) {
-            clientInfo->nickname = match[1].str();
-
-            GUI::updatePrompt(clientInfo);
-
-            continue;
-          }
-
-          regex = std::regex("/joined (.+) (.+)");
-          std::regex_search(message, match, regex);
-
-          if (match.size() > 1) {
-            clientInfo->isAdmin = match[2].str() == "admin";
-            clientInfo->channel = match[1].str();
-
-            GUI::updatePrompt(clientInfo);
-
-            GUI::log("Joined channel " + clientInfo->channel + " as " +
-                     (clientInfo->isAdmin ? "admin" : "user") +
-                     " successfully!");
-            continue;
-          }
-
-          if (message == "/kicked") {
-
-            clientInfo->isAdmin = false;
-            clientInfo->channel = "";
-
-            GUI::updatePrompt(clientInfo);
-
-            GUI::log("You have been kicked from your current channel!");
-
-            continue;
-          }
-
-          if (message == "/muted") {
-            clientInfo->isMuted = true;
-            GUI::log("You have been muted!");
-            continue;
-          }
-
-          if (message == "/unmuted") {
-            clientInfo->isMuted = false;
-            GUI::log("You have been unmuted!");
-            continue;
-          }
-
-          regex = std::regex("/msg (\\S+) (.+)");
-          std::regex_search(message, match, regex);
-
-          if (match.size() > 1) {
-            GUI::addToWindow(match[1].str() + ": " + match[2].str());
-            continue;
-          }
-
-        } else {
-          GUI::addToWindow(message);
-        }
-      }
-    }
+  while (this->shouldBeListening && core->size() > 0) {
+    core->poll(1000);
   }
 }
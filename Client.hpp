@@ -1,29 +1,23 @@
 #ifndef _CLIENT_HPP_
 #define _CLIENT_HPP_
 
-// Default port for the client
-#define DEFAULT_PORT "6697"
-
-// Maximum size of a message
-#define MAX_MSG_SIZE 4096
-
-#include "Socket.hpp" // Include the Socket header file
+#include "ClientCore.hpp" // Protocol handling, DEFAULT_PORT and MAX_MSG_SIZE
 #include <mutex>
 #include <string>
 #include <thread>
 
-// Class representing a client
+// Class representing a client, showing one ClientCore connection in the GUI
 class Client {
 private:
-  MySocket *socket;            // Pointer to a MySocket object
-  std::string address;         // Address of the server
-  SocketWithInfo *clientInfo;  // Pointer to a SocketWithInfo object
+  ClientCore *core;                         // Connection set and protocol
+  ClientConnection *connection = nullptr;   // Connection to the server
+  std::string address;                      // Address of the server
   bool _isConnected = false;   // Flag indicating if the client is connected
-  std::mutex isConnectedMutex; // Mutex for thread safety
+  std::mutex isConnectedMutex; // Guards _isConnected and connection
   bool shouldBeListening =
       false;      // Flag indicating if the client should be listening
   void _listen(); // Private method for listening to incoming messages
-  std::thread *listenThread; // Pointer to a thread for listening
+  std::thread *listenThread = nullptr; // Pointer to a thread for listening
   void init();               // Private method for initializing the client
 
 public:
@@ -48,12 +42,6 @@ public:
   // Method to check if the client is connected
   bool isConnected(bool);
 
-  // Method to read a message from the server
-  std::string readMessage();
-
-  // Method to safely read a message from the server
-  int safeReadMessage(std::string &message);
-
   // Method to send a message to the server
   void sendMessage(std::string message);
 
@@ -67,4 +55,4 @@ public:
   bool checkMute();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,189 @@
+#include "ClientCore.hpp"
+#include "util.hpp"
+#include <poll.h>
+#include <regex>
+#include <sys/socket.h>
+
+ClientConnection::ClientConnection(MySocket *socket) : info(socket, true) {}
+
+ClientConnection::~ClientConnection() { delete info.socket; }
+
+void ClientConnection::send(std::string command) {
+  info.socket->socketWrite(command + FRAME_DELIMITER);
+}
+
+void ClientConnection::message(std::string text) {
+  while (text.length() > MAX_MSG_SIZE) {
+    this->send("/m " + text.substr(0, MAX_MSG_SIZE));
+    text = text.substr(MAX_MSG_SIZE, text.length());
+  }
+  this->send("/m " + text);
+}
+
+ClientCore::ClientCore(ClientEvents events) { this->events = events; }
+
+ClientCore::~ClientCore() {
+  while (!connections.empty()) {
+    this->close(connections.back());
+  }
+}
+
+ClientConnection *ClientCore::connect(std::string address, std::string port,
+                                      int &status, bool askNickname) {
+  MySocket *socket = new MySocket(AF_INET, SOCK_STREAM, 0);
+
+  socket->setBlocking(false);
+  status = socket->socketConnect(address, port);
+  socket->setBlocking(true);
+
+  if (status != 0) {
+    socket->close();
+    delete socket;
+    return nullptr;
+  }
+
+  ClientConnection *connection = new ClientConnection(socket);
+  connection->index = connections.size();
+  connections.push_back(connection);
+  if (askNickname) {
+    connection->send("/whoami");
+  }
+  return connection;
+}
+
+void ClientCore::close(ClientConnection *connection) {
+  if (connection->isClosed) {
+    return;
+  }
+  connection->isClosed = true;
+  connection->info.socket->close();
+
+  if (!isPolling) {
+    remove(connection);
+  }
+}
+
+void ClientCore::remove(ClientConnection *connection) {
+  connections[connection->index] = connections.back();
+  connections[connection->index]->index = connection->index;
+  connections.pop_back();
+  delete connection;
+}
+
+int ClientCore::poll(int timeout) {
+  std::vector<struct pollfd> descriptors(connections.size());
+  for (size_t i = 0; i < connections.size(); i++) {
+    descriptors[i].fd = connections[i]->info.socket->socketFD;
+    descriptors[i].events = POLLIN;
+    descriptors[i].revents = 0;
+  }
+
+  int ready = ::poll(descriptors.data(), descriptors.size(), timeout);
+  if (ready <= 0) {
+    return ready < 0 && errno != EINTR ? -1 : 0;
+  }
+
+  char buffer[MAX_MSG_SIZE + 100];
+  std::string frame;
+  int frames = 0;
+
+  // Connections may be closed by callbacks, so they are only deleted once
+  // the loop is over; descriptors[i] still matches connections[i] here
+  isPolling = true;
+  for (size_t i = 0; i < descriptors.size(); i++) {
+    ClientConnection *connection = connections[i];
+    if (descriptors[i].revents == 0 || connection->isClosed) {
+      continue;
+    }
+
+    ssize_t length = connection->info.socket->socketReadInto(buffer);
+    if (length == SOCKET_AGAIN) {
+      continue;
+    }
+    if (length <= 0) {
+      if (events.onDisconnected) {
+        events.onDisconnected(connection);
+      }
+      this->close(connection);
+      continue;
+    }
+
+    connection->info.readBuffer.append(buffer, length);
+    while (!connection->isClosed &&
+           popFrame(connection->info.readBuffer, frame)) {
+      this->handleFrame(connection, frame);
+      frames++;
+    }
+  }
+  isPolling = false;
+
+  for (size_t i = connections.size(); i-- > 0;) {
+    if (connections[i]->isClosed) {
+      remove(connections[i]);
+    }
+  }
+  return frames;
+}
+
+size_t ClientCore::size() { return connections.size(); }
+
+void ClientCore::handleFrame(ClientConnection *connection,
+                             const std::string &frame) {
+  static const std::regex youAre("/youare (.+)");
+  static const std::regex joined("/joined (\\S+) (\\S+)( muted)?");
+  static const std::regex kicked("/kicked (\\S+)");
+  static const std::regex muted("/(un)?muted (\\S+)");
+  static const std::regex message("/msg (\\S+) (.+)");
+
+  SocketWithInfo &info = connection->info;
+  std::smatch match;
+
+  if (frame.empty() || frame[0] != '/') {
+    if (events.onNotice) {
+      events.onNotice(connection, frame);
+    }
+
+  } else if (std::regex_match(frame, match, youAre)) {
+    info.nickname = match[1].str();
+    if (events.onNickname) {
+      events.onNickname(connection, info.nickname.str());
+    }
+
+  } else if (std::regex_match(frame, match, joined)) {
+    Membership &membership = info.memberships[match[1].str()];
+    membership.isAdmin = match[2].str() == "admin";
+    membership.isMuted = match[3].matched;
+    info.channel = match[1].str();
+    info.isAdmin = membership.isAdmin;
+    info.isMuted = membership.isMuted;
+    if (events.onJoined) {
+      events.onJoined(connection, info.channel.str());
+    }
+
+  } else if (std::regex_match(frame, match, kicked)) {
+    info.memberships.erase(match[1].str());
+    if (info.channel == match[1].str()) {
+      info.isAdmin = false;
+      info.isMuted = false;
+      info.channel = "";
+    }
+    if (events.onKicked) {
+      events.onKicked(connection, match[1].str());
+    }
+
+  } else if (std::regex_match(frame, match, muted)) {
+    bool isMuted = !match[1].matched;
+    info.memberships[match[2].str()].isMuted = isMuted;
+    if (info.channel == match[2].str()) {
+      info.isMuted = isMuted;
+    }
+    if (events.onMuted) {
+      events.onMuted(connection, match[2].str(), isMuted);
+    }
+
+  } else if (std::regex_match(frame, match, message)) {
+    if (events.onMessage) {
+      events.onMessage(connection, match[1].str(), match[2].str());
+    }
+  }
+}
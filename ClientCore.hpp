@@ -0,0 +1,84 @@
+#ifndef _CLIENT_CORE_HPP_
+#define _CLIENT_CORE_HPP_
+
+// Default port of the server
+#define DEFAULT_PORT "6697"
+
+// Maximum size of a message
+#define MAX_MSG_SIZE 4096
+
+#include "Socket.hpp"
+#include <bits/stdc++.h>
+
+class ClientCore;
+
+// One connection to a server, owned by a ClientCore
+class ClientConnection {
+  friend class ClientCore;
+
+private:
+  size_t index;
+  bool isClosed = false;
+  ClientConnection(MySocket *socket);
+  ~ClientConnection();
+
+public:
+  // Nickname, channels and roles as last reported by the server; only the
+  // ClientCore updates them
+  SocketWithInfo info;
+  // Free for the application, e.g. to find its own state in callbacks
+  void *userData = nullptr;
+  // Sends one command line, e.g. "/join #channel"
+  void send(std::string command);
+  // Sends text to the active channel, split in MAX_MSG_SIZE pieces
+  void message(std::string text);
+};
+
+// Callbacks of a ClientCore, each one optional. They run on the thread
+// calling ClientCore::poll, after the connection state was updated.
+struct ClientEvents {
+  std::function<void(ClientConnection *, std::string nickname)> onNickname;
+  // Joined channel, or made it the active one again
+  std::function<void(ClientConnection *, std::string channel)> onJoined;
+  std::function<void(ClientConnection *, std::string channel)> onKicked;
+  std::function<void(ClientConnection *, std::string channel, bool isMuted)>
+      onMuted;
+  // Channel message; sender is "nickname@channel"
+  std::function<void(ClientConnection *, std::string sender,
+                     std::string text)>
+      onMessage;
+  // Any other line from the server, such as replies to commands
+  std::function<void(ClientConnection *, std::string text)> onNotice;
+  // The connection is deleted once this returns
+  std::function<void(ClientConnection *)> onDisconnected;
+};
+
+// Client side of the protocol without any user interface: a set of
+// connections driven by one thread through poll(), reporting what the
+// servers say through ClientEvents.
+class ClientCore {
+private:
+  ClientEvents events;
+  std::vector<ClientConnection *> connections;
+  bool isPolling = false;
+  void handleFrame(ClientConnection *connection, const std::string &frame);
+  void remove(ClientConnection *connection);
+
+public:
+  ClientCore(ClientEvents events);
+  ~ClientCore();
+  // Connects to a server and, if askNickname, asks for the nickname it was
+  // given. Returns nullptr on failure, with the getaddrinfo or errno code
+  // in status.
+  ClientConnection *connect(std::string address, std::string port,
+                            int &status, bool askNickname = true);
+  // Closes and deletes connection, now or, from a callback, once poll is
+  // done with it
+  void close(ClientConnection *connection);
+  // Waits up to timeout ms for input, then handles every complete frame.
+  // Returns the number of frames handled, or -1 if waiting failed.
+  int poll(int timeout);
+  size_t size();
+};
+
+#endif
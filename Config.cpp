@@ -0,0 +1,202 @@
+#include "Config.hpp"
+#include "Affinity.hpp"
+#include <errno.h>
+#include <fstream>
+#include <stdlib.h>
+#include <string.h>
+
+static int parseSize(std::string value, size_t &out) {
+  if (value.empty() || value[0] == '-') {
+    return -1;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+
+  if (errno != 0 || *end != '\0') {
+    return -1;
+  }
+  out = (size_t)parsed;
+  return 0;
+}
+
+int ServerConfig::set(std::string key, std::string value) {
+  if (key == "fanout-threshold") {
+    return parseSize(value, fanoutThreshold);
+  }
+  if (key == "fanout-chunk-size") {
+    return parseSize(value, fanoutChunkSize) != 0 || fanoutChunkSize == 0
+               ? -1
+               : 0;
+  }
+  if (key == "fanout-workers") {
+    return parseSize(value, fanoutWorkers);
+  }
+  if (key == "history-depth") {
+    return parseSize(value, historyDepth);
+  }
+  if (key == "message-log-dir") {
+    messageLogDir = value;
+    return 0;
+  }
+  if (key == "message-log-segment-size") {
+    return parseSize(value, messageLogSegmentSize);
+  }
+  if (key == "message-log-index-interval") {
+    return parseSize(value, messageLogIndexInterval);
+  }
+  if (key == "handoff-socket") {
+    handoffSocket = value;
+    return 0;
+  }
+  if (key == "takeover") {
+    takeover = value;
+    return 0;
+  }
+  if (key == "snapshot-file") {
+    snapshotFile = value;
+    return 0;
+  }
+  if (key == "capture-file") {
+    captureFile = value;
+    return 0;
+  }
+  if (key == "message-rate") {
+    return parseSize(value, messageRate);
+  }
+  if (key == "message-burst") {
+    return parseSize(value, messageBurst);
+  }
+  if (key == "command-rate") {
+    return parseSize(value, commandRate);
+  }
+  if (key == "command-burst") {
+    return parseSize(value, commandBurst);
+  }
+  if (key == "max-connections") {
+    return parseSize(value, maxConnections);
+  }
+  if (key == "max-connections-per-address") {
+    return parseSize(value, maxConnectionsPerAddress);
+  }
+  if (key == "outbound-budget") {
+    return parseSize(value, outboundBudget);
+  }
+  if (key == "max-connection-memory") {
+    return parseSize(value, maxConnectionMemory);
+  }
+  if (key == "max-memory") {
+    return parseSize(value, maxMemory);
+  }
+  if (key == "accept-cpus") {
+    return parseCpuList(value, acceptCpus);
+  }
+  if (key == "listen-cpus") {
+    return parseCpuList(value, listenCpus);
+  }
+  if (key == "fanout-cpus") {
+    return parseCpuList(value, fanoutCpus);
+  }
+  if (key == "steer-connections") {
+    size_t enabled;
+    if (parseSize(value, enabled) != 0) {
+      return -1;
+    }
+    steerConnections = enabled != 0;
+    return 0;
+  }
+  if (key == "metrics-port") {
+    return parseSize(value, metricsPort) != 0 || metricsPort > 65535 ? -1
+                                                                      : 0;
+  }
+  if (key == "metrics-socket") {
+    metricsSocket = value;
+    return 0;
+  }
+  if (key == "metrics-top-connections") {
+    return parseSize(value, metricsTopConnections);
+  }
+  if (key == "stall-threshold") {
+    return parseSize(value, stallThreshold);
+  }
+  if (key == "trace-sample") {
+    return parseSize(value, traceSample);
+  }
+  if (key == "trace-file") {
+    traceFile = value;
+    return 0;
+  }
+  if (key == "daemon") {
+    size_t enabled;
+    if (parseSize(value, enabled) != 0) {
+      return -1;
+    }
+    daemon = enabled != 0;
+    return 0;
+  }
+  if (key == "log-file") {
+    logFile = value;
+    return 0;
+  }
+  return -1;
+}
+
+static std::string trim(const std::string &text) {
+  size_t begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+int ServerConfig::load(std::string path, std::string &error) {
+  std::ifstream file(path);
+  if (!file) {
+    error = "Could not read " + path + ": " + strerror(errno);
+    return -1;
+  }
+
+  std::string line;
+  for (size_t number = 1; std::getline(file, line); number++) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    size_t equals = line.find('=');
+    if (equals == std::string::npos ||
+        this->set(trim(line.substr(0, equals)),
+                  trim(line.substr(equals + 1))) != 0) {
+      error = path + ":" + std::to_string(number) + ": Invalid option: " +
+              line;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int ServerConfig::parse(const std::vector<std::string> &args,
+                        std::string &error) {
+  for (auto &arg : args) {
+    size_t equals = arg.find('=');
+
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      error = "Invalid option: " + arg;
+      return -1;
+    }
+
+    std::string key = arg.substr(2, equals - 2);
+    std::string value = arg.substr(equals + 1);
+
+    if (key == "config") {
+      if (this->load(value, error) != 0) {
+        return -1;
+      }
+    } else if (this->set(key, value) != 0) {
+      error = "Invalid option: " + arg;
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef _CONFIG_HPP_
+#define _CONFIG_HPP_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Tunables of the server. Every field can be set by name through set(),
+// which is what the command line of serverMain and config files use.
+struct ServerConfig {
+  // Channels with more members than this are fanned out by the worker pool
+  size_t fanoutThreshold = 1024;
+  // Recipients handed to a fan-out worker per job
+  size_t fanoutChunkSize = 256;
+  // Fan-out worker threads, 0 means one per entry of fanoutCpus or, when
+  // that is empty, one per core
+  size_t fanoutWorkers = 0;
+  // Latest messages kept per channel and replayed to joining clients
+  size_t historyDepth = 50;
+  // Directory of the persistent message log, empty to disable it
+  std::string messageLogDir = "";
+  // Size of each message log segment file
+  size_t messageLogSegmentSize = 64 << 20;
+  // One index entry is kept every this many messages of a channel
+  size_t messageLogIndexInterval = 64;
+  // Unix socket where a new server process can take this one over, empty
+  // to disable hot restart
+  std::string handoffSocket = "";
+  // Unix socket of a running server to take over instead of binding
+  std::string takeover = "";
+  // File keeping a binary snapshot of the channels and clients, restored
+  // at startup; empty to disable it
+  std::string snapshotFile = "";
+  // File recording every read from a client with its time, to be replayed
+  // against any build with replay; empty to disable it
+  std::string captureFile = "";
+  // Messages (/m) a connection may send per second, and in a burst; a rate
+  // of 0 disables the limit
+  size_t messageRate = 5;
+  size_t messageBurst = 10;
+  // Same for every other command
+  size_t commandRate = 5;
+  size_t commandBurst = 20;
+  // Connections accepted at once, overall and per client address; 0 means
+  // no limit
+  size_t maxConnections = 4096;
+  size_t maxConnectionsPerAddress = 64;
+  // Bytes of multicasts waiting for delivery above which channel messages
+  // and new connections are refused; 0 means no limit
+  size_t outboundBudget = 64 << 20;
+  // Bytes a connection may hold (see MemoryCategory) before it is closed,
+  // and bytes all connections may hold before channel messages and new
+  // connections are refused; 0 means no limit
+  size_t maxConnectionMemory = 4 << 20;
+  size_t maxMemory = 0;
+  // CPUs the accept and listen threads may run on, empty to let them float
+  std::vector<int> acceptCpus;
+  std::vector<int> listenCpus;
+  // Fan-out worker i runs on fanoutCpus[i % size], empty for no pinning
+  std::vector<int> fanoutCpus;
+  // Hands the multicasts to a client to the fan-out worker on the CPU that
+  // receives its packets (SO_INCOMING_CPU), or to one on the same node
+  bool steerConnections = false;
+  // Local TCP port and Unix socket serving metrics over HTTP; 0 and empty
+  // to disable them
+  size_t metricsPort = 0;
+  std::string metricsSocket = "";
+  // Connections exported per-connection series, worst consumers first
+  size_t metricsTopConnections = 10;
+  // Milliseconds the listen loop may work without waiting before its stack
+  // and current command are logged; 0 disables the watchdog
+  size_t stallThreshold = 100;
+  // Messages traced out of every this many reads, 0 to disable tracing,
+  // and the file the spans are dumped to
+  size_t traceSample = 0;
+  std::string traceFile = "trace.json";
+  // Runs without the terminal interface, stopped and reloaded by signals
+  bool daemon = false;
+  // File the daemon logs to, appended to and reopened on reload; empty for
+  // stderr
+  std::string logFile = "";
+
+  // Sets the option named key (e.g. "fanout-threshold"). Returns 0 on
+  // success or -1 for an unknown key or malformed value.
+  int set(std::string key, std::string value);
+  // Reads "key = value" lines from the file at path; blank lines and lines
+  // starting with # are skipped. Returns 0 on success or -1 with the cause
+  // in error.
+  int load(std::string path, std::string &error);
+  // Applies --key=value arguments in order; --config=<path> loads a file
+  // at that point, so later arguments override it. Returns 0 on success or
+  // -1 with the cause in error.
+  int parse(const std::vector<std::string> &args, std::string &error);
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "Daemon.hpp"
+#include "util.hpp"
+#include <errno.h>
+#include <string.h>
+
+Daemon::Daemon(std::vector<std::string> args, ServerConfig config) {
+  this->args = args;
+  this->config = config;
+
+  // Threads inherit the mask, so only run() ever sees these signals
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  // A client vanishing mid-write must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  this->openLog();
+  Logger::addSink([this](int level, int64_t time, const std::string &text) {
+    this->log(level, time, text);
+  });
+  Logger::start();
+  setExitHandler([this](std::string message, int code) {
+    Logger::stop();
+    this->log(code == EXIT_SUCCESS ? LOG_LEVEL_INFO : LOG_LEVEL_ERROR,
+              Logger::now(), message);
+    exit(code);
+  });
+}
+
+Daemon::~Daemon() {
+  Logger::stop();
+  Logger::clearSinks();
+  if (logFile != stderr) {
+    fclose(logFile);
+  }
+}
+
+void Daemon::openLog() {
+  if (config.logFile == "") {
+    return;
+  }
+
+  FILE *file = fopen(config.logFile.c_str(), "a");
+  if (file == nullptr) {
+    LOG_ERROR("Could not open log file {}: {}", config.logFile,
+              strerror(errno));
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(logMutex);
+  if (logFile != stderr) {
+    fclose(logFile);
+  }
+  logFile = file;
+  setvbuf(logFile, nullptr, _IOLBF, 0);
+}
+
+void Daemon::log(int level, int64_t time, const std::string &text) {
+  std::string line = Logger::line(level, time, text);
+  std::lock_guard<std::mutex> lock(logMutex);
+  fprintf(logFile, "%s\n", line.c_str());
+}
+
+// Options are parsed again from scratch, so a config file given with
+// --config is read anew; a broken file leaves everything as it was
+void Daemon::reload(Server *server) {
+  ServerConfig reloaded;
+  std::string error;
+
+  if (reloaded.parse(args, error) != 0) {
+    LOG_ERROR("Reload failed: {}", error);
+    return;
+  }
+
+  config = reloaded;
+  this->openLog();
+  server->reload(config);
+}
+
+void Daemon::dumpTrace() {
+  if (Tracer::dump(config.traceFile) != 0) {
+    LOG_ERROR("Could not write trace to {}: {}", config.traceFile,
+              strerror(errno));
+  } else {
+    LOG_INFO("Trace written to {}", config.traceFile);
+  }
+}
+
+// Written straight to the log file: the lines outgrow a logger record
+void Daemon::logStats(Server *server) {
+  this->log(LOG_LEVEL_INFO, Logger::now(), server->stats());
+  for (auto &line : server->connectionReport(10)) {
+    this->log(LOG_LEVEL_INFO, Logger::now(), line);
+  }
+}
+
+int Daemon::run(Server *server) {
+  while (server->isRunning()) {
+    int signal;
+    if (sigwait(&signals, &signal) != 0) {
+      continue;
+    }
+
+    if (signal == SIGHUP) {
+      this->reload(server);
+    } else if (signal == SIGUSR1) {
+      this->dumpTrace();
+    } else if (signal == SIGUSR2) {
+      this->logStats(server);
+    } else {
+      LOG_INFO("Stopping on {}", strsignal(signal));
+      break;
+    }
+  }
+
+  server->shouldBeRunning = false;
+  server->stop();
+  LOG_INFO("Server stopped");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+#ifndef _DAEMON_HPP_
+#define _DAEMON_HPP_
+
+#include "Config.hpp"
+#include "Logger.hpp"
+#include "Server.hpp"
+#include "Trace.hpp"
+#include <signal.h>
+#include <stdio.h>
+
+// Runs the server without a terminal: lines are logged to a file (or
+// stderr) instead of the ncurses window, SIGHUP reloads the configuration
+// and reopens the log file, SIGUSR1 dumps the sampled traces, SIGUSR2 logs
+// what /stats and /connections show and SIGTERM or SIGINT stop the server
+// cleanly.
+class Daemon {
+private:
+  // Arguments the configuration came from, parsed again on reload
+  std::vector<std::string> args;
+  ServerConfig config;
+  sigset_t signals;
+  std::mutex logMutex;
+  FILE *logFile = stderr;
+  void openLog();
+  void log(int level, int64_t time, const std::string &text);
+  void reload(Server *server);
+  void dumpTrace();
+  void logStats(Server *server);
+
+public:
+  // Blocks the handled signals, so it must run before any thread starts,
+  // and starts the logger with the log file as its sink
+  Daemon(std::vector<std::string> args, ServerConfig config);
+  ~Daemon();
+  // Waits for signals until asked to stop, then stops server
+  int run(Server *server);
+};
+
+#endif
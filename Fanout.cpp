@@ -0,0 +1,164 @@
+#include "Fanout.hpp"
+#include "Affinity.hpp"
+#include "Socket.hpp"
+#include "Trace.hpp"
+
+FanoutPool::FanoutPool(size_t workerCount, std::vector<int> cpus) {
+  if (workerCount == 0) {
+    workerCount = cpus.empty()
+                      ? std::max(1u, std::thread::hardware_concurrency())
+                      : cpus.size();
+  }
+  for (size_t i = 0; i < workerCount; i++) {
+    workers.push_back(new Worker());
+    if (!cpus.empty()) {
+      workers[i]->cpu = cpus[i % cpus.size()];
+    }
+  }
+
+  if (cpus.empty()) {
+    return;
+  }
+
+  // Prefer a worker on the same CPU, then spread the CPU's node over the
+  // workers of that node
+  int cpuCount = std::max((int)std::thread::hardware_concurrency(),
+                          *std::max_element(cpus.begin(), cpus.end()) + 1);
+  std::vector<int> workerNodes;
+  for (auto worker : workers) {
+    workerNodes.push_back(cpuNode(worker->cpu));
+  }
+  std::map<int, size_t> nodeTurns;
+  cpuWorkers.assign(cpuCount, -1);
+
+  for (int cpu = 0; cpu < cpuCount; cpu++) {
+    int node = cpuNode(cpu);
+    std::vector<int> sameNode;
+    for (size_t i = 0; i < workers.size() && cpuWorkers[cpu] == -1; i++) {
+      if (workers[i]->cpu == cpu) {
+        cpuWorkers[cpu] = (int)i;
+      } else if (workerNodes[i] == node) {
+        sameNode.push_back((int)i);
+      }
+    }
+    if (cpuWorkers[cpu] == -1 && !sameNode.empty()) {
+      size_t &turn = nodeTurns[node];
+      cpuWorkers[cpu] = sameNode[turn++ % sameNode.size()];
+    }
+  }
+}
+
+FanoutPool::~FanoutPool() {
+  this->stop();
+  for (auto worker : workers) {
+    delete worker;
+  }
+}
+
+void FanoutPool::setBlockedHandler(std::function<void()> handler) {
+  onBlocked = handler;
+}
+
+void FanoutPool::start() {
+  if (shouldBeRunning) {
+    return;
+  }
+  shouldBeRunning = true;
+  for (auto worker : workers) {
+    worker->thread = new std::thread(&FanoutPool::_run, this, worker);
+  }
+}
+
+void FanoutPool::stop() {
+  if (!shouldBeRunning) {
+    return;
+  }
+  shouldBeRunning = false;
+  for (auto worker : workers) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+    }
+    worker->hasJobs.notify_all();
+    worker->thread->join();
+    delete worker->thread;
+    worker->thread = nullptr;
+  }
+}
+
+size_t FanoutPool::size() { return workers.size(); }
+
+size_t FanoutPool::workerFor(SocketWithInfo *recipient) {
+  int cpu = recipient->incomingCpu;
+  if (cpu >= 0 && cpu < (int)cpuWorkers.size() && cpuWorkers[cpu] != -1) {
+    return (size_t)cpuWorkers[cpu];
+  }
+  return (size_t)recipient->socket->socketFD % workers.size();
+}
+
+size_t FanoutPool::outboundBytes(const FanoutJob &job) {
+  size_t bytes = 0;
+  for (auto &frame : job.frames) {
+    bytes += frame->size();
+  }
+  return bytes * job.recipients.size();
+}
+
+void FanoutPool::submit(size_t worker, FanoutJob job) {
+  Worker *target = workers[worker];
+  pending++;
+  pendingOutbound += outboundBytes(job);
+  {
+    std::lock_guard<std::mutex> lock(target->mutex);
+    target->jobs.push_back(std::move(job));
+  }
+  target->hasJobs.notify_one();
+}
+
+size_t FanoutPool::pendingJobs() { return pending; }
+
+size_t FanoutPool::pendingBytes() { return pendingOutbound; }
+
+void FanoutPool::_run(Worker *worker) {
+  Tracer::nameThread("fanout");
+  if (worker->cpu != -1) {
+    pinCurrentThread(std::vector<int>(1, worker->cpu));
+  }
+
+  while (true) {
+    FanoutJob job;
+    {
+      std::unique_lock<std::mutex> lock(worker->mutex);
+      worker->hasJobs.wait(lock, [this, worker]() {
+        return !worker->jobs.empty() || !shouldBeRunning;
+      });
+      if (worker->jobs.empty()) {
+        return;
+      }
+      job = std::move(worker->jobs.front());
+      worker->jobs.pop_front();
+    }
+
+    {
+      TraceContext context(job.trace);
+      TraceSpan span("fanout job");
+      IRC_PROBE1(fanout_job, job.recipients.size());
+      bool isBlocked = false;
+      for (auto recipient : job.recipients) {
+        if (!recipient->isClosed) {
+          recipient->outbound.push(LANE_BULK, job.frames);
+          isBlocked |= !recipient->outbound.flush(recipient->socket);
+        }
+        recipient->unpin();
+      }
+      if (isBlocked && onBlocked) {
+        onBlocked();
+      }
+    }
+
+    if (job.onDone) {
+      job.onDone();
+    }
+    pendingOutbound -= outboundBytes(job);
+    pending--;
+  }
+}
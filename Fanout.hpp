@@ -0,0 +1,60 @@
+#ifndef _FANOUT_HPP_
+#define _FANOUT_HPP_
+
+#include "Socket.hpp"
+#include <bits/stdc++.h>
+
+struct FanoutJob {
+  std::vector<Frame> frames;
+  // Pinned by the submitter, unpinned by the worker once written to
+  std::vector<SocketWithInfo *> recipients;
+  // Trace the job belongs to, 0 if it isn't sampled
+  uint64_t trace = 0;
+  // Called by the worker once every recipient got the frames
+  std::function<void()> onDone;
+};
+
+// Worker threads delivering large multicasts. Each recipient is owned by
+// exactly one worker and every worker runs its jobs in FIFO order, so a
+// recipient receives the frames submitted for it in submission order.
+class FanoutPool {
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::condition_variable hasJobs;
+    std::deque<FanoutJob> jobs;
+    std::thread *thread = nullptr;
+    // CPU the worker is pinned to, -1 if it floats
+    int cpu = -1;
+  };
+  std::vector<Worker *> workers;
+  // Worker owning recipients whose packets arrive on each CPU, -1 if none
+  std::vector<int> cpuWorkers;
+  std::atomic<bool> shouldBeRunning{false};
+  std::atomic<size_t> pending{0};
+  std::atomic<size_t> pendingOutbound{0};
+  std::function<void()> onBlocked;
+  static size_t outboundBytes(const FanoutJob &job);
+  void _run(Worker *worker);
+
+public:
+  // Worker i is pinned to cpus[i % cpus.size()] when cpus isn't empty
+  FanoutPool(size_t workerCount, std::vector<int> cpus = std::vector<int>());
+  ~FanoutPool();
+  // Called by a worker that left frames behind for a full socket, see
+  // OutboundLanes::isBlocked; set before start()
+  void setBlockedHandler(std::function<void()> handler);
+  void start();
+  // Delivers the jobs already submitted, then joins the workers
+  void stop();
+  size_t size();
+  // Worker of a recipient: the one on its incoming CPU or that CPU's node
+  // when known, otherwise chosen by descriptor
+  size_t workerFor(SocketWithInfo *recipient);
+  void submit(size_t worker, FanoutJob job);
+  size_t pendingJobs();
+  // Bytes the submitted jobs still have to write, over all recipients
+  size_t pendingBytes();
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include "History.hpp"
+
+ChannelHistory::ChannelHistory(size_t depth) { slots.resize(depth); }
+
+void ChannelHistory::push(Frame frame) {
+  if (slots.empty()) {
+    return;
+  }
+  slots[next] = std::move(frame);
+  next = (next + 1) % slots.size();
+  count = std::min(count + 1, slots.size());
+  pushes++;
+}
+
+std::vector<const std::string *> ChannelHistory::frames() {
+  std::vector<const std::string *> ordered;
+  if (count == 0) {
+    return ordered;
+  }
+  ordered.reserve(count);
+  size_t first = (next + slots.size() - count) % slots.size();
+  for (size_t i = 0; i < count; i++) {
+    ordered.push_back(slots[(first + i) % slots.size()].get());
+  }
+  return ordered;
+}
+
+std::vector<Frame> ChannelHistory::sharedFrames() {
+  std::vector<Frame> ordered;
+  ordered.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    ordered.push_back(slots[(next + slots.size() - count + i) % slots.size()]);
+  }
+  return ordered;
+}
+
+size_t ChannelHistory::size() { return count; }
+
+uint64_t ChannelHistory::version() { return pushes; }
+
+size_t ChannelHistory::memoryUsage() {
+  size_t bytes = slots.capacity() * sizeof(Frame);
+  for (auto &frame : slots) {
+    if (frame) {
+      bytes += sizeof(std::string) + frame->capacity();
+    }
+  }
+  return bytes;
+}
@@ -0,0 +1,30 @@
+#ifndef _HISTORY_HPP_
+#define _HISTORY_HPP_
+
+#include "Outbound.hpp"
+#include <bits/stdc++.h>
+
+// Fixed-size ring of the latest frames multicast to a channel. The frames
+// are the ones built for fan-out, so keeping them costs no copy. Slots are
+// allocated up front; pushing into a full ring drops the oldest frame.
+class ChannelHistory {
+private:
+  std::vector<Frame> slots;
+  size_t next = 0;
+  size_t count = 0;
+  uint64_t pushes = 0;
+
+public:
+  ChannelHistory(size_t depth);
+  void push(Frame frame);
+  // Frames from oldest to newest
+  std::vector<const std::string *> frames();
+  // The same frames, shared, to queue them for sending
+  std::vector<Frame> sharedFrames();
+  size_t size();
+  // Changes every time a frame is pushed
+  uint64_t version();
+  size_t memoryUsage();
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "HotRestart.hpp"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Descriptors sent per message, below the kernel's SCM_MAX_FD of 253
+#define HANDOFF_DESCRIPTORS_PER_MESSAGE 200
+
+struct HandoffHeader {
+  uint64_t stateSize;
+  uint32_t descriptorCount;
+};
+
+void StateWriter::writeU8(uint8_t value) { data.push_back((char)value); }
+
+void StateWriter::writeU32(uint32_t value) {
+  data.append((const char *)&value, sizeof value);
+}
+
+void StateWriter::writeString(const std::string &value) {
+  writeU32((uint32_t)value.size());
+  data.append(value);
+}
+
+StateReader::StateReader(const std::string &data) : data(data) {}
+
+bool StateReader::take(void *out, size_t length) {
+  if (hasFailed || data.size() - position < length) {
+    hasFailed = true;
+    memset(out, 0, length);
+    return false;
+  }
+  memcpy(out, data.data() + position, length);
+  position += length;
+  return true;
+}
+
+uint8_t StateReader::readU8() {
+  uint8_t value;
+  take(&value, sizeof value);
+  return value;
+}
+
+uint32_t StateReader::readU32() {
+  uint32_t value;
+  take(&value, sizeof value);
+  return value;
+}
+
+std::string StateReader::readString() {
+  uint32_t length = readU32();
+  if (hasFailed || data.size() - position < length) {
+    hasFailed = true;
+    return "";
+  }
+  std::string value = data.substr(position, length);
+  position += length;
+  return value;
+}
+
+bool StateReader::failed() { return hasFailed; }
+
+static int writeAll(int socketFD, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(socketFD, data, length, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += sent;
+    length -= (size_t)sent;
+  }
+  return 0;
+}
+
+static int readAll(int socketFD, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t received = recv(socketFD, data, length, 0);
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    data += received;
+    length -= (size_t)received;
+  }
+  return 0;
+}
+
+int sendHandoff(int socketFD, const std::string &state,
+                const std::vector<int> &descriptors) {
+  HandoffHeader header;
+  memset(&header, 0, sizeof header);
+  header.stateSize = state.size();
+  header.descriptorCount = (uint32_t)descriptors.size();
+
+  if (writeAll(socketFD, (const char *)&header, sizeof header) != 0 ||
+      writeAll(socketFD, state.data(), state.size()) != 0) {
+    return -1;
+  }
+
+  for (size_t first = 0; first < descriptors.size();
+       first += HANDOFF_DESCRIPTORS_PER_MESSAGE) {
+    size_t count = std::min(descriptors.size() - first,
+                            (size_t)HANDOFF_DESCRIPTORS_PER_MESSAGE);
+
+    // Ancillary data needs a byte of regular data to travel with
+    char byte = 0;
+    struct iovec buffer;
+    buffer.iov_base = &byte;
+    buffer.iov_len = 1;
+
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+    struct msghdr message;
+    memset(&message, 0, sizeof message);
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(rights), &descriptors[first], count * sizeof(int));
+
+    if (sendmsg(socketFD, &message, MSG_NOSIGNAL) != 1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int receiveHandoff(int socketFD, std::string &state,
+                   std::vector<int> &descriptors) {
+  HandoffHeader header;
+  if (readAll(socketFD, (char *)&header, sizeof header) != 0) {
+    return -1;
+  }
+
+  state.resize(header.stateSize);
+  if (readAll(socketFD, &state[0], state.size()) != 0) {
+    return -1;
+  }
+
+  descriptors.clear();
+  while (descriptors.size() < header.descriptorCount) {
+    char byte;
+    struct iovec buffer;
+    buffer.iov_base = &byte;
+    buffer.iov_len = 1;
+
+    std::vector<char> control(
+        CMSG_SPACE(HANDOFF_DESCRIPTORS_PER_MESSAGE * sizeof(int)));
+    struct msghdr message;
+    memset(&message, 0, sizeof message);
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    if (recvmsg(socketFD, &message, MSG_CMSG_CLOEXEC) != 1 ||
+        (message.msg_flags & MSG_CTRUNC) != 0) {
+      return -1;
+    }
+
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    if (rights == nullptr || rights->cmsg_level != SOL_SOCKET ||
+        rights->cmsg_type != SCM_RIGHTS) {
+      return -1;
+    }
+
+    size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t first = descriptors.size();
+    descriptors.resize(first + count);
+    memcpy(&descriptors[first], CMSG_DATA(rights), count * sizeof(int));
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef _HOT_RESTART_HPP_
+#define _HOT_RESTART_HPP_
+
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Appends fixed-width integers and length-prefixed strings to a buffer
+class StateWriter {
+public:
+  std::string data;
+  void writeU8(uint8_t value);
+  void writeU32(uint32_t value);
+  void writeString(const std::string &value);
+};
+
+// Reads back what StateWriter wrote. Reading past the end yields zeroes and
+// empty strings and makes failed() return true.
+class StateReader {
+private:
+  const std::string &data;
+  size_t position = 0;
+  bool hasFailed = false;
+  bool take(void *out, size_t length);
+
+public:
+  StateReader(const std::string &data);
+  uint8_t readU8();
+  uint32_t readU32();
+  std::string readString();
+  bool failed();
+};
+
+// Sends a serialized server state and the descriptors it refers to over a
+// connected Unix socket. The descriptors travel as SCM_RIGHTS ancillary
+// data, so the receiving process gets its own copies of the very same
+// sockets. Returns 0 on success or -1 on error.
+int sendHandoff(int socketFD, const std::string &state,
+                const std::vector<int> &descriptors);
+
+// Receives what sendHandoff() sent. Returns 0 on success or -1 on error.
+int receiveHandoff(int socketFD, std::string &state,
+                   std::vector<int> &descriptors);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _INLINE_STRING_HPP_
+#define _INLINE_STRING_HPP_
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// Longest nickname and channel name the server accepts
+#define NICKNAME_CAPACITY 50
+#define CHANNEL_NAME_CAPACITY 200
+
+// String of at most Capacity bytes stored in place, with its length and
+// hash computed once when it is assigned. Copies never allocate, and two
+// strings are compared by hash and length before their bytes. Longer text
+// is cut at Capacity and marked as such, so it never equals a name that
+// fits: looking up an overlong name finds nothing.
+template <size_t Capacity> class InlineString {
+  static_assert(Capacity <= UINT16_MAX, "length is stored in 16 bits");
+
+private:
+  uint32_t hashValue;
+  uint16_t length;
+  bool isTruncated;
+  char text[Capacity + 1];
+
+  // 32-bit FNV-1a
+  static uint32_t hashOf(const char *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+public:
+  InlineString() { assign(nullptr, 0); }
+  InlineString(const char *value) { assign(value, strlen(value)); }
+  InlineString(const std::string &value) {
+    assign(value.data(), value.size());
+  }
+
+  void assign(const char *data, size_t size) {
+    isTruncated = size > Capacity;
+    length = (uint16_t)(isTruncated ? Capacity : size);
+    if (length > 0) {
+      memcpy(text, data, length);
+    }
+    text[length] = '\0';
+    hashValue = hashOf(text, length);
+  }
+  static bool fits(size_t size) { return size <= Capacity; }
+
+  const char *data() const { return text; }
+  const char *c_str() const { return text; }
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  uint32_t hash() const { return hashValue; }
+  std::string str() const { return std::string(text, length); }
+
+  bool operator==(const InlineString &other) const {
+    return hashValue == other.hashValue && length == other.length &&
+           isTruncated == other.isTruncated &&
+           memcmp(text, other.text, length) == 0;
+  }
+  bool operator!=(const InlineString &other) const {
+    return !(*this == other);
+  }
+  bool operator==(const char *other) const {
+    return !isTruncated && strlen(other) == length &&
+           memcmp(text, other, length) == 0;
+  }
+  bool operator!=(const char *other) const { return !(*this == other); }
+};
+
+template <size_t Capacity>
+std::string operator+(std::string left, const InlineString<Capacity> &right) {
+  return left.append(right.data(), right.size());
+}
+
+template <size_t Capacity>
+std::string operator+(const InlineString<Capacity> &left,
+                      const std::string &right) {
+  return left.str() + right;
+}
+
+template <size_t Capacity>
+std::string operator+(const InlineString<Capacity> &left, const char *right) {
+  return left.str() + right;
+}
+
+namespace std {
+template <size_t Capacity> struct hash<InlineString<Capacity>> {
+  size_t operator()(const InlineString<Capacity> &value) const {
+    return value.hash();
+  }
+};
+} // namespace std
+
+using Nickname = InlineString<NICKNAME_CAPACITY>;
+using ChannelName = InlineString<CHANNEL_NAME_CAPACITY>;
+
+#endif
@@ -0,0 +1,17 @@
+#include "LineRing.hpp"
+
+LineRing::LineRing(size_t capacity) {
+  slots.resize(std::max((size_t)1, capacity));
+}
+
+void LineRing::push(std::string line) {
+  slots[next] = std::move(line);
+  next = (next + 1) % slots.size();
+  count = std::min(count + 1, slots.size());
+}
+
+size_t LineRing::size() { return count; }
+
+const std::string &LineRing::at(size_t index) {
+  return slots[(next + slots.size() - count + index) % slots.size()];
+}
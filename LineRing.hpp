@@ -0,0 +1,22 @@
+#ifndef _LINE_RING_HPP_
+#define _LINE_RING_HPP_
+
+#include <bits/stdc++.h>
+
+// Fixed number of the latest lines of text. Slots are allocated up front;
+// pushing into a full ring drops the oldest line.
+class LineRing {
+private:
+  std::vector<std::string> slots;
+  size_t next = 0;
+  size_t count = 0;
+
+public:
+  LineRing(size_t capacity);
+  void push(std::string line);
+  size_t size();
+  // Line number index, 0 being the oldest
+  const std::string &at(size_t index);
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "Logger.hpp"
+#include <time.h>
+
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "LogRecord size");
+
+struct Logger::Ring {
+  SpscQueue<LogRecord> records{LOG_RING_SIZE};
+  // Set when the owning thread exits; the ring is freed once drained
+  std::atomic<bool> isOrphaned{false};
+};
+
+// Marks the ring of an exiting thread for the formatter to free
+struct RingOwner {
+  std::atomic<bool> *isOrphaned = nullptr;
+  ~RingOwner() {
+    if (isOrphaned != nullptr) {
+      *isOrphaned = true;
+    }
+  }
+};
+
+std::mutex Logger::ringsMutex;
+std::vector<Logger::Ring *> Logger::rings;
+std::mutex Logger::sinksMutex;
+std::vector<LogSink> Logger::sinks;
+std::atomic<bool> Logger::isRunning{false};
+std::thread *Logger::formatter = nullptr;
+std::atomic<size_t> Logger::droppedRecords{0};
+
+Logger::Ring *Logger::threadRing() {
+  static thread_local Ring *ring = nullptr;
+  static thread_local RingOwner owner;
+
+  if (ring == nullptr) {
+    ring = new Ring();
+    owner.isOrphaned = &ring->isOrphaned;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    rings.push_back(ring);
+  }
+  return ring;
+}
+
+void Logger::push(LogRecord &record) {
+  if (!threadRing()->records.push(record)) {
+    droppedRecords++;
+  }
+}
+
+void Logger::encodeText(LogRecord &record, const char *text, size_t length) {
+  size_t room = LOG_PAYLOAD_SIZE - record.used;
+  if (room < 3) {
+    return;
+  }
+
+  char tag = 's';
+  if (length > room - 3) {
+    length = room - 3;
+    tag = 'S';
+  }
+
+  uint16_t size = length;
+  record.payload[record.used] = tag;
+  memcpy(record.payload + record.used + 1, &size, 2);
+  memcpy(record.payload + record.used + 3, text, length);
+  record.used += 3 + length;
+  record.argumentCount++;
+}
+
+void Logger::encodeNumber(LogRecord &record, char tag, uint64_t value) {
+  if (LOG_PAYLOAD_SIZE - record.used < 9) {
+    return;
+  }
+
+  record.payload[record.used] = tag;
+  memcpy(record.payload + record.used + 1, &value, 8);
+  record.used += 9;
+  record.argumentCount++;
+}
+
+std::string Logger::format(const LogRecord &record) {
+  std::string text;
+  size_t offset = 0;
+  size_t arguments = record.argumentCount;
+
+  for (const char *c = record.format; *c != '\0'; c++) {
+    if (c[0] != '{' || c[1] != '}') {
+      text += *c;
+      continue;
+    }
+    c++;
+
+    if (arguments == 0) {
+      text += "?";
+      continue;
+    }
+    arguments--;
+
+    char tag = record.payload[offset];
+    if (tag == 's' || tag == 'S') {
+      uint16_t length;
+      memcpy(&length, record.payload + offset + 1, 2);
+      text.append(record.payload + offset + 3, length);
+      if (tag == 'S') {
+        text += "...";
+      }
+      offset += 3 + length;
+    } else {
+      uint64_t value;
+      memcpy(&value, record.payload + offset + 1, 8);
+      text += tag == 'i' ? std::to_string((int64_t)value)
+                         : std::to_string(value);
+      offset += 9;
+    }
+  }
+  return text;
+}
+
+const char *Logger::levelName(int level) {
+  switch (level) {
+  case LOG_LEVEL_DEBUG:
+    return "DEBUG";
+  case LOG_LEVEL_INFO:
+    return "INFO";
+  case LOG_LEVEL_WARNING:
+    return "WARNING";
+  default:
+    return "ERROR";
+  }
+}
+
+std::string Logger::line(int level, int64_t time, const std::string &text) {
+  time_t seconds = time / 1000000000;
+  struct tm local;
+  char stamp[32];
+  strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S",
+           localtime_r(&seconds, &local));
+
+  char millis[8];
+  snprintf(millis, sizeof millis, ".%03d",
+           (int)(time / 1000000 % 1000));
+  return std::string(stamp) + millis + " " + levelName(level) + " " + text;
+}
+
+int64_t Logger::now() {
+  struct timespec time;
+  clock_gettime(CLOCK_REALTIME, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+size_t Logger::dropped() { return droppedRecords; }
+
+// Moves every waiting record to the sinks, oldest first. Returns how many
+// there were.
+size_t Logger::drain() {
+  std::vector<LogRecord> batch;
+  LogRecord record;
+
+  {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (size_t i = 0; i < rings.size();) {
+      Ring *ring = rings[i];
+      // Read before popping, so records pushed before the thread exited
+      // are drained before the ring is freed
+      bool isOrphaned = ring->isOrphaned;
+      while (ring->records.pop(record)) {
+        batch.push_back(record);
+      }
+
+      if (isOrphaned) {
+        rings[i] = rings.back();
+        rings.pop_back();
+        delete ring;
+      } else {
+        i++;
+      }
+    }
+  }
+
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const LogRecord &a, const LogRecord &b) {
+                     return a.time < b.time;
+                   });
+
+  std::lock_guard<std::mutex> lock(sinksMutex);
+  for (auto &entry : batch) {
+    std::string text = format(entry);
+    for (auto &sink : sinks) {
+      sink(entry.level, entry.time, text);
+    }
+  }
+  return batch.size();
+}
+
+void Logger::_format() {
+  size_t reportedDrops = 0;
+
+  while (isRunning) {
+    if (drain() == 0) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(LOG_FLUSH_INTERVAL));
+    }
+
+    size_t drops = droppedRecords;
+    if (drops != reportedDrops) {
+      LOG_WARNING("Dropped {} log records, rings were full",
+                  drops - reportedDrops);
+      reportedDrops = drops;
+    }
+  }
+}
+
+void Logger::start() {
+  if (isRunning.exchange(true)) {
+    return;
+  }
+  formatter = new std::thread(&Logger::_format);
+}
+
+void Logger::stop() {
+  if (isRunning.exchange(false)) {
+    formatter->join();
+    delete formatter;
+    formatter = nullptr;
+  }
+  drain();
+}
+
+void Logger::addSink(LogSink sink) {
+  std::lock_guard<std::mutex> lock(sinksMutex);
+  sinks.push_back(sink);
+}
+
+void Logger::clearSinks() {
+  std::lock_guard<std::mutex> lock(sinksMutex);
+  sinks.clear();
+}
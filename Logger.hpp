@@ -0,0 +1,149 @@
+#ifndef _LOGGER_HPP_
+#define _LOGGER_HPP_
+
+#include "InlineString.hpp"
+#include "SpscQueue.hpp"
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+// Calls below this level are removed by the preprocessor, arguments and
+// all; e.g. make LOG_MIN_LEVEL=2 keeps warnings and errors only
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Size of a log record, including up to LOG_PAYLOAD_SIZE bytes of
+// arguments; longer text arguments are cut
+#define LOG_RECORD_SIZE 256
+#define LOG_PAYLOAD_SIZE (LOG_RECORD_SIZE - 24)
+// Records each thread can have waiting for the formatter
+#define LOG_RING_SIZE 1024
+// Nap of the formatter thread, in ms, when every ring is empty
+#define LOG_FLUSH_INTERVAL 5
+
+// A call such as LOG_INFO("{} joined {}", nickname, channel) copies the
+// format pointer and the arguments into a record; the text is only built
+// by the formatter thread
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) Logger::write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) Logger::write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) Logger::write(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) ((void)0)
+#endif
+
+#define LOG_ERROR(...) Logger::write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Binary form of one log call. The format must be a string literal: "{}"
+// in it stands for the next argument, stored in payload as a tag byte
+// followed by a 64-bit integer or a 16-bit length and the text.
+struct LogRecord {
+  int64_t time;
+  const char *format;
+  uint8_t level;
+  uint8_t argumentCount;
+  uint16_t used;
+  uint32_t padding;
+  char payload[LOG_PAYLOAD_SIZE];
+};
+
+// Receives every formatted line, on the formatter thread
+using LogSink =
+    std::function<void(int level, int64_t time, const std::string &text)>;
+
+// Asynchronous logger. Each thread writes records into its own lock-free
+// ring and never waits: when the ring is full the record is dropped and
+// counted. A background thread drains the rings, orders the records by
+// time and hands the text to the sinks.
+class Logger {
+private:
+  struct Ring;
+  static std::mutex ringsMutex;
+  static std::vector<Ring *> rings;
+  static std::mutex sinksMutex;
+  static std::vector<LogSink> sinks;
+  static std::atomic<bool> isRunning;
+  static std::thread *formatter;
+  static std::atomic<size_t> droppedRecords;
+
+  static Ring *threadRing();
+  static void push(LogRecord &record);
+  static void encodeText(LogRecord &record, const char *text, size_t length);
+  static void encodeNumber(LogRecord &record, char tag, uint64_t value);
+  static void encode(LogRecord &record, const std::string &value) {
+    encodeText(record, value.data(), value.size());
+  }
+  static void encode(LogRecord &record, const char *value) {
+    encodeText(record, value, strlen(value));
+  }
+  template <size_t Capacity>
+  static void encode(LogRecord &record, const InlineString<Capacity> &value) {
+    encodeText(record, value.data(), value.size());
+  }
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value &&
+                                 std::is_signed<T>::value>::type
+  encode(LogRecord &record, T value) {
+    encodeNumber(record, 'i', (uint64_t)(int64_t)value);
+  }
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value &&
+                                 std::is_unsigned<T>::value>::type
+  encode(LogRecord &record, T value) {
+    encodeNumber(record, 'u', (uint64_t)value);
+  }
+  static void encodeAll(LogRecord &) {}
+  template <typename T, typename... Rest>
+  static void encodeAll(LogRecord &record, const T &value,
+                        const Rest &...rest) {
+    encode(record, value);
+    encodeAll(record, rest...);
+  }
+  static size_t drain();
+  static void _format();
+
+public:
+  template <typename... Args>
+  static void write(int level, const char *format, const Args &...args) {
+    LogRecord record;
+    record.time = now();
+    record.format = format;
+    record.level = level;
+    record.argumentCount = 0;
+    record.used = 0;
+    encodeAll(record, args...);
+    push(record);
+  }
+  // Starts the formatter thread
+  static void start();
+  // Formats what is left in the rings and stops the formatter thread
+  static void stop();
+  static void addSink(LogSink sink);
+  static void clearSinks();
+  // Text of a record with its arguments in place
+  static std::string format(const LogRecord &record);
+  // "2026-01-31 12:00:00.000 INFO text"
+  static std::string line(int level, int64_t time, const std::string &text);
+  static const char *levelName(int level);
+  // Nanoseconds since the epoch
+  static int64_t now();
+  // Records lost because a ring was full
+  static size_t dropped();
+};
+
+#endif
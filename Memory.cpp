@@ -0,0 +1,89 @@
+#include "Memory.hpp"
+
+std::atomic<size_t> MemoryAccount::totals[MEMORY_CATEGORIES];
+std::atomic<size_t> MemoryAccount::limit{0};
+
+MemoryAccount::MemoryAccount() {
+  for (auto &category : bytes) {
+    category = 0;
+  }
+}
+
+MemoryAccount::~MemoryAccount() {
+  release();
+  set(MEMORY_OUTBOUND, 0);
+}
+
+void MemoryAccount::charge(MemoryCategory category, size_t amount) {
+  bytes[category] += amount;
+  totals[category] += amount;
+  size_t used = totalBytes += amount;
+  size_t max = limit;
+  if (max != 0 && used > max) {
+    isExceeded = true;
+  }
+}
+
+bool MemoryAccount::tryCharge(MemoryCategory category, size_t amount) {
+  size_t max = limit;
+  if (max != 0 && totalBytes + amount > max) {
+    isExceeded = true;
+    return false;
+  }
+  charge(category, amount);
+  return true;
+}
+
+void MemoryAccount::credit(MemoryCategory category, size_t amount) {
+  bytes[category] -= amount;
+  totals[category] -= amount;
+  totalBytes -= amount;
+}
+
+void MemoryAccount::set(MemoryCategory category, size_t amount) {
+  size_t previous = bytes[category].exchange(amount);
+  totals[category] += amount - previous;
+  size_t used = totalBytes += amount - previous;
+  size_t max = limit;
+  if (max != 0 && used > max) {
+    isExceeded = true;
+  }
+}
+
+void MemoryAccount::release() {
+  for (size_t i = 0; i < MEMORY_CATEGORIES; i++) {
+    if (i != MEMORY_OUTBOUND) {
+      set((MemoryCategory)i, 0);
+    }
+  }
+}
+
+size_t MemoryAccount::used(MemoryCategory category) const {
+  return bytes[category];
+}
+
+size_t MemoryAccount::used() const { return totalBytes; }
+
+bool MemoryAccount::exceeded() const { return isExceeded; }
+
+void MemoryAccount::setConnectionLimit(size_t bytes) { limit = bytes; }
+
+size_t MemoryAccount::connectionLimit() { return limit; }
+
+size_t MemoryAccount::total(MemoryCategory category) {
+  return totals[category];
+}
+
+size_t MemoryAccount::total() {
+  size_t sum = 0;
+  for (auto &category : totals) {
+    sum += category;
+  }
+  return sum;
+}
+
+const char *MemoryAccount::categoryName(MemoryCategory category) {
+  static const char *names[MEMORY_CATEGORIES] = {"connection", "read_buffer",
+                                                 "outbound", "memberships"};
+  return names[category];
+}
@@ -0,0 +1,58 @@
+#ifndef _MEMORY_HPP_
+#define _MEMORY_HPP_
+
+#include <bits/stdc++.h>
+
+// What the memory of a connection is spent on
+enum MemoryCategory {
+  // Its own state, names included since they are stored inline
+  MEMORY_CONNECTION,
+  // Received bytes not parsed yet
+  MEMORY_READ_BUFFER,
+  // Frames queued for it, each shared frame (e.g. channel history) counted
+  // once per connection holding it
+  MEMORY_OUTBOUND,
+  // Its memberships and its entries in the channels' member maps
+  MEMORY_MEMBERSHIPS,
+  MEMORY_CATEGORIES
+};
+
+// Bytes held by one connection, by category, kept in step with
+// process-wide totals. Any thread may charge and credit. A connection over
+// the per-connection limit is marked exceeded so its owner can drop it.
+class MemoryAccount {
+private:
+  std::atomic<size_t> bytes[MEMORY_CATEGORIES];
+  std::atomic<size_t> totalBytes{0};
+  std::atomic<bool> isExceeded{false};
+  static std::atomic<size_t> totals[MEMORY_CATEGORIES];
+  static std::atomic<size_t> limit;
+
+public:
+  MemoryAccount();
+  ~MemoryAccount();
+  // Adds bytes; marks the account exceeded if that takes it over the limit
+  void charge(MemoryCategory category, size_t amount);
+  // Adds bytes only if they fit under the limit, otherwise marks the
+  // account exceeded and returns false
+  bool tryCharge(MemoryCategory category, size_t amount);
+  void credit(MemoryCategory category, size_t amount);
+  // Replaces the bytes of a category measured as a whole, e.g. a capacity
+  void set(MemoryCategory category, size_t amount);
+  // Credits everything but MEMORY_OUTBOUND, when the connection goes away.
+  // Queued frames are credited by their OutboundLanes (see close()), which
+  // may still be writing some.
+  void release();
+  size_t used(MemoryCategory category) const;
+  size_t used() const;
+  bool exceeded() const;
+
+  // Bytes per connection, 0 for no limit
+  static void setConnectionLimit(size_t bytes);
+  static size_t connectionLimit();
+  static size_t total(MemoryCategory category);
+  static size_t total();
+  static const char *categoryName(MemoryCategory category);
+};
+
+#endif
@@ -0,0 +1,352 @@
+#include "MessageLog.hpp"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_QUEUE_CAPACITY 65536
+#define LOG_MIN_SEGMENT_SIZE (1 << 20)
+
+static const char SEGMENT_MAGIC[8] = {'I', 'R', 'C', 'L', 'O', 'G', '1', '\0'};
+
+static size_t recordSize(size_t channelLength, size_t nicknameLength,
+                         size_t messageLength) {
+  size_t size = sizeof(LogRecordHeader) + channelLength + nicknameLength +
+                messageLength;
+  return (size + 7) & ~(size_t)7;
+}
+
+static size_t recordSize(const LogRecordHeader *record) {
+  return recordSize(record->channelLength, record->nicknameLength,
+                    record->messageLength);
+}
+
+MessageLog::MessageLog(std::string directory, size_t segmentSize,
+                       size_t indexInterval)
+    : queue(LOG_QUEUE_CAPACITY) {
+  this->directory = directory;
+  this->segmentSize = std::max(segmentSize, (size_t)LOG_MIN_SEGMENT_SIZE);
+  this->indexInterval = std::max(indexInterval, (size_t)1);
+}
+
+MessageLog::~MessageLog() { this->close(); }
+
+std::string MessageLog::segmentPath(uint64_t firstSequence) {
+  char name[32];
+  snprintf(name, sizeof name, "%020llu.seg", (unsigned long long)firstSequence);
+  return directory + "/" + name;
+}
+
+int MessageLog::openSegment(std::string path, uint64_t firstSequence,
+                            bool create) {
+  int fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR,
+                  0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  size_t size = segmentSize;
+  struct stat info;
+
+  if (create ? ftruncate(fd, (off_t)size) == -1 : fstat(fd, &info) == -1) {
+    ::close(fd);
+    return -1;
+  }
+  if (!create) {
+    size = (size_t)info.st_size;
+  }
+  if (size < sizeof(LogSegmentHeader)) {
+    ::close(fd);
+    return -1;
+  }
+
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    ::close(fd);
+    return -1;
+  }
+
+  Segment *segment = new Segment();
+  segment->path = path;
+  segment->fd = fd;
+  segment->data = (char *)data;
+  segment->size = size;
+
+  LogSegmentHeader *header = segment->header();
+  if (create) {
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof SEGMENT_MAGIC);
+    header->firstSequence = firstSequence;
+    header->used = sizeof(LogSegmentHeader);
+  } else if (memcmp(header->magic, SEGMENT_MAGIC, sizeof SEGMENT_MAGIC) != 0 ||
+             header->used < sizeof(LogSegmentHeader) || header->used > size) {
+    munmap(data, size);
+    ::close(fd);
+    delete segment;
+    return -1;
+  }
+  segment->end = header->used;
+
+  std::lock_guard<std::mutex> lock(indexMutex);
+  segments.push_back(segment);
+  return 0;
+}
+
+// Maps the segments left by a previous run and rebuilds the index from them
+int MessageLog::recoverSegments() {
+  DIR *dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return -1;
+  }
+
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+      names.push_back(name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (auto &name : names) {
+    if (openSegment(directory + "/" + name, 0, false) != 0) {
+      return -1;
+    }
+
+    size_t segmentIndex = segments.size() - 1;
+    Segment *segment = segments.back();
+    size_t end = segment->end;
+    size_t offset = sizeof(LogSegmentHeader);
+
+    while (offset + sizeof(LogRecordHeader) <= end) {
+      const LogRecordHeader *record =
+          (const LogRecordHeader *)(segment->data + offset);
+      if (offset + recordSize(record) > end) {
+        break;
+      }
+      indexRecord(record, (const char *)(record + 1), segmentIndex, offset);
+      nextSequence = record->sequence + 1;
+      lastTimestamp = record->timestamp;
+      offset += recordSize(record);
+    }
+  }
+  return 0;
+}
+
+void MessageLog::indexRecord(const LogRecordHeader *record,
+                             const char *channel, size_t segment,
+                             size_t offset) {
+  std::lock_guard<std::mutex> lock(indexMutex);
+  ChannelIndex &channelIndex =
+      index[std::string(channel, record->channelLength)];
+
+  if (channelIndex.records++ % indexInterval == 0) {
+    IndexEntry entry;
+    entry.sequence = record->sequence;
+    entry.timestamp = record->timestamp;
+    entry.segment = segment;
+    entry.offset = offset;
+    channelIndex.entries.push_back(entry);
+  }
+}
+
+int MessageLog::open() {
+  if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+    return -1;
+  }
+  if (recoverSegments() != 0) {
+    return -1;
+  }
+
+  shouldBeWriting = true;
+  writerThread = new std::thread(&MessageLog::_write, this);
+  return 0;
+}
+
+void MessageLog::close() {
+  if (writerThread != nullptr) {
+    shouldBeWriting = false;
+    writerThread->join();
+    delete writerThread;
+    writerThread = nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(indexMutex);
+  for (auto segment : segments) {
+    msync(segment->data, segment->end, MS_SYNC);
+    munmap(segment->data, segment->size);
+    ::close(segment->fd);
+    delete segment;
+  }
+  segments.clear();
+  index.clear();
+  nextSequence = 1;
+  lastTimestamp = 0;
+}
+
+bool MessageLog::append(std::string channel, std::string nickname,
+                        std::string message) {
+  Entry entry;
+  entry.timestamp = (uint64_t)std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+  entry.channel = std::move(channel);
+  entry.nickname = std::move(nickname);
+  entry.message = std::move(message);
+
+  if (!queue.push(std::move(entry))) {
+    dropped++;
+    return false;
+  }
+  return true;
+}
+
+// Copies one entry into the last segment, starting a new one when full.
+// Only the writer thread calls this, so it reads segments without locking.
+void MessageLog::write(Entry &entry) {
+  size_t size = recordSize(entry.channel.size(), entry.nickname.size(),
+                           entry.message.size());
+  Segment *current = segments.empty() ? nullptr : segments.back();
+
+  if (current == nullptr || current->end + size > current->size) {
+    if (sizeof(LogSegmentHeader) + size > segmentSize ||
+        openSegment(segmentPath(nextSequence), nextSequence, true) != 0) {
+      dropped++;
+      return;
+    }
+    if (current != nullptr) {
+      msync(current->data, current->end, MS_ASYNC);
+    }
+    current = segments.back();
+  }
+
+  size_t offset = current->end;
+  LogRecordHeader *record = (LogRecordHeader *)(current->data + offset);
+  record->sequence = nextSequence++;
+  record->timestamp = lastTimestamp = std::max(lastTimestamp, entry.timestamp);
+  record->channelLength = (uint32_t)entry.channel.size();
+  record->nicknameLength = (uint32_t)entry.nickname.size();
+  record->messageLength = (uint32_t)entry.message.size();
+  record->padding = 0;
+
+  char *body = (char *)(record + 1);
+  memcpy(body, entry.channel.data(), entry.channel.size());
+  body += entry.channel.size();
+  memcpy(body, entry.nickname.data(), entry.nickname.size());
+  body += entry.nickname.size();
+  memcpy(body, entry.message.data(), entry.message.size());
+
+  current->header()->used = offset + size;
+  current->end.store(offset + size, std::memory_order_release);
+
+  indexRecord(record, (const char *)(record + 1), segments.size() - 1, offset);
+}
+
+void MessageLog::_write() {
+  Entry entry;
+  while (true) {
+    bool wrote = false;
+    while (queue.pop(entry)) {
+      write(entry);
+      wrote = true;
+    }
+
+    if (wrote) {
+      if (!segments.empty()) {
+        msync(segments.back()->data, segments.back()->end, MS_ASYNC);
+      }
+    } else if (!shouldBeWriting) {
+      return;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+size_t
+MessageLog::scan(std::string channel, bool bySequence, uint64_t from,
+                 uint64_t to,
+                 const std::function<void(const LogRecordView &)> &visit) {
+  std::vector<Segment *> snapshot;
+  size_t startSegment;
+  size_t startOffset;
+  {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto channelIndex = index.find(channel);
+    if (channelIndex == index.end()) {
+      return 0;
+    }
+    snapshot = segments;
+
+    // Start at the last indexed record not after from, or at the first
+    // record of the channel
+    auto &entries = channelIndex->second.entries;
+    auto entry = std::upper_bound(
+        entries.begin(), entries.end(), from,
+        [bySequence](uint64_t key, const IndexEntry &indexEntry) {
+          return key < (bySequence ? indexEntry.sequence
+                                   : indexEntry.timestamp);
+        });
+    if (entry != entries.begin()) {
+      entry--;
+    }
+    startSegment = entry->segment;
+    startOffset = entry->offset;
+  }
+
+  size_t visited = 0;
+  for (size_t i = startSegment; i < snapshot.size(); i++) {
+    Segment *segment = snapshot[i];
+    size_t end = segment->end.load(std::memory_order_acquire);
+    size_t offset = i == startSegment ? startOffset : sizeof(LogSegmentHeader);
+
+    while (offset < end) {
+      const LogRecordHeader *record =
+          (const LogRecordHeader *)(segment->data + offset);
+      uint64_t key = bySequence ? record->sequence : record->timestamp;
+
+      if (key > to) {
+        return visited;
+      }
+
+      const char *body = (const char *)(record + 1);
+      if (key >= from && record->channelLength == channel.size() &&
+          memcmp(body, channel.data(), channel.size()) == 0) {
+        LogRecordView view;
+        view.sequence = record->sequence;
+        view.timestamp = record->timestamp;
+        view.channel = body;
+        view.channelLength = record->channelLength;
+        view.nickname = body + record->channelLength;
+        view.nicknameLength = record->nicknameLength;
+        view.message = view.nickname + record->nicknameLength;
+        view.messageLength = record->messageLength;
+        visit(view);
+        visited++;
+      }
+      offset += recordSize(record);
+    }
+  }
+  return visited;
+}
+
+size_t MessageLog::readSequences(
+    std::string channel, uint64_t from, uint64_t to,
+    const std::function<void(const LogRecordView &)> &visit) {
+  return scan(channel, true, from, to, visit);
+}
+
+size_t
+MessageLog::readTimes(std::string channel, uint64_t from, uint64_t to,
+                      const std::function<void(const LogRecordView &)> &visit) {
+  return scan(channel, false, from, to, visit);
+}
+
+size_t MessageLog::droppedRecords() { return dropped; }
+
+size_t MessageLog::queuedRecords() { return queue.size(); }
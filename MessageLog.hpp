@@ -0,0 +1,124 @@
+#ifndef _MESSAGE_LOG_HPP_
+#define _MESSAGE_LOG_HPP_
+
+#include "SpscQueue.hpp"
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Header at the start of every segment file
+struct LogSegmentHeader {
+  char magic[8];
+  uint64_t firstSequence;
+  // Bytes of the file in use, header included
+  uint64_t used;
+};
+
+// Header of every record; channel, nickname and message bytes follow it and
+// the record is padded to a multiple of 8 bytes
+struct LogRecordHeader {
+  uint64_t sequence;
+  // Nanoseconds since the Unix epoch
+  uint64_t timestamp;
+  uint32_t channelLength;
+  uint32_t nicknameLength;
+  uint32_t messageLength;
+  uint32_t padding;
+};
+
+// A record as seen by readers; every pointer refers to the mapped segment
+struct LogRecordView {
+  uint64_t sequence;
+  uint64_t timestamp;
+  const char *channel;
+  size_t channelLength;
+  const char *nickname;
+  size_t nicknameLength;
+  const char *message;
+  size_t messageLength;
+};
+
+// Append-only log of channel messages, split in fixed-size segment files
+// under one directory. append() only pushes to a lock-free queue; a
+// background thread copies the records into the mmap'ed segments and keeps
+// a sparse per-channel index used to start range reads near their target.
+class MessageLog {
+private:
+  struct Entry {
+    uint64_t timestamp;
+    std::string channel;
+    std::string nickname;
+    std::string message;
+  };
+
+  struct Segment {
+    std::string path;
+    int fd;
+    char *data;
+    size_t size;
+    // Mirror of header->used that readers may load concurrently
+    std::atomic<size_t> end{0};
+    LogSegmentHeader *header() { return (LogSegmentHeader *)data; }
+  };
+
+  // Every indexInterval-th record of a channel gets one of these
+  struct IndexEntry {
+    uint64_t sequence;
+    uint64_t timestamp;
+    size_t segment;
+    size_t offset;
+  };
+
+  struct ChannelIndex {
+    uint64_t records = 0;
+    std::vector<IndexEntry> entries;
+  };
+
+  std::string directory;
+  size_t segmentSize;
+  size_t indexInterval;
+  SpscQueue<Entry> queue;
+  std::thread *writerThread = nullptr;
+  std::atomic<bool> shouldBeWriting{false};
+  std::atomic<size_t> dropped{0};
+  uint64_t nextSequence = 1;
+  uint64_t lastTimestamp = 0;
+
+  // Guards segments and index; held by the writer only while publishing
+  std::mutex indexMutex;
+  std::vector<Segment *> segments;
+  std::unordered_map<std::string, ChannelIndex> index;
+
+  std::string segmentPath(uint64_t firstSequence);
+  int openSegment(std::string path, uint64_t firstSequence, bool create);
+  int recoverSegments();
+  void indexRecord(const LogRecordHeader *record, const char *channel,
+                   size_t segment, size_t offset);
+  void write(Entry &entry);
+  void _write();
+  size_t scan(std::string channel, bool bySequence, uint64_t from,
+              uint64_t to,
+              const std::function<void(const LogRecordView &)> &visit);
+
+public:
+  MessageLog(std::string directory, size_t segmentSize, size_t indexInterval);
+  ~MessageLog();
+  // Maps the existing segments and starts the writer. Returns 0 on
+  // success or -1 if the directory or a segment can't be used.
+  int open();
+  // Drains the queue, stops the writer and syncs and unmaps the segments.
+  // The log can be opened again afterwards.
+  void close();
+  // Never blocks; returns false and counts a drop when the queue is full
+  bool append(std::string channel, std::string nickname, std::string message);
+  // Visits the records of channel with a sequence number (or timestamp) in
+  // [from, to], oldest first. Returns the number of records visited. The
+  // views are valid until the log is closed.
+  size_t readSequences(std::string channel, uint64_t from, uint64_t to,
+                       const std::function<void(const LogRecordView &)> &visit);
+  size_t readTimes(std::string channel, uint64_t from, uint64_t to,
+                   const std::function<void(const LogRecordView &)> &visit);
+  size_t droppedRecords();
+  size_t queuedRecords();
+};
+
+#endif
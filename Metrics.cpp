@@ -0,0 +1,474 @@
+#include "Metrics.hpp"
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Metrics::Shard {
+  std::atomic<uint64_t> counters[METRIC_COUNTERS];
+  std::atomic<uint64_t> buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+  std::atomic<uint64_t> sums[METRIC_HISTOGRAMS];
+
+  Shard() {
+    for (auto &counter : counters) {
+      counter = 0;
+    }
+    for (auto &histogram : buckets) {
+      for (auto &bucket : histogram) {
+        bucket = 0;
+      }
+    }
+    for (auto &sum : sums) {
+      sum = 0;
+    }
+  }
+};
+
+// Only the owning thread writes a shard, so a relaxed load and store is
+// enough and cheaper than an atomic add
+static inline void add(std::atomic<uint64_t> &value, uint64_t amount) {
+  value.store(value.load(std::memory_order_relaxed) + amount,
+              std::memory_order_relaxed);
+}
+
+// Gives the shard of an exiting thread back for reuse
+struct ShardOwner {
+  std::function<void()> release;
+  ~ShardOwner() {
+    if (release) {
+      release();
+    }
+  }
+};
+
+struct MetricInfo {
+  const char *name;
+  const char *labels;
+  const char *help;
+};
+
+static const MetricInfo counterInfo[METRIC_COUNTERS] = {
+    {"irc_commands_total", "command=\"whoami\"", "Commands handled"},
+    {"irc_commands_total", "command=\"ping\"", "Commands handled"},
+    {"irc_commands_total", "command=\"nickname\"", "Commands handled"},
+    {"irc_commands_total", "command=\"join\"", "Commands handled"},
+    {"irc_commands_total", "command=\"mute\"", "Commands handled"},
+    {"irc_commands_total", "command=\"unmute\"", "Commands handled"},
+    {"irc_commands_total", "command=\"whois\"", "Commands handled"},
+    {"irc_commands_total", "command=\"kick\"", "Commands handled"},
+    {"irc_commands_total", "command=\"m\"", "Commands handled"},
+    {"irc_commands_total", "command=\"unknown\"", "Commands handled"},
+    {"irc_received_bytes_total", "", "Bytes read from clients"},
+    {"irc_sent_bytes_total", "", "Bytes written to clients"},
+    {"irc_connections_accepted_total", "", "Connections accepted"},
+    {"irc_connections_refused_total", "", "Connections refused by limits"},
+    {"irc_connections_closed_total", "", "Connections closed"},
+    {"irc_loop_stalls_total", "", "Listen loop iterations over the threshold"},
+};
+
+struct HistogramInfo {
+  const char *name;
+  const char *help;
+  // Exported value of one recorded unit
+  double scale;
+  // Exported buckets end below the powers of two from 2^minExponent to
+  // 2^maxExponent recorded units
+  int minExponent;
+  int maxExponent;
+};
+
+static const HistogramInfo histogramInfo[METRIC_HISTOGRAMS] = {
+    {"irc_message_latency_seconds",
+     "Time from handling a channel message to writing it to the members",
+     1e-9, 10, 34},
+    {"irc_fanout_recipients", "Members a channel message is delivered to", 1,
+     1, 20},
+    {"irc_loop_lag_seconds", "Time the listen loop works between two waits",
+     1e-9, 10, 34},
+};
+
+std::mutex Metrics::shardsMutex;
+std::vector<Metrics::Shard *> Metrics::shards;
+std::vector<Metrics::Shard *> Metrics::freeShards;
+std::mutex Metrics::gaugesMutex;
+std::vector<Metrics::Gauge> Metrics::gauges;
+std::vector<std::function<void()>> Metrics::collectors;
+
+Metrics::Shard *Metrics::threadShard() {
+  static thread_local Shard *shard = nullptr;
+  static thread_local ShardOwner owner;
+
+  if (shard == nullptr) {
+    std::lock_guard<std::mutex> lock(shardsMutex);
+    if (freeShards.empty()) {
+      shard = new Shard();
+      shards.push_back(shard);
+    } else {
+      shard = freeShards.back();
+      freeShards.pop_back();
+    }
+    Shard *owned = shard;
+    owner.release = [owned]() { releaseShard(owned); };
+  }
+  return shard;
+}
+
+void Metrics::releaseShard(Shard *shard) {
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  freeShards.push_back(shard);
+}
+
+size_t Metrics::bucketOf(uint64_t value) {
+  if (value < (1 << METRIC_SUB_BUCKET_BITS)) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  size_t sub = (value >> (exponent - METRIC_SUB_BUCKET_BITS)) &
+               ((1 << METRIC_SUB_BUCKET_BITS) - 1);
+  size_t bucket =
+      ((exponent - METRIC_SUB_BUCKET_BITS + 1) << METRIC_SUB_BUCKET_BITS) +
+      sub;
+  return std::min(bucket, (size_t)METRIC_BUCKETS - 1);
+}
+
+// First value past bucket
+uint64_t Metrics::bucketLimit(size_t bucket) {
+  bucket++;
+  if (bucket < (1 << METRIC_SUB_BUCKET_BITS)) {
+    return bucket;
+  }
+  int exponent =
+      (bucket >> METRIC_SUB_BUCKET_BITS) + METRIC_SUB_BUCKET_BITS - 1;
+  uint64_t sub = bucket & ((1 << METRIC_SUB_BUCKET_BITS) - 1);
+  return (((uint64_t)1 << METRIC_SUB_BUCKET_BITS) + sub)
+         << (exponent - METRIC_SUB_BUCKET_BITS);
+}
+
+void Metrics::count(MetricCounter counter, uint64_t amount) {
+  add(threadShard()->counters[counter], amount);
+}
+
+void Metrics::record(MetricHistogram histogram, uint64_t value) {
+  Shard *shard = threadShard();
+  add(shard->buckets[histogram][bucketOf(value)], 1);
+  add(shard->sums[histogram], value);
+}
+
+void Metrics::addGauge(std::string name, std::string help,
+                       std::function<double()> read) {
+  addGauges(name, help, [read]() { return GaugeSeries{{"", read()}}; });
+}
+
+void Metrics::addGauges(std::string name, std::string help,
+                        std::function<GaugeSeries()> read) {
+  std::lock_guard<std::mutex> lock(gaugesMutex);
+  Gauge gauge;
+  gauge.name = name;
+  gauge.help = help;
+  gauge.read = read;
+  gauges.push_back(gauge);
+}
+
+void Metrics::addCollector(std::function<void()> collect) {
+  std::lock_guard<std::mutex> lock(gaugesMutex);
+  collectors.push_back(collect);
+}
+
+void Metrics::clearGauges() {
+  std::lock_guard<std::mutex> lock(gaugesMutex);
+  gauges.clear();
+  collectors.clear();
+}
+
+std::string Metrics::labelValue(const std::string &value) {
+  std::string text = "\"";
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      text += '\\';
+    } else if (c == '\n') {
+      text += "\\n";
+      continue;
+    }
+    text += c;
+  }
+  return text + "\"";
+}
+
+uint64_t Metrics::total(MetricCounter counter) {
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  uint64_t total = 0;
+  for (auto shard : shards) {
+    total += shard->counters[counter].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void Metrics::histogram(MetricHistogram histogram,
+                        std::vector<uint64_t> &buckets, uint64_t &sum) {
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  buckets.assign(METRIC_BUCKETS, 0);
+  sum = 0;
+  for (auto shard : shards) {
+    for (size_t i = 0; i < METRIC_BUCKETS; i++) {
+      buckets[i] +=
+          shard->buckets[histogram][i].load(std::memory_order_relaxed);
+    }
+    sum += shard->sums[histogram].load(std::memory_order_relaxed);
+  }
+}
+
+uint64_t Metrics::percentile(MetricHistogram histogram, double fraction) {
+  std::vector<uint64_t> buckets;
+  uint64_t sum;
+  Metrics::histogram(histogram, buckets, sum);
+
+  uint64_t count = 0;
+  for (auto bucket : buckets) {
+    count += bucket;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)std::ceil(fraction * count);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < METRIC_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank && buckets[i] != 0) {
+      return bucketLimit(i);
+    }
+  }
+  return bucketLimit(METRIC_BUCKETS - 1);
+}
+
+static std::string number(double value) {
+  std::ostringstream text;
+  text << value;
+  return text.str();
+}
+
+std::string Metrics::prometheus() {
+  std::string text;
+  const char *previous = "";
+
+  for (size_t i = 0; i < METRIC_COUNTERS; i++) {
+    const MetricInfo &info = counterInfo[i];
+    if (strcmp(info.name, previous) != 0) {
+      text += std::string("# HELP ") + info.name + " " + info.help + "\n";
+      text += std::string("# TYPE ") + info.name + " counter\n";
+      previous = info.name;
+    }
+    text += info.name;
+    if (info.labels[0] != '\0') {
+      text += std::string("{") + info.labels + "}";
+    }
+    text += " " + std::to_string(total((MetricCounter)i)) + "\n";
+  }
+
+  for (size_t i = 0; i < METRIC_HISTOGRAMS; i++) {
+    const HistogramInfo &info = histogramInfo[i];
+    std::vector<uint64_t> buckets;
+    uint64_t sum;
+    histogram((MetricHistogram)i, buckets, sum);
+
+    text += std::string("# HELP ") + info.name + " " + info.help + "\n";
+    text += std::string("# TYPE ") + info.name + " histogram\n";
+
+    // Powers of two are bucket boundaries, so counting up to 2^k - 1
+    // units is exact
+    uint64_t below = 0;
+    size_t bucket = 0;
+    for (int exponent = info.minExponent; exponent <= info.maxExponent;
+         exponent++) {
+      uint64_t limit = (uint64_t)1 << exponent;
+      while (bucket < METRIC_BUCKETS && bucketLimit(bucket) <= limit) {
+        below += buckets[bucket++];
+      }
+      text += std::string(info.name) + "_bucket{le=\"" +
+              number((limit - 1) * info.scale) + "\"} " +
+              std::to_string(below) + "\n";
+    }
+
+    uint64_t count = 0;
+    for (auto value : buckets) {
+      count += value;
+    }
+    text += std::string(info.name) + "_bucket{le=\"+Inf\"} " +
+            std::to_string(count) + "\n";
+    text += std::string(info.name) + "_sum " + number(sum * info.scale) +
+            "\n";
+    text += std::string(info.name) + "_count " + std::to_string(count) + "\n";
+  }
+
+  std::lock_guard<std::mutex> lock(gaugesMutex);
+  for (auto &collect : collectors) {
+    collect();
+  }
+  for (auto &gauge : gauges) {
+    text += "# HELP " + gauge.name + " " + gauge.help + "\n";
+    text += "# TYPE " + gauge.name + " gauge\n";
+    for (auto &series : gauge.read()) {
+      text += gauge.name;
+      if (series.first != "") {
+        text += "{" + series.first + "}";
+      }
+      text += " " + number(series.second) + "\n";
+    }
+  }
+  return text;
+}
+
+int64_t Metrics::now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+MetricsEndpoint::~MetricsEndpoint() { this->stop(); }
+
+int MetricsEndpoint::start(size_t port, std::string socketPath) {
+  if (port != 0) {
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable,
+                   sizeof enable) != 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof address) != 0 ||
+        listen(listener, 8) != 0) {
+      int error = errno;
+      if (listener >= 0) {
+        ::close(listener);
+      }
+      this->stop();
+      errno = error;
+      return -1;
+    }
+    listeners.push_back(listener);
+  }
+
+  if (socketPath != "") {
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(),
+            sizeof address.sun_path - 1);
+    unlink(socketPath.c_str());
+
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof address) != 0 ||
+        listen(listener, 8) != 0) {
+      int error = errno;
+      if (listener >= 0) {
+        ::close(listener);
+      }
+      this->stop();
+      errno = error;
+      return -1;
+    }
+    listeners.push_back(listener);
+    this->socketPath = socketPath;
+  }
+
+  if (!listeners.empty()) {
+    isRunning = true;
+    thread = new std::thread(&MetricsEndpoint::_serve, this);
+  }
+  return 0;
+}
+
+void MetricsEndpoint::stop() {
+  isRunning = false;
+  if (thread != nullptr) {
+    thread->join();
+    delete thread;
+    thread = nullptr;
+  }
+  for (auto listener : listeners) {
+    ::close(listener);
+  }
+  listeners.clear();
+  if (socketPath != "") {
+    unlink(socketPath.c_str());
+    socketPath = "";
+  }
+}
+
+void MetricsEndpoint::_serve() {
+  std::vector<struct pollfd> descriptors(listeners.size());
+  for (size_t i = 0; i < listeners.size(); i++) {
+    descriptors[i].fd = listeners[i];
+    descriptors[i].events = POLLIN;
+  }
+
+  while (isRunning) {
+    if (poll(descriptors.data(), descriptors.size(),
+             METRICS_POLL_INTERVAL) <= 0) {
+      continue;
+    }
+
+    for (auto &descriptor : descriptors) {
+      if (descriptor.revents == 0) {
+        continue;
+      }
+      int connection = accept(descriptor.fd, nullptr, nullptr);
+      if (connection >= 0) {
+        this->respond(connection);
+        ::close(connection);
+      }
+    }
+  }
+}
+
+// Answers one HTTP request. A slow scraper can hold the thread for at most
+// a second, and never the server's own threads.
+void MetricsEndpoint::respond(int connection) {
+  struct timeval timeout = {1, 0};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < 8192) {
+    ssize_t length = recv(connection, buffer, sizeof buffer, 0);
+    if (length <= 0) {
+      return;
+    }
+    request.append(buffer, length);
+  }
+
+  std::string status = "200 OK";
+  std::string body;
+  if (request.compare(0, 13, "GET /metrics ") == 0 ||
+      request.compare(0, 6, "GET / ") == 0) {
+    body = Metrics::prometheus();
+  } else {
+    status = "404 Not Found";
+    body = "Try GET /metrics\n";
+  }
+
+  std::string response = "HTTP/1.0 " + status +
+                         "\r\nContent-Type: text/plain; version=0.0.4"
+                         "\r\nContent-Length: " +
+                         std::to_string(body.size()) + "\r\n\r\n" + body;
+
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t length = send(connection, response.data() + sent,
+                          response.size() - sent, MSG_NOSIGNAL);
+    if (length <= 0) {
+      return;
+    }
+    sent += length;
+  }
+}
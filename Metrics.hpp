@@ -0,0 +1,120 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Histogram buckets: values below 8 get one bucket each, then every power
+// of two is split in 8 buckets, so a bucket is at most 12.5% wide. Values
+// of 2^40 and above all land in the last bucket.
+#define METRIC_SUB_BUCKET_BITS 3
+#define METRIC_BUCKETS                                                         \
+  ((40 - METRIC_SUB_BUCKET_BITS + 1) << METRIC_SUB_BUCKET_BITS)
+// Longest wait of the endpoint thread, in ms, before it checks for stop
+#define METRICS_POLL_INTERVAL 200
+
+// Series of a labeled gauge: label set (e.g. nickname="alice") and value
+using GaugeSeries = std::vector<std::pair<std::string, double>>;
+
+enum MetricCounter {
+  METRIC_COMMAND_WHOAMI,
+  METRIC_COMMAND_PING,
+  METRIC_COMMAND_NICKNAME,
+  METRIC_COMMAND_JOIN,
+  METRIC_COMMAND_MUTE,
+  METRIC_COMMAND_UNMUTE,
+  METRIC_COMMAND_WHOIS,
+  METRIC_COMMAND_KICK,
+  METRIC_COMMAND_MESSAGE,
+  METRIC_COMMAND_UNKNOWN,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_CONNECTIONS_ACCEPTED,
+  METRIC_CONNECTIONS_REFUSED,
+  METRIC_CONNECTIONS_CLOSED,
+  METRIC_LOOP_STALLS,
+  METRIC_COUNTERS
+};
+
+enum MetricHistogram {
+  // Nanoseconds from handling a /m to writing it to the members, once per
+  // direct multicast or fan-out job
+  METRIC_MESSAGE_LATENCY,
+  // Members a channel message is delivered to
+  METRIC_FANOUT_SIZE,
+  // Nanoseconds the listen loop spends working per iteration
+  METRIC_LOOP_LAG,
+  METRIC_HISTOGRAMS
+};
+
+// Process-wide counters and histograms. Every thread records into its own
+// shard with relaxed atomic stores, so recording never locks or contends;
+// reads add the shards up. Gauges are read only when metrics are exported.
+class Metrics {
+private:
+  struct Shard;
+  struct Gauge {
+    std::string name;
+    std::string help;
+    std::function<GaugeSeries()> read;
+  };
+  static std::mutex shardsMutex;
+  static std::vector<Shard *> shards;
+  // Shards of exited threads, reused with their counts by new threads
+  static std::vector<Shard *> freeShards;
+  static std::mutex gaugesMutex;
+  static std::vector<Gauge> gauges;
+  static std::vector<std::function<void()>> collectors;
+
+  static Shard *threadShard();
+  static void releaseShard(Shard *shard);
+  static size_t bucketOf(uint64_t value);
+  static uint64_t bucketLimit(size_t bucket);
+  static void histogram(MetricHistogram histogram,
+                        std::vector<uint64_t> &buckets, uint64_t &sum);
+
+public:
+  static void count(MetricCounter counter, uint64_t amount = 1);
+  static void record(MetricHistogram histogram, uint64_t value);
+  static void addGauge(std::string name, std::string help,
+                       std::function<double()> read);
+  // Gauge with one series per label set, e.g. one per connection
+  static void addGauges(std::string name, std::string help,
+                        std::function<GaugeSeries()> read);
+  // Called once per export before any gauge is read, e.g. to take one
+  // snapshot several gauges share. Runs under the same lock as the gauges.
+  static void addCollector(std::function<void()> collect);
+  // Removes the gauges and the collectors
+  static void clearGauges();
+  // value quoted and escaped as a label value
+  static std::string labelValue(const std::string &value);
+  static uint64_t total(MetricCounter counter);
+  // Smallest value above the given fraction (e.g. 0.99) of the recorded
+  // values, within a bucket's width; 0 if nothing was recorded
+  static uint64_t percentile(MetricHistogram histogram, double fraction);
+  // Everything in the Prometheus text exposition format
+  static std::string prometheus();
+  // Monotonic nanoseconds, for latencies
+  static int64_t now();
+};
+
+// Serves Metrics::prometheus() over HTTP on a local TCP port and/or a Unix
+// socket, from its own thread
+class MetricsEndpoint {
+private:
+  std::vector<int> listeners;
+  std::string socketPath;
+  std::atomic<bool> isRunning{false};
+  std::thread *thread = nullptr;
+  void _serve();
+  void respond(int connection);
+
+public:
+  ~MetricsEndpoint();
+  // Listens on 127.0.0.1:port unless port is 0 and on socketPath unless it
+  // is empty. Returns 0 on success or -1 with errno set.
+  int start(size_t port, std::string socketPath);
+  void stop();
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "Outbound.hpp"
+#include "Metrics.hpp"
+#include "Socket.hpp"
+#include "Trace.hpp"
+
+LaneLatency OutboundLanes::latencies[OUTBOUND_LANES];
+
+static int64_t monotonicNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void raise(std::atomic<uint64_t> &max, uint64_t value) {
+  uint64_t current = max;
+  while (value > current && !max.compare_exchange_weak(current, value)) {
+  }
+}
+
+// Memory a queued frame holds, charged to the connection
+static size_t frameBytes(const Frame &frame) {
+  return sizeof(std::shared_ptr<const std::string>) + sizeof(int64_t) +
+         frame->capacity();
+}
+
+template <typename Frames> static size_t queuedBytes(const Frames &frames) {
+  size_t bytes = 0;
+  for (auto &queued : frames) {
+    bytes += frameBytes(queued.frame);
+  }
+  return bytes;
+}
+
+// Control frames are always queued; bulk frames that would take the
+// connection over its memory limit are dropped and the account is marked
+// exceeded, so the connection gets closed instead of growing. Called
+// under mutex, like credit().
+bool OutboundLanes::charge(OutboundLane lane, size_t bytes) {
+  if (account == nullptr) {
+    return true;
+  }
+  if (lane == LANE_CONTROL) {
+    account->charge(MEMORY_OUTBOUND, bytes);
+    return true;
+  }
+  return account->tryCharge(MEMORY_OUTBOUND, bytes);
+}
+
+// Once closed, the account was settled by close()
+void OutboundLanes::credit(size_t bytes) {
+  if (account != nullptr && !isClosed) {
+    account->credit(MEMORY_OUTBOUND, bytes);
+  }
+}
+
+void OutboundLanes::push(OutboundLane lane, Frame frame) {
+  int64_t now = monotonicNanoseconds();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (isClosed) {
+    return;
+  }
+  if (!charge(lane, frameBytes(frame))) {
+    counters.dropped++;
+    return;
+  }
+  lanes[lane].push_back(Queued{std::move(frame), now});
+  if (++queuedFrames > counters.highWater) {
+    counters.highWater = queuedFrames;
+  }
+}
+
+void OutboundLanes::push(OutboundLane lane, const std::vector<Frame> &frames) {
+  int64_t now = monotonicNanoseconds();
+  size_t bytes = 0;
+  for (auto &frame : frames) {
+    bytes += frameBytes(frame);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (isClosed) {
+    return;
+  }
+  if (!charge(lane, bytes)) {
+    counters.dropped += frames.size();
+    return;
+  }
+  for (auto &frame : frames) {
+    lanes[lane].push_back(Queued{frame, now});
+  }
+  queuedFrames += frames.size();
+  if (queuedFrames > counters.highWater) {
+    counters.highWater = queuedFrames;
+  }
+}
+
+// Called under mutex
+void OutboundLanes::clear() {
+  credit(writingBytes);
+  writingBytes = 0;
+  for (auto &queue : lanes) {
+    credit(queuedBytes(queue));
+    queue.clear();
+  }
+  queuedFrames = 0;
+  unfinishedOffset = 0;
+}
+
+void OutboundLanes::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  clear();
+  isClosed = true;
+}
+
+// Moves the next frames to write into batch: the rest of an unfinished
+// frame if there is one, otherwise every control frame if there are any,
+// otherwise up to OUTBOUND_BULK_BATCH bulk frames. offset is set to the
+// bytes of the first frame already written.
+bool OutboundLanes::takeBatch(std::vector<Queued> &batch, OutboundLane &lane,
+                              size_t &offset) {
+  std::lock_guard<std::mutex> lock(mutex);
+  offset = unfinishedOffset;
+  unfinishedOffset = 0;
+  for (int i = 0; i < OUTBOUND_LANES; i++) {
+    std::deque<Queued> &queue = lanes[i];
+    if (queue.empty() || (offset != 0 && i != unfinishedLane)) {
+      continue;
+    }
+
+    size_t count = offset != 0       ? 1
+                   : i == LANE_CONTROL ? queue.size()
+                                       : std::min(queue.size(),
+                                                  (size_t)OUTBOUND_BULK_BATCH);
+    batch.assign(std::make_move_iterator(queue.begin()),
+                 std::make_move_iterator(queue.begin() + count));
+    queue.erase(queue.begin(), queue.begin() + count);
+    queuedFrames -= count;
+    writingBytes = queuedBytes(batch);
+    lane = (OutboundLane)i;
+    return true;
+  }
+  return false;
+}
+
+// Credits the first written frames of batch and returns the others to
+// the front of lane, offset bytes of the first of them being written
+// already. Returns whether any frame is left to write.
+bool OutboundLanes::finishBatch(std::vector<Queued> &batch, size_t written,
+                                OutboundLane lane, size_t offset) {
+  std::lock_guard<std::mutex> lock(mutex);
+  bool isLeft = written < batch.size() && !isClosed;
+  if (isLeft) {
+    lanes[lane].insert(lanes[lane].begin(),
+                       std::make_move_iterator(batch.begin() + written),
+                       std::make_move_iterator(batch.end()));
+    queuedFrames += batch.size() - written;
+    unfinishedLane = lane;
+    unfinishedOffset = offset;
+  }
+  batch.resize(written);
+  credit(queuedBytes(batch));
+  writingBytes = 0;
+  return isLeft;
+}
+
+bool OutboundLanes::flush(MySocket *socket) {
+  std::vector<Queued> batch;
+  std::vector<const std::string *> messages;
+  OutboundLane lane;
+  size_t offset;
+
+  // A frame pushed right after the writer found the lanes empty, but
+  // before it let go, is picked up by the second pass of the loop
+  while (!isWriting.exchange(true)) {
+    bool filled = false;
+    while (!filled && takeBatch(batch, lane, offset)) {
+      messages.clear();
+      for (auto &queued : batch) {
+        messages.push_back(queued.frame.get());
+      }
+
+      // A dead connection can't take the rest either
+      int64_t started = monotonicNanoseconds();
+      int written;
+      {
+        TraceSpan span("send");
+        written = socket->socketWriteBatch(messages, offset);
+      }
+      IRC_PROBE2(write, socket->socketFD, written);
+      if (written < 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        clear();
+        continue;
+      }
+
+      // Frames written whole, and the bytes written of the next one
+      size_t done = 0;
+      size_t rest = offset + written;
+      while (done < batch.size() && rest >= batch[done].frame->size()) {
+        rest -= batch[done].frame->size();
+        done++;
+      }
+      filled = finishBatch(batch, done, lane, rest);
+
+      LaneLatency &stats = latencies[lane];
+      int64_t sent = monotonicNanoseconds();
+      for (auto &queued : batch) {
+        uint64_t waited = (uint64_t)(started - queued.queuedAt);
+        stats.totalNanoseconds += waited;
+        raise(stats.maxNanoseconds, waited);
+        uint64_t latency = (uint64_t)(sent - queued.queuedAt);
+        counters.totalLatency += latency;
+        raise(counters.maxLatency, latency);
+      }
+      stats.frames += batch.size();
+      Metrics::count(METRIC_BYTES_OUT, written);
+      counters.frames += batch.size();
+      counters.bytes += written;
+    }
+
+    isFull = filled;
+    isWriting = false;
+    if (filled) {
+      return false;
+    }
+    if (size() == 0) {
+      return true;
+    }
+  }
+  return true;
+}
+
+std::string OutboundLanes::pending() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string bytes;
+  bool isUnfinished = unfinishedOffset != 0;
+  if (isUnfinished) {
+    bytes.append(*lanes[unfinishedLane].front().frame, unfinishedOffset,
+                 std::string::npos);
+  }
+  for (int i = 0; i < OUTBOUND_LANES; i++) {
+    auto queued = lanes[i].begin();
+    if (isUnfinished && i == unfinishedLane) {
+      queued++;
+    }
+    for (; queued != lanes[i].end(); queued++) {
+      bytes += *queued->frame;
+    }
+  }
+  return bytes;
+}
+
+size_t OutboundLanes::size() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return queuedFrames;
+}
+
+LaneLatency &OutboundLanes::latency(OutboundLane lane) {
+  return latencies[lane];
+}
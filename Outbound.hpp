@@ -0,0 +1,99 @@
+#ifndef _OUTBOUND_HPP_
+#define _OUTBOUND_HPP_
+
+#include "Memory.hpp"
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// An encoded message, built once and shared by every recipient
+using Frame = std::shared_ptr<const std::string>;
+
+class MySocket;
+
+// Priority classes of outbound frames, most urgent first
+enum OutboundLane { LANE_CONTROL, LANE_BULK, OUTBOUND_LANES };
+
+// Bulk frames written per batch before control frames get another look
+#define OUTBOUND_BULK_BATCH 64
+
+// Time frames of a lane spent queued, over all connections
+struct LaneLatency {
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> totalNanoseconds{0};
+  std::atomic<uint64_t> maxNanoseconds{0};
+};
+
+// Outbound traffic of one connection
+struct OutboundStats {
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> bytes{0};
+  // Most frames queued at once
+  std::atomic<size_t> highWater{0};
+  // Nanoseconds from queueing a frame to the end of its write
+  std::atomic<uint64_t> totalLatency{0};
+  std::atomic<uint64_t> maxLatency{0};
+  // Bulk frames dropped for going over the connection's memory limit
+  std::atomic<uint64_t> dropped{0};
+};
+
+// Outbound frames of one connection, one FIFO per lane. Any thread may
+// push and flush; whichever thread finds the connection idle becomes its
+// only writer and drains every lane, control frames first, while the
+// others just leave their frames behind. Frames of a lane keep their order.
+// On a nonblocking socket the writer stops once the socket is full and the
+// connection is marked blocked; the rest is written by a flush once the
+// socket is writable again.
+class OutboundLanes {
+private:
+  struct Queued {
+    Frame frame;
+    int64_t queuedAt;
+  };
+  std::mutex mutex;
+  std::deque<Queued> lanes[OUTBOUND_LANES];
+  std::atomic<bool> isWriting{false};
+  std::atomic<bool> isFull{false};
+  // Frames in every lane, guarded by mutex
+  size_t queuedFrames = 0;
+  // Bytes of the first frame of unfinishedLane already written, guarded by
+  // mutex. That frame is finished before anything else is written.
+  size_t unfinishedOffset = 0;
+  OutboundLane unfinishedLane = LANE_CONTROL;
+  // Memory of the batch being written, guarded by mutex
+  size_t writingBytes = 0;
+  // Guarded by mutex; see close()
+  bool isClosed = false;
+  OutboundStats counters;
+  MemoryAccount *account = nullptr;
+  static LaneLatency latencies[OUTBOUND_LANES];
+  bool takeBatch(std::vector<Queued> &batch, OutboundLane &lane,
+                 size_t &offset);
+  bool finishBatch(std::vector<Queued> &batch, size_t written,
+                   OutboundLane lane, size_t offset);
+  void clear();
+  bool charge(OutboundLane lane, size_t bytes);
+  void credit(size_t bytes);
+
+public:
+  // Queued frames are charged to account from then on
+  void setAccount(MemoryAccount *account) { this->account = account; }
+  void push(OutboundLane lane, Frame frame);
+  void push(OutboundLane lane, const std::vector<Frame> &frames);
+  // Drops every frame, including the batch being written, and credits
+  // them. Frames pushed afterwards are ignored and the account is left
+  // alone, so the connection's memory can be released.
+  void close();
+  // Writes the queued frames to socket unless another thread already is.
+  // Returns false if the socket filled up with frames left to write.
+  bool flush(MySocket *socket);
+  // Bytes still to write, in the order flush() would write them, starting
+  // with the rest of an unfinished frame. Nothing is dequeued.
+  std::string pending();
+  // The socket filled up: flush again once it is writable
+  bool isBlocked() const { return isFull; }
+  size_t size();
+  const OutboundStats &stats() const { return counters; }
+  static LaneLatency &latency(OutboundLane lane);
+};
+
+#endif
@@ -0,0 +1,34 @@
+#include "RateLimit.hpp"
+#include <algorithm>
+#include <chrono>
+
+int64_t TokenBucket::take(size_t rate, size_t burst, int64_t now) {
+  if (rate == 0) {
+    return 0;
+  }
+
+  int64_t interval = 1000000000LL / (int64_t)rate;
+  int64_t capacity = interval * (int64_t)std::max(burst, (size_t)1);
+  int64_t start = std::max(fullAt, now);
+
+  // Taking a token pushes the time the bucket is full by one interval; it
+  // may not get further than a whole bucket away
+  if (start + interval - now > capacity) {
+    return start + interval - now - capacity;
+  }
+  fullAt = start + interval;
+  return 0;
+}
+
+int64_t (*TokenBucket::clock)() = nullptr;
+
+int64_t TokenBucket::now() {
+  if (clock != nullptr) {
+    return clock();
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void TokenBucket::setClock(int64_t (*clock)()) { TokenBucket::clock = clock; }
@@ -0,0 +1,30 @@
+#ifndef _RATE_LIMIT_HPP_
+#define _RATE_LIMIT_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Classes of input charged to separate buckets of a connection
+enum FloodClass { FLOOD_MESSAGE, FLOOD_COMMAND, FLOOD_CLASSES };
+
+// Token bucket refilled at rate tokens per second and holding at most
+// burst tokens. It is kept as the single time at which the bucket would be
+// full again, so a check is O(1), allocates nothing and needs no lock as
+// long as one thread owns the bucket.
+class TokenBucket {
+private:
+  int64_t fullAt = 0;
+  static int64_t (*clock)();
+
+public:
+  // Takes one token at time now. Returns 0 on success, or the nanoseconds
+  // to wait for the next token. A rate of 0 means no limit.
+  int64_t take(size_t rate, size_t burst, int64_t now);
+  // Monotonic clock in nanoseconds used for now, and by the server to
+  // schedule throttled clients and channel reclamation
+  static int64_t now();
+  // Replaces that clock, e.g. with a virtual one; nullptr restores it
+  static void setClock(int64_t (*clock)());
+};
+
+#endif
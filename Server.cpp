@@ -1,14 +1,35 @@
 #include "Server.hpp"
+#include "Affinity.hpp"
+#include "HotRestart.hpp"
+#include "Logger.hpp"
 #include "Socket.hpp"
-#include "interface.hpp"
+#include "util.hpp"
 #include <bits/stdc++.h>
 #include <regex>
 #include <sys/socket.h>
+#include <unistd.h>
 
-Server::Server(std::string address) {
-  this->clients = std::unordered_map<std::string, SocketWithInfo *>();
-  this->channels = std::unordered_map<std::string, Channel *>();
+Server::Server(std::string address, ServerConfig config) {
   this->address = address;
+  this->config = config;
+  this->fanoutPool = new FanoutPool(config.fanoutWorkers, config.fanoutCpus);
+  this->watchdog.add(&listenWatch);
+
+  int wakeDescriptors[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                 wakeDescriptors) == -1) {
+    safeExitFailure("Error creating wake-up socket: " +
+                        std::string(strerror(errno)),
+                    errno);
+  }
+  this->wakeInfo = new SocketWithInfo(
+      MySocket::fromDescriptor(wakeDescriptors[0]), false);
+  this->wakeDescriptor = wakeDescriptors[1];
+  // Connections a fan-out worker found full are written by the listen
+  // loop once they are writable
+  this->fanoutPool->setBlockedHandler([this]() { this->wake(); });
+  MemoryAccount::setConnectionLimit(config.maxConnectionMemory);
+  Tracer::setSampling(config.traceSample);
   this->socket = new MySocket(AF_INET, SOCK_STREAM, 0);
   int optValue = 1;
   socket->socketSetOpt(SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optValue);
@@ -17,23 +38,416 @@ int Server::init() {
 
   this->clientInfo = new SocketWithInfo(socket, false);
   socket->socketbind(address, DEFAULT_PORT);
+
+  if (config.snapshotFile != "") {
+    SnapshotView view;
+    std::unordered_map<uint32_t, SocketWithInfo *> connections;
+
+    if (view.map(config.snapshotFile) == 0) {
+      restoreSnapshot(view, connections);
+      LOG_INFO("Restored {} channels from {}", channels.size(),
+               config.snapshotFile);
+    }
+    this->openSnapshot();
+  }
+
+  this->start();
+  LOG_INFO("Server started on {}:{}", address, DEFAULT_PORT);
+  LOG_INFO("Waiting for client connection!");
+
+  return 0;
+}
+
+// Starts serving the listening socket and clients of the server process
+// listening on handoffSocket, which exits once they are transferred
+int Server::takeOver(std::string handoffSocket) {
+  MySocket *peer = new MySocket(AF_UNIX, SOCK_STREAM, 0);
+  peer->socketConnect(handoffSocket, "");
+
+  std::string state;
+  std::vector<int> descriptors;
+
+  if (receiveHandoff(peer->socketFD, state, descriptors) != 0 ||
+      restoreState(state, descriptors) != 0) {
+    safeExitFailure("Error taking over server from " + handoffSocket,
+                    EXIT_FAILURE);
+  }
+
+  // The old process keeps the sockets open until this byte arrives
+  peer->socketWrite("1");
+  peer->close();
+  delete peer;
+
+  if (config.snapshotFile != "") {
+    this->openSnapshot();
+  }
+  this->start();
+  LOG_INFO("Took over {} clients and {} channels on {}:{}", clients.size(),
+           channels.size(), address, DEFAULT_PORT);
+
+  return 0;
+}
+
+void Server::start() {
   this->shouldBeRunning = true;
-  GUI::log("Server started on " + address + ":" + DEFAULT_PORT);
-  GUI::log("Waiting for client connection!");
+  this->fanoutPool->start();
+
+  if (config.messageLogDir != "") {
+    if (this->messageLog == nullptr) {
+      this->messageLog =
+          new MessageLog(config.messageLogDir, config.messageLogSegmentSize,
+                         config.messageLogIndexInterval);
+    }
+    if (this->messageLog->open() != 0) {
+      safeExitFailure("Error opening message log in " + config.messageLogDir +
+                          ": " + std::string(strerror(errno)),
+                      EXIT_FAILURE);
+    }
+  }
+
+  // Kept open across a failed hand-off, which would truncate it
+  if (config.captureFile != "" && !capture.isOpen() &&
+      capture.open(config.captureFile, TokenBucket::now()) != 0) {
+    safeExitFailure("Error opening capture file " + config.captureFile +
+                        ": " + std::string(strerror(errno)),
+                    EXIT_FAILURE);
+  }
+
+  this->startMetrics();
   this->acceptClients();
   this->listenClients();
+  watchdog.start(config.stallThreshold);
+
+  if (config.handoffSocket != "" && this->handoffThread == nullptr) {
+    this->shouldBeHandingOff = true;
+    this->handoffThread = new std::thread(&Server::_handoff, this);
+  }
+}
+
+// Waits on config.handoffSocket for a new server process to take over
+void Server::_handoff() {
+  MySocket *listener = new MySocket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(config.handoffSocket.c_str());
+  listener->socketbind(config.handoffSocket, "");
+  listener->socketListen(1);
+  SocketWithInfo listenerInfo(listener, false);
+
+  while (this->shouldBeHandingOff) {
+    std::vector<SocketWithInfo *> reads(1, &listenerInfo);
+
+    if (MySocket::select(&reads, nullptr, nullptr, 1) == 0) {
+      continue;
+    }
+
+    MySocket *peer = listener->accept();
+    this->handOff(peer);
+    peer->close();
+    delete peer;
+  }
+
+  listener->close();
+  unlink(config.handoffSocket.c_str());
+  delete listener;
+}
+
+// Freezes the server, sends its state and sockets to peer and exits once
+// the new process acknowledges them. Sockets are closed without shutdown,
+// so no connection notices the switch. Resumes serving if anything fails.
+void Server::handOff(MySocket *peer) {
+  LOG_INFO("Handing off to a new server process...");
+
+  this->shouldBeAccepting = false;
+  this->shouldBeListening = false;
+  // The new process binds the metrics port and socket
+  metricsEndpoint.stop();
+  watchdog.stop();
+  Metrics::clearGauges();
+  this->acceptThread->join();
+  this->listenThread->join();
+  this->fanoutPool->stop();
+  if (this->messageLog != nullptr) {
+    this->messageLog->close();
+  }
+
+  std::vector<int> descriptors;
+  std::string state = saveState(descriptors);
+  char ack;
+
+  if (state != "" && sendHandoff(peer->socketFD, state, descriptors) == 0 &&
+      recv(peer->socketFD, &ack, 1, MSG_WAITALL) == 1) {
+    capture.close();
+    safeExitFailure("Handed off " + std::to_string(clients.size()) +
+                        " clients, exiting",
+                    EXIT_SUCCESS);
+  }
+
+  LOG_WARNING("Hand-off failed, resuming");
+  // The new process may already have replaced the snapshot file
+  if (config.snapshotFile != "") {
+    this->openSnapshot();
+  } else {
+    snapshot.close();
+  }
+  this->start();
+}
+
+// The state handed to a new process is the snapshot image, built in memory
+// when there is no snapshot file, plus the client slot, unparsed input and
+// unwritten output of every socket in descriptors. Returns "" if no
+// snapshot can be made.
+std::string Server::saveState(std::vector<int> &descriptors) {
+  if (!snapshot.isOpen()) {
+    if (snapshot.create("") != 0) {
+      return "";
+    }
+    this->snapshotAll();
+  }
+  this->snapshotHistories();
+
+  StateWriter writer;
+
+  descriptors.push_back(socket->socketFD);
+  writer.writeU32((uint32_t)clients.size());
+
+  for (auto &entry : clients) {
+    SocketWithInfo *client = entry.second;
+    descriptors.push_back(client->socket->socketFD);
+    writer.writeU32(client->snapshotSlot);
+    writer.writeString(client->readBuffer);
+    writer.writeString(client->outbound.pending());
+  }
+
+  writer.writeString(snapshot.image());
+  return writer.data;
+}
+
+int Server::restoreState(const std::string &state,
+                         const std::vector<int> &descriptors) {
+  StateReader reader(state);
+
+  uint32_t clientCount = reader.readU32();
+  if (reader.failed() || descriptors.size() != (size_t)clientCount + 1) {
+    return -1;
+  }
+
+  this->socket->close();
+  delete this->socket;
+  this->socket = MySocket::fromDescriptor(descriptors[0]);
+  this->clientInfo = new SocketWithInfo(socket, false);
+
+  std::unordered_map<uint32_t, SocketWithInfo *> connections;
+
+  for (uint32_t i = 0; i < clientCount; i++) {
+    SocketWithInfo *client = new SocketWithInfo(
+        MySocket::fromDescriptor(descriptors[i + 1]), true);
+    client->socket->setBlocking(false);
+    uint32_t slot = reader.readU32();
+    client->readBuffer = reader.readString();
+    std::string pending = reader.readString();
+    client->memory.charge(MEMORY_CONNECTION, CONNECTION_STATE_SIZE);
+    client->memory.set(MEMORY_READ_BUFFER, client->readBuffer.capacity());
+    // What the old process didn't get to write, the rest of a frame
+    // first, goes out before anything new
+    if (pending != "") {
+      client->outbound.push(LANE_CONTROL,
+                            std::make_shared<const std::string>(pending));
+      client->outbound.flush(client->socket);
+    }
+    connections[slot] = client;
+    connectionsPerAddress[client->socket->getPeerAddress()]++;
+    if (config.steerConnections) {
+      client->incomingCpu = incomingCpu(client->socket->socketFD);
+    }
+  }
+
+  std::string image = reader.readString();
+  SnapshotView view;
 
+  if (reader.failed() || view.attach(image.data(), image.size()) != 0) {
+    return -1;
+  }
+
+  restoreSnapshot(view, connections);
   return 0;
 }
 
-std::string Server::readMessage(MySocket *client) {
-  std::string message;
-  client->socketRead(message, MAX_MSG_SIZE + 100);
-  return message;
+// Rebuilds the channels with their history, and the clients whose slot has
+// a connection in connections, from a snapshot. Clients without a
+// connection, as after a cold start, are left out.
+void Server::restoreSnapshot(
+    SnapshotView &view,
+    std::unordered_map<uint32_t, SocketWithInfo *> &connections) {
+  const SnapshotHeader *header = view.header();
+  std::vector<Channel *> channelSlots(header->channelSlots, nullptr);
+
+  for (uint32_t slot = 0; slot < header->channelSlots; slot++) {
+    const SnapshotChannel &record = view.channels()[slot];
+    if (!record.inUse) {
+      continue;
+    }
+
+    Channel *channel = new Channel(config.historyDepth);
+    channel->channelName.assign(
+        record.name,
+        std::min(record.nameLength, (uint32_t)SNAPSHOT_CHANNEL_SIZE));
+    channel->admin.assign(
+        record.admin,
+        std::min(record.adminLength, (uint32_t)SNAPSHOT_NICKNAME_SIZE));
+
+    // Frames are stored with their delimiter, back to back
+    size_t length;
+    const char *frame = view.history(record, length);
+    const char *end = frame + length;
+    while (frame < end) {
+      const char *delimiter =
+          (const char *)memchr(frame, FRAME_DELIMITER, end - frame);
+      const char *next = delimiter == nullptr ? end : delimiter + 1;
+      channel->history.push(std::make_shared<const std::string>(frame, next));
+      frame = next;
+    }
+
+    channels[channel->channelName] = channel;
+    channelSlots[slot] = channel;
+  }
+
+  for (auto &connection : connections) {
+    SocketWithInfo *client = connection.second;
+
+    if (connection.first >= header->clientSlots ||
+        !view.clients()[connection.first].inUse) {
+      client->nickname = generateDefaultNickname();
+      clients[client->nickname] = client;
+      continue;
+    }
+
+    const SnapshotClient &record = view.clients()[connection.first];
+    client->nickname.assign(record.nickname,
+                            std::min(record.nicknameLength,
+                                     (uint32_t)SNAPSHOT_NICKNAME_SIZE));
+    if (record.activeChannel < channelSlots.size() &&
+        channelSlots[record.activeChannel] != nullptr) {
+      client->channel = channelSlots[record.activeChannel]->channelName;
+    }
+    clients[client->nickname] = client;
+  }
+
+  for (uint32_t slot = 0; slot < header->membershipSlots; slot++) {
+    const SnapshotMembership &record = view.memberships()[slot];
+    auto connection = connections.find(record.client);
+
+    if (!record.inUse || connection == connections.end() ||
+        record.channel >= channelSlots.size() ||
+        channelSlots[record.channel] == nullptr) {
+      continue;
+    }
+
+    Channel *channel = channelSlots[record.channel];
+    addMembership(connection->second, channel,
+                  (record.flags & SNAPSHOT_ADMIN) != 0);
+    connection->second->memberships[channel->channelName].isMuted =
+        (record.flags & SNAPSHOT_MUTED) != 0;
+  }
+
+  for (auto &connection : connections) {
+    SocketWithInfo *client = connection.second;
+    if (client->memberships.count(client->channel) == 0) {
+      client->channel = "";
+    }
+  }
+
+  // Empty channels resume waiting for reclamation, long enough for their
+  // members to reconnect
+  for (auto &channel : channels) {
+    if (channel.second->refCount == 0) {
+      channel.second->restoredUntil =
+          TokenBucket::now() + (int64_t)CHANNEL_RESTORED_GRACE * 1000000000;
+      acquireChannel(channel.second);
+      releaseChannel(channel.second);
+    }
+  }
+  channelCount = channels.size();
+}
+
+void Server::openSnapshot() {
+  if (snapshot.create(config.snapshotFile) != 0) {
+    safeExitFailure("Error creating snapshot " + config.snapshotFile + ": " +
+                        std::string(strerror(errno)),
+                    EXIT_FAILURE);
+  }
+  this->snapshotAll();
+  snapshot.sync();
+}
+
+// Writes everything into a freshly created snapshot, giving new slots
+void Server::snapshotAll() {
+  for (auto &entry : channels) {
+    Channel *channel = entry.second;
+    channel->snapshotSlot = SNAPSHOT_NONE;
+    snapshotChannel(channel);
+    snapshot.putHistory(channel->snapshotSlot, channel->history.frames());
+    channel->snapshotHistoryVersion = channel->history.version();
+  }
+
+  std::lock_guard<std::mutex> lock(this->clientsMutex);
+
+  for (auto &entry : clients) {
+    SocketWithInfo *client = entry.second;
+    client->snapshotSlot = SNAPSHOT_NONE;
+    snapshotClient(client);
+
+    for (auto &membership : client->memberships) {
+      membership.second.snapshotSlot = SNAPSHOT_NONE;
+      snapshotMembership(client, membership.first);
+    }
+  }
+}
+
+void Server::snapshotClient(SocketWithInfo *client) {
+  uint32_t activeChannel = SNAPSHOT_NONE;
+  if (client->channel != "") {
+    auto channel = channels.find(client->channel);
+    if (channel != channels.end()) {
+      activeChannel = channel->second->snapshotSlot;
+    }
+  }
+  client->snapshotSlot =
+      snapshot.putClient(client->snapshotSlot, client->nickname, activeChannel);
+}
+
+void Server::snapshotChannel(Channel *channel) {
+  channel->snapshotSlot = snapshot.putChannel(
+      channel->snapshotSlot, channel->channelName, channel->admin);
 }
 
+void Server::snapshotMembership(SocketWithInfo *client,
+                                const ChannelName &channelName) {
+  Membership &membership = client->memberships[channelName];
+  membership.snapshotSlot = snapshot.putMembership(
+      membership.snapshotSlot, client->snapshotSlot,
+      channels[channelName]->snapshotSlot,
+      (membership.isAdmin ? SNAPSHOT_ADMIN : 0) |
+          (membership.isMuted ? SNAPSHOT_MUTED : 0));
+}
+
+// Writes the histories that changed since they were last written
+void Server::snapshotHistories() {
+  for (auto &entry : channels) {
+    Channel *channel = entry.second;
+    uint64_t version = channel->history.version();
+
+    if (version != channel->snapshotHistoryVersion) {
+      snapshot.putHistory(channel->snapshotSlot, channel->history.frames());
+      channel->snapshotHistoryVersion = version;
+    }
+  }
+}
+
+// Replies and notices are control traffic: they are written ahead of any
+// channel message still queued for the client
 void Server::sendMessage(std::string message, SocketWithInfo *client) {
-  client->socket->socketWrite(message);
+  client->outbound.push(LANE_CONTROL, std::make_shared<const std::string>(
+                                          message + FRAME_DELIMITER));
+  client->outbound.flush(client->socket);
 }
 
 void Server::messageClient(std::string message, SocketWithInfo *client,
@@ -46,14 +460,97 @@ void Server::messageClient(std::string message, SocketWithInfo *client,
   sendMessage(prefix + message, client);
 }
 
-void Server::multicastMessage(std::string message, std::string channel,
-                              std::string prefix) {
+std::vector<Frame> Server::encodeFrames(std::string message,
+                                        std::string prefix) {
+  std::vector<Frame> frames;
+  while (message.length() > MAX_MSG_SIZE) {
+    frames.push_back(std::make_shared<const std::string>(
+        prefix + message.substr(0, MAX_MSG_SIZE) + FRAME_DELIMITER));
+    message = message.substr(MAX_MSG_SIZE, message.length());
+  }
+  frames.push_back(
+      std::make_shared<const std::string>(prefix + message + FRAME_DELIMITER));
+  return frames;
+}
+
+void Server::multicastMessage(std::string message,
+                              const ChannelName &channel,
+                              std::string prefix, SocketWithInfo *sender,
+                              int64_t handledAt) {
   if (channels.find(channel) == channels.end()) {
     return;
   }
   Channel *channelObj = channels[channel];
+  IRC_PROBE2(multicast, channel.c_str(), channelObj->users.size());
+  std::vector<Frame> frames = encodeFrames(message, prefix);
+
+  for (auto &frame : frames) {
+    channelObj->history.push(frame);
+  }
+
+  // Once a sender has messages in the pool, the following ones go through
+  // it as well so they cannot overtake them
+  if (channelObj->users.size() > config.fanoutThreshold ||
+      (sender != nullptr && sender->pendingFanouts > 0)) {
+    Metrics::record(METRIC_FANOUT_SIZE, channelObj->users.size());
+    parallelFanout(channelObj, frames, sender, handledAt);
+    return;
+  }
+
+  Metrics::record(METRIC_FANOUT_SIZE, channelObj->users.size());
+  TraceSpan span("multicast");
   for (auto client : channelObj->users) {
-    messageClient(message, client.second, prefix);
+    client.second->outbound.push(LANE_BULK, frames);
+    client.second->outbound.flush(client.second->socket);
+  }
+  if (handledAt != 0) {
+    Metrics::record(METRIC_MESSAGE_LATENCY, Metrics::now() - handledAt);
+  }
+}
+
+// Splits the members of a channel by owning worker and hands them to the
+// fan-out pool in chunks of config.fanoutChunkSize. The channel and the
+// sender's ordering stay pinned until every chunk is delivered.
+void Server::parallelFanout(Channel *channel, std::vector<Frame> frames,
+                            SocketWithInfo *sender, int64_t handledAt) {
+  std::vector<std::vector<SocketWithInfo *>> shards(fanoutPool->size());
+  for (auto user : channel->users) {
+    shards[fanoutPool->workerFor(user.second)].push_back(user.second);
+  }
+
+  for (size_t worker = 0; worker < shards.size(); worker++) {
+    auto &shard = shards[worker];
+
+    for (size_t begin = 0; begin < shard.size();
+         begin += config.fanoutChunkSize) {
+      size_t end = std::min(shard.size(), begin + config.fanoutChunkSize);
+
+      FanoutJob job;
+      job.frames = frames;
+      job.recipients.assign(shard.begin() + begin, shard.begin() + end);
+      for (auto recipient : job.recipients) {
+        recipient->pin();
+      }
+      job.trace = Tracer::current();
+
+      acquireChannel(channel);
+      if (sender != nullptr) {
+        sender->pin();
+        sender->pendingFanouts++;
+      }
+      job.onDone = [this, channel, sender, handledAt]() {
+        if (handledAt != 0) {
+          Metrics::record(METRIC_MESSAGE_LATENCY, Metrics::now() - handledAt);
+        }
+        if (sender != nullptr) {
+          sender->pendingFanouts--;
+          sender->unpin();
+        }
+        releaseChannel(channel);
+      };
+
+      fanoutPool->submit(worker, std::move(job));
+    }
   }
 }
 
@@ -61,18 +558,173 @@ int Server::stop() {
   this->shouldBeAccepting = false;
   this->shouldBeListening = false;
   this->shouldBeRunning = false;
+  this->shouldBeHandingOff = false;
+  if (this->handoffThread != nullptr) {
+    this->handoffThread->join();
+  }
   if (this->acceptThread != nullptr) {
     this->acceptThread->join();
   }
   if (this->listenThread != nullptr) {
     this->listenThread->join();
   }
+  metricsEndpoint.stop();
+  Metrics::clearGauges();
+  watchdog.stop();
+  this->fanoutPool->stop();
+  if (this->messageLog != nullptr) {
+    this->messageLog->close();
+  }
+  // Histories are otherwise written at the next reclamation pass
+  this->snapshotHistories();
+  snapshot.sync();
   this->closeClients();
+  capture.close();
   this->socket->close();
   delete this->clientInfo;
   return 0;
 }
 
+void Server::reload(const ServerConfig &config) {
+  std::lock_guard<std::mutex> lock(this->reloadMutex);
+  this->reloadedConfig = config;
+  this->hasReloadedConfig = true;
+}
+
+// Runs on the listen thread, the only one reading these options besides
+// connectionRefusal, which holds clientsMutex
+void Server::applyReloadedConfig() {
+  if (!this->hasReloadedConfig) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> reload(this->reloadMutex);
+  std::lock_guard<std::mutex> lock(this->clientsMutex);
+  config.fanoutThreshold = reloadedConfig.fanoutThreshold;
+  config.fanoutChunkSize = reloadedConfig.fanoutChunkSize;
+  config.messageRate = reloadedConfig.messageRate;
+  config.messageBurst = reloadedConfig.messageBurst;
+  config.commandRate = reloadedConfig.commandRate;
+  config.commandBurst = reloadedConfig.commandBurst;
+  config.maxConnections = reloadedConfig.maxConnections;
+  config.maxConnectionsPerAddress = reloadedConfig.maxConnectionsPerAddress;
+  config.outboundBudget = reloadedConfig.outboundBudget;
+  config.maxConnectionMemory = reloadedConfig.maxConnectionMemory;
+  config.maxMemory = reloadedConfig.maxMemory;
+  MemoryAccount::setConnectionLimit(config.maxConnectionMemory);
+  config.traceSample = reloadedConfig.traceSample;
+  Tracer::setSampling(config.traceSample);
+  this->hasReloadedConfig = false;
+  LOG_INFO("Configuration reloaded");
+}
+
+// Serves metrics when a port or socket is configured. Gauges are sampled at
+// scrape time, off the listen thread.
+void Server::startMetrics() {
+  Metrics::clearGauges();
+  Metrics::addGauge("irc_connections", "Connected clients", [this]() {
+    std::lock_guard<std::mutex> lock(this->clientsMutex);
+    return (double)clients.size();
+  });
+  Metrics::addGauge("irc_channels", "Channels, as of the last reclamation",
+                    [this]() { return (double)channelCount; });
+  Metrics::addGauge(
+      "irc_outbound_queued_frames", "Frames queued for clients",
+      [this]() {
+        std::lock_guard<std::mutex> lock(this->clientsMutex);
+        size_t frames = 0;
+        for (auto &client : clients) {
+          frames += client.second->outbound.size();
+        }
+        return (double)frames;
+      });
+  Metrics::addGauge("irc_fanout_pending_jobs", "Fan-out jobs not yet done",
+                    [this]() { return (double)fanoutPool->pendingJobs(); });
+  Metrics::addGauge(
+      "irc_fanout_pending_bytes", "Bytes fan-out jobs still have to write",
+      [this]() { return (double)fanoutPool->pendingBytes(); });
+  Metrics::addGauges(
+      "irc_client_memory_bytes", "Memory held by clients, by category", []() {
+        GaugeSeries series;
+        for (size_t i = 0; i < MEMORY_CATEGORIES; i++) {
+          MemoryCategory category = (MemoryCategory)i;
+          series.push_back({std::string("category=\"") +
+                                MemoryAccount::categoryName(category) + "\"",
+                            (double)MemoryAccount::total(category)});
+        }
+        return series;
+      });
+  addConnectionGauges();
+  if (messageLog != nullptr) {
+    Metrics::addGauge(
+        "irc_message_log_queued_records", "Messages waiting to be logged",
+        [this]() { return (double)messageLog->queuedRecords(); });
+  }
+
+  if ((config.metricsPort != 0 || config.metricsSocket != "") &&
+      metricsEndpoint.start(config.metricsPort, config.metricsSocket) != 0) {
+    LOG_WARNING("Could not serve metrics: {}", strerror(errno));
+  }
+}
+
+// One series per connection among the worst consumers, labeled by
+// nickname and address. The consumers are ranked once per scrape.
+void Server::addConnectionGauges() {
+  struct ConnectionGauge {
+    const char *name;
+    const char *help;
+    std::function<double(const ConnectionStats &)> value;
+  };
+  static const ConnectionGauge connectionGauges[] = {
+      {"irc_connection_received_bytes", "Bytes read from the connection",
+       [](const ConnectionStats &s) { return (double)s.bytesIn; }},
+      {"irc_connection_received_messages", "Frames read from the connection",
+       [](const ConnectionStats &s) { return (double)s.messagesIn; }},
+      {"irc_connection_sent_bytes", "Bytes written to the connection",
+       [](const ConnectionStats &s) { return (double)s.bytesOut; }},
+      {"irc_connection_sent_messages", "Frames written to the connection",
+       [](const ConnectionStats &s) { return (double)s.messagesOut; }},
+      {"irc_connection_queued_frames", "Frames queued for the connection",
+       [](const ConnectionStats &s) { return (double)s.queued; }},
+      {"irc_connection_queued_frames_high_water",
+       "Most frames ever queued for the connection",
+       [](const ConnectionStats &s) { return (double)s.highWater; }},
+      {"irc_connection_send_latency_mean_seconds",
+       "Mean time from queueing a frame to writing it",
+       [](const ConnectionStats &s) { return s.meanLatency / 1e9; }},
+      {"irc_connection_send_latency_max_seconds",
+       "Longest time from queueing a frame to writing it",
+       [](const ConnectionStats &s) { return s.maxLatency / 1e9; }},
+      {"irc_connection_idle_seconds", "Time since the connection last sent",
+       [](const ConnectionStats &s) { return s.idle / 1e9; }},
+      {"irc_connection_memory_bytes", "Memory held by the connection",
+       [](const ConnectionStats &s) { return (double)s.memory; }}};
+
+  Metrics::addCollector([this]() {
+    scrapedConsumers = worstConsumers(config.metricsTopConnections);
+  });
+  for (auto &gauge : connectionGauges) {
+    auto value = gauge.value;
+    Metrics::addGauges(gauge.name, gauge.help, [this, value]() {
+      GaugeSeries series;
+      for (auto &stats : scrapedConsumers) {
+        series.push_back(
+            {"nickname=" + Metrics::labelValue(stats.nickname) +
+                 ",address=" + Metrics::labelValue(stats.address),
+             value(stats)});
+      }
+      return series;
+    });
+  }
+}
+
+void Server::wake() {
+  char byte = 0;
+  // A full socket already has a wake-up pending
+  ssize_t sent = send(wakeDescriptor, &byte, 1, MSG_DONTWAIT);
+  (void)sent;
+}
+
 void Server::acceptClients() {
   this->shouldBeAccepting = true;
   this->acceptThread = new std::thread(&Server::_accept, this);
@@ -94,24 +746,359 @@ void Server::closeClients() {
   }
 
   for (auto client : clientsToClose) {
+    this->sendMessage("Server is shutting down", client);
     client->socket->close();
   }
 }
 
 void Server::closeClient(SocketWithInfo *client) {
+  {
+    std::lock_guard<std::mutex> lock(this->clientsMutex);
+    clients.erase(client->nickname);
+  }
+  Metrics::count(METRIC_CONNECTIONS_CLOSED);
 
-  clients.erase(client->nickname);
+  while (!client->memberships.empty()) {
+    removeMembership(client, client->memberships.begin()->first);
+  }
+  snapshot.removeClient(client->snapshotSlot);
+  if (client->captureId != 0) {
+    capture.disconnect(client->captureId, TokenBucket::now());
+  }
 
-  if (client->channel != "") {
-    auto clientChannel = channels[client->channel];
-    clientChannel->users.erase(client->nickname);
+  {
+    std::lock_guard<std::mutex> lock(this->clientsMutex);
+    auto connections =
+        connectionsPerAddress.find(client->socket->getPeerAddress());
+    if (connections != connectionsPerAddress.end() &&
+        --connections->second == 0) {
+      connectionsPerAddress.erase(connections);
+    }
   }
 
+  // Queued fan-out jobs may still hold the connection: their writes fail
+  // after the shutdown, and it is deleted once they let go
+  client->isClosed = true;
   client->socket->socketShutdown(SHUT_RDWR);
-  client->socket->close();
+  client->outbound.close();
+  client->memory.release();
+  client->unpin();
+}
+
+Membership *Server::activeMembership(SocketWithInfo *client) {
+  auto membership = client->memberships.find(client->channel);
+  if (membership == client->memberships.end()) {
+    return nullptr;
+  }
+  return &membership->second;
+}
+
+void Server::addMembership(SocketWithInfo *client, Channel *channel,
+                           bool isAdmin) {
+  Membership membership;
+  membership.isAdmin = isAdmin;
+  client->memberships[channel->channelName] = membership;
+  channel->users[client->nickname] = client;
+  acquireChannel(channel);
+  snapshotMembership(client, channel->channelName);
+  accountMemberships(client);
+}
+
+void Server::removeMembership(SocketWithInfo *client,
+                              ChannelName channelName) {
+  bool wasAdmin = false;
+  auto membership = client->memberships.find(channelName);
+  if (membership != client->memberships.end()) {
+    wasAdmin = membership->second.isAdmin;
+    snapshot.removeMembership(membership->second.snapshotSlot);
+    client->memberships.erase(membership);
+  }
+
+  auto channel = channels.find(channelName);
+  if (channel != channels.end()) {
+    channel->second->users.erase(client->nickname);
+    if (wasAdmin) {
+      handOverAdmin(channel->second);
+    }
+    releaseChannel(channel->second);
+  }
+
+  if (client->channel == channelName) {
+    client->channel = client->memberships.empty()
+                          ? ""
+                          : client->memberships.begin()->first;
+    snapshotClient(client);
+  }
+  accountMemberships(client);
+}
+
+// A membership costs its entry in client->memberships plus the client's
+// entry in the channel's member map
+void Server::accountMemberships(SocketWithInfo *client) {
+  size_t memberEntry = sizeof(std::pair<const Nickname, SocketWithInfo *>) +
+                       2 * sizeof(void *);
+  client->memory.set(MEMORY_MEMBERSHIPS,
+                     mapMemoryUsage(client->memberships) +
+                         client->memberships.size() * memberEntry);
+}
+
+void Server::renameMember(SocketWithInfo *client,
+                          const Nickname &newNickname) {
+  for (auto &membership : client->memberships) {
+    Channel *channel = channels[membership.first];
+    channel->users.erase(client->nickname);
+    channel->users[newNickname] = client;
+    if (membership.second.isAdmin) {
+      channel->admin = newNickname;
+      snapshotChannel(channel);
+    }
+  }
+}
+
+// Makes one of the remaining members the admin of channel, or leaves it
+// without one until somebody revives it
+void Server::handOverAdmin(Channel *channel) {
+  channel->admin = "";
+  if (!channel->users.empty()) {
+    SocketWithInfo *member = channel->users.begin()->second;
+    member->memberships[channel->channelName].isAdmin = true;
+    channel->admin = member->nickname;
+    snapshotMembership(member, channel->channelName);
+    if (member->channel == channel->channelName) {
+      sendJoined(member);
+    }
+  }
+  snapshotChannel(channel);
+}
+
+SocketWithInfo *Server::findMember(Channel *channel,
+                                   const Nickname &nickname) {
+  auto member = channel->users.find(nickname);
+  return member == channel->users.end() ? nullptr : member->second;
+}
+
+void Server::acquireChannel(Channel *channel) { channel->refCount++; }
+
+void Server::releaseChannel(Channel *channel) {
+  if (--channel->refCount == 0) {
+    std::lock_guard<std::mutex> lock(this->reclaimMutex);
+    channel->emptySince = TokenBucket::now();
+    if (!channel->isQueuedForReclaim) {
+      channel->isQueuedForReclaim = true;
+      reclaimQueue.push_back(channel);
+    }
+  }
+}
+
+// Deletes channels that stayed unreferenced for CHANNEL_RECLAIM_GRACE and
+// shrinks the maps left sparse by them. Runs on the listen thread, which
+// owns the channels map.
+void Server::reclaimChannels() {
+  int64_t now = TokenBucket::now();
+  if (now - lastReclaim < (int64_t)CHANNEL_RECLAIM_INTERVAL * 1000000000) {
+    return;
+  }
+  lastReclaim = now;
+
+  {
+    std::lock_guard<std::mutex> lock(this->reclaimMutex);
+    std::vector<Channel *> stillEmpty;
+
+    for (auto channel : reclaimQueue) {
+      if (channel->refCount > 0) {
+        channel->isQueuedForReclaim = false;
+        continue;
+      }
+      int64_t until =
+          channel->restoredUntil != 0
+              ? channel->restoredUntil
+              : channel->emptySince +
+                    (int64_t)CHANNEL_RECLAIM_GRACE * 1000000000;
+      if (now < until) {
+        stillEmpty.push_back(channel);
+        continue;
+      }
+      channels.erase(channel->channelName);
+      snapshot.removeChannel(channel->snapshotSlot);
+      delete channel;
+      reclaimedChannels++;
+    }
+
+    reclaimQueue.swap(stillEmpty);
+  }
+
+  shrinkMap(channels);
+
+  size_t bytes = mapMemoryUsage(channels);
+  for (auto &channel : channels) {
+    shrinkMap(channel.second->users);
+    bytes += sizeof(Channel) + mapMemoryUsage(channel.second->users) +
+             channel.second->history.memoryUsage();
+  }
+  channelCount = channels.size();
+  channelBytes = bytes;
+
+  this->snapshotHistories();
+  snapshot.sync();
+
+  std::lock_guard<std::mutex> lock(this->clientsMutex);
+  shrinkMap(clients);
+}
+
+static std::string laneLatency(std::string name, OutboundLane lane) {
+  LaneLatency &latency = OutboundLanes::latency(lane);
+  uint64_t frames = latency.frames;
+  uint64_t average = frames == 0 ? 0 : latency.totalNanoseconds / frames;
+  return ", " + name + " queueing: avg " + std::to_string(average / 1000) +
+         " us, max " + std::to_string(latency.maxNanoseconds / 1000) + " us";
+}
+
+static std::string memoryUsage() {
+  std::string text = ", client memory:";
+  for (size_t i = 0; i < MEMORY_CATEGORIES; i++) {
+    MemoryCategory category = (MemoryCategory)i;
+    text += std::string(" ") + MemoryAccount::categoryName(category) + " " +
+            std::to_string(MemoryAccount::total(category));
+  }
+  return text + " (total " + std::to_string(MemoryAccount::total()) +
+         " bytes)";
+}
+
+static std::string messageLatency() {
+  std::string text = ", message latency p50/p99/p99.9:";
+  for (double fraction : {0.5, 0.99, 0.999}) {
+    text += " " + std::to_string(Metrics::percentile(METRIC_MESSAGE_LATENCY,
+                                                     fraction) /
+                                 1000);
+  }
+  return text + " us";
+}
+
+std::string Server::stats() {
+  return "Channels: " + std::to_string(channelCount) + " (" +
+         std::to_string(channelBytes) + " bytes), reclaimed: " +
+         std::to_string(reclaimedChannels) + ", throttled frames: " +
+         std::to_string(throttledFrames) + ", refused connections: " +
+         std::to_string(refusedConnections) + ", shed messages: " +
+         std::to_string(shedMessages) + ", pending fan-out jobs: " +
+         std::to_string(fanoutPool->pendingJobs()) + " (" +
+         std::to_string(fanoutPool->pendingBytes()) + " bytes)" +
+         laneLatency("control", LANE_CONTROL) + laneLatency("bulk", LANE_BULK) +
+         messageLatency() + memoryUsage() +
+         (messageLog == nullptr
+              ? ""
+              : ", message log queue: " +
+                    std::to_string(messageLog->queuedRecords()) +
+                    ", dropped: " +
+                    std::to_string(messageLog->droppedRecords())) +
+         (!capture.isOpen() ? ""
+                            : ", captured records: " +
+                                  std::to_string(capture.recorded()) +
+                                  ", dropped: " +
+                                  std::to_string(capture.droppedRecords()));
+}
+
+std::vector<ConnectionStats> Server::worstConsumers(size_t count) {
+  std::vector<ConnectionStats> connections;
+  int64_t now = Metrics::now();
+  {
+    std::lock_guard<std::mutex> lock(this->clientsMutex);
+    connections.reserve(clients.size());
+    for (auto &entry : clients) {
+      SocketWithInfo *client = entry.second;
+      const OutboundStats &outbound = client->outbound.stats();
+      ConnectionStats stats;
+      stats.nickname = client->nickname.str();
+      stats.address = client->socket->getPeerAddress();
+      stats.bytesIn = client->bytesIn;
+      stats.messagesIn = client->messagesIn;
+      stats.bytesOut = outbound.bytes;
+      stats.messagesOut = outbound.frames;
+      stats.queued = client->outbound.size();
+      stats.highWater = outbound.highWater;
+      stats.meanLatency = stats.messagesOut == 0
+                              ? 0
+                              : outbound.totalLatency / stats.messagesOut;
+      stats.maxLatency = outbound.maxLatency;
+      stats.idle = now - client->lastActivity;
+      stats.memory = client->memory.used();
+      connections.push_back(stats);
+    }
+  }
+
+  auto isWorse = [](const ConnectionStats &a, const ConnectionStats &b) {
+    if (a.queued != b.queued) {
+      return a.queued > b.queued;
+    }
+    return a.meanLatency > b.meanLatency;
+  };
+  count = std::min(count, connections.size());
+  std::partial_sort(connections.begin(), connections.begin() + count,
+                    connections.end(), isWorse);
+  connections.resize(count);
+  return connections;
+}
+
+std::vector<std::string> Server::connectionReport(size_t count) {
+  std::vector<std::string> lines;
+  for (auto &stats : worstConsumers(count)) {
+    lines.push_back(
+        stats.nickname + " (" + stats.address + "): in " +
+        std::to_string(stats.messagesIn) + " messages/" +
+        std::to_string(stats.bytesIn) + " bytes, out " +
+        std::to_string(stats.messagesOut) + " messages/" +
+        std::to_string(stats.bytesOut) + " bytes, queued " +
+        std::to_string(stats.queued) + " (high-water " +
+        std::to_string(stats.highWater) + "), send latency avg " +
+        std::to_string(stats.meanLatency / 1000) + " us, max " +
+        std::to_string(stats.maxLatency / 1000) + " us, idle " +
+        std::to_string(stats.idle / 1000000000) + " s, memory " +
+        std::to_string(stats.memory) + " bytes");
+  }
+  return lines;
+}
+
+std::vector<std::string> Server::scrollback(std::string channel,
+                                            uint64_t from, uint64_t to) {
+  std::vector<std::string> lines;
+  if (messageLog == nullptr) {
+    return lines;
+  }
+  messageLog->readSequences(
+      channel, from, to, [&lines](const LogRecordView &record) {
+        lines.push_back("#" + std::to_string(record.sequence) + " " +
+                        std::string(record.nickname, record.nicknameLength) +
+                        ": " +
+                        std::string(record.message, record.messageLength));
+      });
+  return lines;
+}
+
+// Queues the channel history as bulk traffic, written in batches
+void Server::replayHistory(SocketWithInfo *client, Channel *channel) {
+  if (channel->history.size() == 0) {
+    return;
+  }
+  client->outbound.push(LANE_BULK, channel->history.sharedFrames());
+  client->outbound.flush(client->socket);
+}
+
+void Server::sendJoined(SocketWithInfo *client) {
+  Membership *membership = activeMembership(client);
+  if (membership == nullptr) {
+    return;
+  }
+  this->sendMessage("/joined " + client->channel + " " +
+                        (membership->isAdmin ? "admin" : "user") +
+                        (membership->isMuted ? " muted" : ""),
+                    client);
 }
 
 void Server::_accept() {
+  Tracer::nameThread("accept");
+  if (pinCurrentThread(config.acceptCpus) != 0) {
+    LOG_WARNING("Could not pin the accept thread: {}", strerror(errno));
+  }
 
   this->socket->socketListen(5);
 
@@ -125,283 +1112,528 @@ void Server::_accept() {
     }
 
     MySocket *client = this->socket->accept();
-    SocketWithInfo *clientWithInfo = new SocketWithInfo(client, true);
-    clientWithInfo->nickname = this->generateDefaultNickname();
-    this->clientsMutex.lock();
-    this->clients[clientWithInfo->nickname] = clientWithInfo;
-    this->clientsMutex.unlock();
-    GUI::log(clientWithInfo->nickname + " connected!");
-    GUI::log("Client count: " + std::to_string((int)this->clients.size()));
+    std::string peerAddress = client->getPeerAddress();
+    std::string refusal = this->connectionRefusal(peerAddress);
+
+    if (refusal != "") {
+      refusedConnections++;
+      Metrics::count(METRIC_CONNECTIONS_REFUSED);
+      client->socketWrite(refusal + FRAME_DELIMITER);
+      client->close();
+      delete client;
+      continue;
+    }
+
+    this->addClient(client);
+  }
+}
+
+SocketWithInfo *Server::addClient(MySocket *connection) {
+  // Writes stop when the socket is full rather than stall their thread
+  connection->setBlocking(false);
+  SocketWithInfo *client = new SocketWithInfo(connection, true);
+  client->memory.charge(MEMORY_CONNECTION, CONNECTION_STATE_SIZE);
+  if (config.steerConnections) {
+    client->incomingCpu = incomingCpu(connection->socketFD);
   }
+  client->nickname = this->generateDefaultNickname();
+  this->snapshotClient(client);
+  this->clientsMutex.lock();
+  this->clients[client->nickname] = client;
+  this->connectionsPerAddress[connection->getPeerAddress()]++;
+  this->clientsMutex.unlock();
+  // The listen loop may be waiting on a select that doesn't include it
+  this->wake();
+  Metrics::count(METRIC_CONNECTIONS_ACCEPTED);
+  LOG_INFO("{} connected!", client->nickname);
+  LOG_INFO("Client count: {}", this->clients.size());
+  return client;
+}
+
+// Past the outbound budget or the memory all clients may hold
+bool Server::isOverBudget() {
+  return (config.outboundBudget != 0 &&
+          fanoutPool->pendingBytes() > config.outboundBudget) ||
+         (config.maxMemory != 0 && MemoryAccount::total() > config.maxMemory);
+}
+
+// Returns why a new connection from address is refused, "" to accept it
+std::string Server::connectionRefusal(std::string address) {
+  // Limits change under clientsMutex, see applyReloadedConfig
+  std::lock_guard<std::mutex> lock(this->clientsMutex);
+
+  if (isOverBudget()) {
+    return "Server is busy, try again later";
+  }
+
+  if (config.maxConnections != 0 && clients.size() >= config.maxConnections) {
+    return "Server is full, try again later";
+  }
+
+  auto connections = connectionsPerAddress.find(address);
+  if (config.maxConnectionsPerAddress != 0 &&
+      connections != connectionsPerAddress.end() &&
+      connections->second >= config.maxConnectionsPerAddress) {
+    return "Too many connections from " + address;
+  }
+  return "";
 }
 
 void Server::_listen() {
+  Tracer::nameThread("listen");
+  if (pinCurrentThread(config.listenCpus) != 0) {
+    LOG_WARNING("Could not pin the listen thread: {}", strerror(errno));
+  }
+  listenWatch.attach();
+
   while (this->shouldBeListening) {
+    this->pollClients(1);
+  }
+}
+
+// One pass of the listen loop: handles due throttled frames, then waits up
+// to timeout seconds for input, but no longer than until the next throttled
+// client is due, and handles what arrived
+int64_t Server::pollClients(int timeout) {
+  // Every read lands here and only what was read is copied to the client
+  char buffer[MAX_MSG_SIZE + 100];
+
+  listenWatch.begin();
+  this->applyReloadedConfig();
+  this->reclaimChannels();
+
+  int64_t now = TokenBucket::now();
+  int64_t nextResume = INT64_MAX;
+  std::vector<SocketWithInfo *> reads(1, wakeInfo);
+  std::vector<SocketWithInfo *> writes;
+  std::vector<SocketWithInfo *> resumed;
 
-    std::vector<SocketWithInfo *> reads = std::vector<SocketWithInfo *>();
+  std::vector<SocketWithInfo *> exceeded;
 
-    this->clientsMutex.lock();
-    for (auto client : this->clients) {
+  this->clientsMutex.lock();
+  for (auto client : this->clients) {
+    if (client.second->memory.exceeded()) {
+      exceeded.push_back(client.second);
+      continue;
+    }
+    if (client.second->outbound.isBlocked()) {
+      writes.push_back(client.second);
+    }
+    if (client.second->throttledUntil == 0) {
       reads.push_back(client.second);
+    } else if (client.second->throttledUntil <= now) {
+      resumed.push_back(client.second);
+    } else {
+      nextResume = std::min(nextResume, client.second->throttledUntil);
+    }
+  }
+  this->clientsMutex.unlock();
+
+  // No notice: a client this far behind wouldn't read it
+  for (auto client : exceeded) {
+    LOG_WARNING("Disconnecting {}: over the connection memory limit",
+                client->nickname);
+    this->closeClient(client);
+  }
+
+  // Frames held back by flood control go before any new input
+  for (auto client : resumed) {
+    client->throttledUntil = 0;
+    this->handleFrames(client, now);
+    if (client->throttledUntil == 0) {
+      reads.push_back(client);
+    } else {
+      nextResume = std::min(nextResume, client->throttledUntil);
     }
-    this->clientsMutex.unlock();
+  }
+
+  int64_t wait =
+      std::max((int64_t)0, std::min((int64_t)timeout * 1000000000,
+                                    nextResume - now));
+  struct timeval waitTime;
+  waitTime.tv_sec = wait / 1000000000;
+  waitTime.tv_usec = wait % 1000000000 / 1000;
+
+  listenWatch.end();
+  if (MySocket::select(&reads, &writes, nullptr, waitTime) == 0) {
+    return std::max((int64_t)1, nextResume - TokenBucket::now());
+  }
+
+  listenWatch.begin();
+  for (auto client : writes) {
+    client->outbound.flush(client->socket);
+  }
 
-    if (reads.size() == 0) {
+  now = TokenBucket::now();
+  for (size_t i = 0; i < reads.size(); i++) {
+    SocketWithInfo *client = reads[i];
+    if (client == wakeInfo) {
+      while (wakeInfo->socket->socketReadInto(buffer) > 0) {
+      }
       continue;
     }
+    TraceContext context(Tracer::sample());
+    ssize_t length;
+    {
+      TraceSpan span("recv");
+      length = client->socket->socketReadInto(buffer);
+    }
 
-    if (this->socket->select(&reads, nullptr, nullptr, 1) == 0) {
+    if (length == SOCKET_AGAIN) {
       continue;
     }
-    for (size_t i = 0; i < reads.size(); i++) {
-      std::string message = this->readMessage(reads[i]->socket);
-      this->handleMessage(reads[i], message);
+    if (length == SOCKET_ERROR) {
+      LOG_INFO("Error reading from {}: {}", client->nickname,
+               strerror(errno));
+    }
+    if (length <= 0) {
+      this->handleMessage(client, "");
+      continue;
     }
+
+    Metrics::count(METRIC_BYTES_IN, length);
+    client->bytesIn += length;
+    client->lastActivity = Metrics::now();
+    IRC_PROBE2(read, client->socket->socketFD, length);
+    if (capture.isOpen()) {
+      if (client->captureId == 0) {
+        client->captureId = capture.newConnection();
+      }
+      capture.data(client->captureId, now, buffer, length);
+    }
+
+    client->readBuffer.append(buffer, length);
+    this->handleFrames(client, now);
+  }
+  listenWatch.end();
+  return 0;
+}
+
+// Charges the next frame of client to the bucket of its class. Once the
+// bucket is empty the frame stays buffered and the connection isn't read
+// until the bucket refills, so the excess waits in the kernel and TCP
+// pushes back on the sender instead of us parsing it.
+bool Server::admitFrame(SocketWithInfo *client, int64_t now) {
+  std::string &buffer = client->readBuffer;
+  if (buffer[0] == FRAME_DELIMITER) {
+    return true;
   }
+
+  int64_t wait;
+  if (buffer.compare(0, 3, "/m ") == 0) {
+    wait = client->floodBuckets[FLOOD_MESSAGE].take(
+        config.messageRate, config.messageBurst, now);
+  } else {
+    wait = client->floodBuckets[FLOOD_COMMAND].take(
+        config.commandRate, config.commandBurst, now);
+  }
+
+  if (wait == 0) {
+    return true;
+  }
+  client->throttledUntil = now + wait;
+  throttledFrames++;
+  return false;
+}
+
+void Server::handleFrames(SocketWithInfo *client, int64_t now) {
+  std::string message;
+  if (client->isDiscardingFrame) {
+    size_t end = client->readBuffer.find(FRAME_DELIMITER);
+    client->readBuffer.erase(0, end == std::string::npos ? end : end + 1);
+    client->isDiscardingFrame = end == std::string::npos;
+  }
+
+  while (client->readBuffer.find(FRAME_DELIMITER) != std::string::npos &&
+         admitFrame(client, now) && popFrame(client->readBuffer, message)) {
+    if (message != "") {
+      client->messagesIn++;
+      this->handleMessage(client, message);
+    }
+  }
+
+  // A peer that never terminates its frame can't make us buffer forever
+  if (client->throttledUntil == 0 &&
+      client->readBuffer.size() > MAX_MSG_SIZE + 100) {
+    LOG_WARNING("Dropping unterminated frame from {}", client->nickname);
+    client->readBuffer.clear();
+    client->isDiscardingFrame = true;
+  }
+  client->memory.set(MEMORY_READ_BUFFER, client->readBuffer.capacity());
+}
+
+// Counter of the command in a frame, by its first word
+static MetricCounter commandMetric(const std::string &message) {
+  static const std::unordered_map<std::string, MetricCounter> commands = {
+      {"/whoami", METRIC_COMMAND_WHOAMI}, {"/ping", METRIC_COMMAND_PING},
+      {"/nickname", METRIC_COMMAND_NICKNAME}, {"/join", METRIC_COMMAND_JOIN},
+      {"/mute", METRIC_COMMAND_MUTE},     {"/unmute", METRIC_COMMAND_UNMUTE},
+      {"/whois", METRIC_COMMAND_WHOIS},   {"/kick", METRIC_COMMAND_KICK},
+      {"/m", METRIC_COMMAND_MESSAGE}};
+
+  auto command = commands.find(message.substr(0, message.find(' ')));
+  return command == commands.end() ? METRIC_COMMAND_UNKNOWN : command->second;
 }
 
 void Server::handleMessage(SocketWithInfo *client, std::string message) {
+  TraceSpan span("handleMessage");
+  listenWatch.setActivity(client->nickname, message);
+  IRC_PROBE2(message, client->socket->socketFD, message.size());
+  int64_t handledAt = Metrics::now();
+  if (message != "") {
+    Metrics::count(commandMetric(message));
+  }
 
   if (message == "") {
-    this->clients.erase(client->nickname);
-    GUI::log(client->nickname + " disconnected!");
-    GUI::log("Client count: " + std::to_string((int)this->clients.size()));
+    LOG_INFO("{} disconnected!", client->nickname);
     this->closeClient(client);
+    LOG_INFO("Client count: {}", this->clients.size());
     return;
   } else if (message[0] == '/') {
     if (message == "/whoami") {
       this->sendMessage("/youare " + client->nickname, client);
     } else if (message == "/ping") {
       this->sendMessage("<server> pong", client);
-      GUI::log(client->nickname + " pinged!");
+      LOG_INFO("{} pinged!", client->nickname);
     } else {
-      std::regex regex = std::regex("/nickname (.+)");
-
-      std::smatch match;
-      std::regex_match(message, match, regex);
+      std::string command;
+      std::string argument;
+      {
+        TraceSpan parseSpan("parse");
+        static const std::regex commandRegex(
+            "(/nickname|/join|/mute|/unmute|/whois|/kick|/m) (.+)");
+        std::smatch match;
+        if (std::regex_match(message, match, commandRegex)) {
+          command = match[1];
+          argument = match[2];
+        }
+      }
+      TraceSpan dispatchSpan("dispatch");
 
-      if (match.size() > 1) {
+      if (command == "/nickname") {
 
-        GUI::log(client->nickname + " asked to change nickname to " +
-                 match[1].str());
+        LOG_INFO("{} asked to change nickname to {}", client->nickname,
+                 argument);
 
-        std::string newNickname = match[1];
+        std::string newNickname = argument;
+        if (!Nickname::fits(newNickname.size())) {
+          LOG_INFO("Nickname change failed: Nickname too long!");
+          this->sendMessage("Nickname too long!", client);
+          return;
+        }
         if (checkAvaiableNickname(newNickname)) {
-          if (newNickname.size() > 50) {
-            GUI::log("Nickname change failed: Nickname too long!");
-            this->sendMessage("Nickname too long!", client);
-            return;
-          } else {
-            GUI::log(client->nickname + " changed nickname to " + newNickname);
-
-            if (client->channel != "") {
-              auto userChannel = this->channels[client->channel];
-              userChannel->users.erase(client->nickname);
-              userChannel->users[newNickname] = client;
-              if (client->isAdmin) {
-                userChannel->admin = newNickname;
-              }
-            }
-
-            this->clientsMutex.lock();
-            this->clients.erase(client->nickname);
-            client->nickname = newNickname;
-            this->clients[newNickname] = client;
-            this->clientsMutex.unlock();
-            this->sendMessage("/youare " + newNickname, client);
-          }
+          LOG_INFO("{} changed nickname to {}", client->nickname,
+                   newNickname);
+
+          renameMember(client, newNickname);
+
+          this->clientsMutex.lock();
+          this->clients.erase(client->nickname);
+          client->nickname = newNickname;
+          this->clients[newNickname] = client;
+          this->clientsMutex.unlock();
+          snapshotClient(client);
+          this->sendMessage("/youare " + newNickname, client);
         } else {
-          GUI::log("Nickname change failed: " + newNickname +
-                   " is already in use!");
+          LOG_INFO("Nickname change failed: {} is already in use!",
+                   newNickname);
           this->sendMessage("Nickname: " + newNickname + " already taken!",
                             client);
         }
         return;
       }
 
-      regex = std::regex("/join (.+)");
-
-      std::regex_match(message, match, regex);
+      if (command == "/join") {
 
-      if (match.size() > 1) {
-
-        std::string newChannel = match[1];
+        std::string newChannel = argument;
 
         std::regex isValidChannelName = std::regex("^([#&][^\\x07\\x2C\\s]+)$");
 
         if (!std::regex_match(newChannel, isValidChannelName)) {
-          GUI::log("Channel join failed: Invalid channel name.");
+          LOG_INFO("Channel join failed: Invalid channel name.");
           this->sendMessage("Channel name should start with '#' or '&'",
                             client);
           return;
         }
-        if (newChannel.size() > 200) {
-          GUI::log("Channel join failed: Invalid channel name.");
+        if (!ChannelName::fits(newChannel.size())) {
+          LOG_INFO("Channel join failed: Invalid channel name.");
           this->sendMessage("Channel name can't have more than 200 letters",
                             client);
           return;
         }
 
-        GUI::log(client->nickname + " asked to join " + newChannel);
+        LOG_INFO("{} asked to join {}", client->nickname, newChannel);
 
-        if (client->isAdmin) {
-          GUI::log("Channel join failed: " + client->nickname +
-                   " is an admin and can't leave his channel!");
-          this->sendMessage("You can't leave a channel you administrate!",
-                            client);
-          return;
-        }
+        Channel *joinedChannel = nullptr;
 
-        Channel *channel;
+        if (client->memberships.count(newChannel) == 0) {
+          Channel *channel;
 
-        if (client->channel != "") {
-          channels[client->channel]->users.erase(client->nickname);
-          client->isMuted = false;
-          client->isAdmin = false;
-        }
+          if (!channelExists(newChannel)) {
+            channel = new Channel(config.historyDepth);
+            channel->channelName = newChannel;
+            this->channels[newChannel] = channel;
+            channelCount++;
+          } else {
+            channel = this->channels[newChannel];
+          }
 
-        if (!channelExists(newChannel)) {
-          channel = new Channel();
-          channel->channelName = newChannel;
-          channel->admin = client->nickname;
-          this->channels[newChannel] = channel;
-          client->isAdmin = true;
-        } else {
-          channel = this->channels[newChannel];
+          // A restored admin who didn't come back in time loses the role,
+          // and a channel restored without one has nobody to wait for
+          if (channel->restoredUntil != 0 &&
+              (channel->admin == "" ||
+               TokenBucket::now() >= channel->restoredUntil)) {
+            channel->restoredUntil = 0;
+            handOverAdmin(channel);
+          }
+
+          // Whoever creates a channel, or revives one waiting for
+          // reclamation, administrates it. A restored channel waits for
+          // its admin instead, who gets the role back by joining under
+          // the same nickname.
+          bool isAdmin = false;
+          if (channel->restoredUntil != 0) {
+            isAdmin = channel->admin == client->nickname;
+            if (isAdmin) {
+              channel->restoredUntil = 0;
+            }
+          } else if (channel->users.empty() || channel->admin == "") {
+            channel->admin = client->nickname;
+            snapshotChannel(channel);
+            isAdmin = true;
+          }
+
+          addMembership(client, channel, isAdmin);
+          joinedChannel = channel;
         }
 
-        channel->users[client->nickname] = client;
         client->channel = newChannel;
+        snapshotClient(client);
 
-        GUI::log(client->nickname + " joined " + newChannel + " as " +
-                 (client->isAdmin ? "admin" : "user"));
+        LOG_INFO("{} joined {} as {}", client->nickname, newChannel,
+                 activeMembership(client)->isAdmin ? "admin" : "user");
 
-        this->sendMessage("/joined " + newChannel + " " +
-                              (client->isAdmin ? "admin" : "user"),
-                          client);
+        sendJoined(client);
+        if (joinedChannel != nullptr) {
+          replayHistory(client, joinedChannel);
+        }
         return;
       }
 
-      regex = std::regex("/mute (.+)");
-
-      std::regex_match(message, match, regex);
-
-      if (match.size() > 1) {
+      if (command == "/mute") {
 
-        std::string target = match[1];
-        if (target == client->nickname) {
-          GUI::log("Mute failed: Cannot mute yourself!");
+        std::string target = argument;
+        if (client->nickname == target) {
+          LOG_INFO("Mute failed: Cannot mute yourself!");
           this->sendMessage("Cannot mute yourself!", client);
           return;
         }
 
-        if (!client->isAdmin) {
-          GUI::log("Mute failed: You are not an admin!");
+        Membership *membership = activeMembership(client);
+
+        if (membership == nullptr || !membership->isAdmin) {
+          LOG_INFO("Mute failed: You are not an admin!");
           this->sendMessage("You must be a channel admin to mute someone!",
                             client);
           return;
         }
 
-        auto userChannel = channels[client->channel];
+        auto targetClient = findMember(channels[client->channel], target);
 
-        if (userChannel->users.find(target) == userChannel->users.end()) {
-          GUI::log("Mute failed: " + target + " is not in the channel!");
+        if (targetClient == nullptr) {
+          LOG_INFO("Mute failed: {} is not in the channel!", target);
           this->sendMessage(target + " is not in the channel!", client);
           return;
         }
+        Membership &targetMembership =
+            targetClient->memberships[client->channel];
 
-        auto targetClient = userChannel->users[target];
-
-        if (targetClient->isMuted) {
-          GUI::log("Mute failed: " + target + " is already muted!");
+        if (targetMembership.isMuted) {
+          LOG_INFO("Mute failed: {} is already muted!", target);
           this->sendMessage(target + " is already muted!", client);
           return;
         }
 
-        targetClient->isMuted = true;
+        targetMembership.isMuted = true;
+        snapshotMembership(targetClient, client->channel);
 
-        sendMessage("/muted", targetClient);
+        sendMessage("/muted " + client->channel, targetClient);
 
-        GUI::log(client->nickname + " muted " + target);
+        LOG_INFO("{} muted {}", client->nickname, target);
         this->sendMessage(target + " is now muted!", client);
 
         return;
       }
 
-      regex = std::regex("/unmute (.+)");
-
-      std::regex_match(message, match, regex);
+      if (command == "/unmute") {
 
-      if (match.size() > 1) {
-
-        std::string target = match[1];
-        if (target == client->nickname) {
-          GUI::log("Unmute failed: Cannot unmute yourself!");
+        std::string target = argument;
+        if (client->nickname == target) {
+          LOG_INFO("Unmute failed: Cannot unmute yourself!");
           this->sendMessage("Cannot unmute yourself!", client);
           return;
         }
 
-        if (!client->isAdmin) {
-          GUI::log("Unmute failed: You are not an admin!");
+        Membership *membership = activeMembership(client);
+
+        if (membership == nullptr || !membership->isAdmin) {
+          LOG_INFO("Unmute failed: You are not an admin!");
           this->sendMessage("You must be a channel admin to unmute someone!",
                             client);
           return;
         }
 
-        auto userChannel = channels[client->channel];
+        auto targetClient = findMember(channels[client->channel], target);
 
-        if (userChannel->users.find(target) == userChannel->users.end()) {
-          GUI::log("Unmute failed: " + target + " is not in the channel!");
+        if (targetClient == nullptr) {
+          LOG_INFO("Unmute failed: {} is not in the channel!", target);
           this->sendMessage(target + " is not in the channel!", client);
           return;
         }
+        Membership &targetMembership =
+            targetClient->memberships[client->channel];
 
-        auto targetClient = userChannel->users[target];
-
-        if (!targetClient->isMuted) {
-          GUI::log("Unmute failed: " + target + " is already unmuted!");
+        if (!targetMembership.isMuted) {
+          LOG_INFO("Unmute failed: {} is already unmuted!", target);
           this->sendMessage(target + " is already unmuted!", client);
           return;
         }
 
-        targetClient->isMuted = false;
+        targetMembership.isMuted = false;
+        snapshotMembership(targetClient, client->channel);
 
-        sendMessage("/unmuted", targetClient);
+        sendMessage("/unmuted " + client->channel, targetClient);
 
-        GUI::log(client->nickname + " unmuted " + target);
+        LOG_INFO("{} unmuted {}", client->nickname, target);
         this->sendMessage(target + " is now unmuted!", client);
 
         return;
       }
 
-      regex = std::regex("/whois (.+)");
+      if (command == "/whois") {
 
-      std::regex_match(message, match, regex);
+        std::string target = argument;
 
-      if (match.size() > 1) {
+        Membership *membership = activeMembership(client);
 
-        std::string target = match[1];
-
-        if (!client->isAdmin) {
-          GUI::log("Whois failed: You are not an admin!");
+        if (membership == nullptr || !membership->isAdmin) {
+          LOG_INFO("Whois failed: You are not an admin!");
           this->sendMessage("You must be a channel admin to whois someone!",
                             client);
           return;
         }
 
-        auto userChannel = channels[client->channel];
+        auto targetClient = findMember(channels[client->channel], target);
 
-        if (userChannel->users.find(target) == userChannel->users.end()) {
-          GUI::log("Whois failed: " + target + " is not in the channel!");
+        if (targetClient == nullptr) {
+          LOG_INFO("Whois failed: {} is not in the channel!", target);
           this->sendMessage(target + " is not in the channel!", client);
           return;
         }
 
-        auto targetClient = userChannel->users[target];
-
         std::string ipAddress = targetClient->socket->getIpAddress();
 
-        GUI::log(client->nickname + " whois " + target);
+        LOG_INFO("{} whois {}", client->nickname, target);
 
         this->sendMessage(target + "'s IP address is" + ipAddress + "!",
                           client);
@@ -409,80 +1641,87 @@ void Server::handleMessage(SocketWithInfo *client, std::string message) {
         return;
       }
 
-      regex = std::regex("/kick (.+)");
-
-      std::regex_match(message, match, regex);
+      if (command == "/kick") {
 
-      if (match.size() > 1) {
-
-        std::string target = match[1];
-        if (target == client->nickname) {
-          GUI::log("Kick failed: Cannot kick yourself!");
+        std::string target = argument;
+        if (client->nickname == target) {
+          LOG_INFO("Kick failed: Cannot kick yourself!");
           this->sendMessage("Cannot kick yourself!", client);
           return;
         }
 
-        if (!client->isAdmin) {
-          GUI::log("Kick failed: You are not an admin!");
+        Membership *membership = activeMembership(client);
+
+        if (membership == nullptr || !membership->isAdmin) {
+          LOG_INFO("Kick failed: You are not an admin!");
           this->sendMessage("You must be a channel admin to kick someone!",
                             client);
           return;
         }
 
-        auto userChannel = channels[client->channel];
+        auto targetClient = findMember(channels[client->channel], target);
 
-        if (userChannel->users.find(target) == userChannel->users.end()) {
-          GUI::log("Kick failed: " + target + " is not in the channel!");
+        if (targetClient == nullptr) {
+          LOG_INFO("Kick failed: {} is not in the channel!", target);
           this->sendMessage(target + " is not in the channel!", client);
           return;
         }
 
-        auto targetClient = userChannel->users[target];
-
-        sendMessage("/kicked", targetClient);
+        sendMessage("/kicked " + client->channel, targetClient);
 
-        userChannel->users.erase(target);
-        targetClient->channel = "";
-        targetClient->isAdmin = false;
-        targetClient->isMuted = false;
+        bool wasActive = targetClient->channel == client->channel;
+        removeMembership(targetClient, client->channel);
+        if (wasActive) {
+          sendJoined(targetClient);
+        }
 
-        GUI::log(client->nickname + " kicked " + target);
+        LOG_INFO("{} kicked {}", client->nickname, target);
         this->sendMessage(target + " is now kicked!", client);
 
         return;
       }
 
-      regex = std::regex("/m (.+)");
-
-      std::regex_match(message, match, regex);
-
-      if (match.size() > 1) {
+      if (command == "/m") {
 
-        std::string msg = match[1];
+        std::string msg = argument;
 
         if (msg.length() > MAX_MSG_SIZE + 100) {
-          GUI::log("Message failed: Message is too long!");
+          LOG_INFO("Message failed: Message is too long!");
           this->sendMessage("Message is too long!", client);
           return;
         }
 
         if (client->channel == "") {
-          GUI::log("Message failed: You are not in a channel!");
+          LOG_INFO("Message failed: You are not in a channel!");
           this->sendMessage("You must be in a channel to send messages!",
                             client);
           return;
         }
 
-        if (client->isMuted) {
-          GUI::log("Message failed: You are muted!");
+        if (activeMembership(client)->isMuted) {
+          LOG_INFO("Message failed: You are muted!");
           this->sendMessage("You can't send messages while muted!", client);
           return;
         }
 
-        GUI::log(client->nickname + "@" + client->channel + " : " + msg);
+        // Channel messages are the first traffic shed under overload
+        if (isOverBudget()) {
+          shedMessages++;
+          this->sendMessage("Server is busy, message dropped!", client);
+          return;
+        }
+
+        LOG_INFO("{}@{} : {}", client->nickname, client->channel, msg);
+
+        if (messageLog != nullptr) {
+          messageLog->append(client->channel.str(), client->nickname.str(),
+                             msg);
+        }
 
         multicastMessage(msg, client->channel,
-                         "/msg " + client->nickname + " ");
+                         "/msg " + client->nickname + "@" + client->channel +
+                             " ",
+                         client, handledAt);
 
         return;
       }
@@ -492,21 +1731,21 @@ void Server::handleMessage(SocketWithInfo *client, std::string message) {
   }
   return;
 
-  GUI::log("Garbage from " + client->nickname + ": " + message);
+  LOG_WARNING("Garbage from {}: {}", client->nickname, message);
 }
 
-std::string Server::generateDefaultNickname() {
-  std::string randNick;
+Nickname Server::generateDefaultNickname() {
+  char randNick[NICKNAME_CAPACITY + 1];
   do {
-    randNick = "user" + std::to_string(rand());
+    snprintf(randNick, sizeof(randNick), "user%d", rand());
   } while ((!this->checkAvaiableNickname(randNick)));
   return randNick;
 }
-bool Server::checkAvaiableNickname(std::string nickname) {
+bool Server::checkAvaiableNickname(const Nickname &nickname) {
   return this->clients.find(nickname) == this->clients.end();
 }
 
-bool Server::channelExists(std::string channel) {
+bool Server::channelExists(const ChannelName &channel) {
   return this->channels.find(channel) != this->channels.end();
 }
 
@@ -3,52 +3,196 @@
 
 #define DEFAULT_PORT "6697"
 #define MAX_MSG_SIZE 4096
+// Seconds between two reclamation passes over empty channels
+#define CHANNEL_RECLAIM_INTERVAL 10
+// Seconds a channel must stay empty before it is deleted
+#define CHANNEL_RECLAIM_GRACE 30
+// Seconds a channel restored from a snapshot waits for its members
+#define CHANNEL_RESTORED_GRACE 3600
+// Memory of a connection's own state, names included
+#define CONNECTION_STATE_SIZE (sizeof(SocketWithInfo) + sizeof(MySocket))
 
+#include "Capture.hpp"
+#include "Config.hpp"
+#include "Fanout.hpp"
+#include "History.hpp"
+#include "MessageLog.hpp"
+#include "Metrics.hpp"
+#include "Snapshot.hpp"
 #include "Socket.hpp"
+#include "Trace.hpp"
+#include "Watchdog.hpp"
 #include <bits/stdc++.h>
 struct Channel {
-  std::string channelName;
-  std::string admin;
-  std::unordered_map<std::string, SocketWithInfo *> users =
-      std::unordered_map<std::string, SocketWithInfo *>();
+  ChannelName channelName;
+  Nickname admin;
+  std::unordered_map<Nickname, SocketWithInfo *> users;
+  // One reference per member plus one per in-flight user of the channel.
+  // Once it drops to zero the channel is queued for reclamation.
+  std::atomic<int> refCount{0};
+  // Guarded by Server::reclaimMutex
+  bool isQueuedForReclaim = false;
+  // TokenBucket::now() when the last reference went away
+  int64_t emptySince = 0;
+  // TokenBucket::now() until which a channel restored from a snapshot
+  // without any member waits for them, and its admin only comes back by
+  // joining under the same nickname. 0 once the admin is back, the time
+  // is up or the channel was never restored.
+  int64_t restoredUntil = 0;
+  ChannelHistory history;
+  uint32_t snapshotSlot = SNAPSHOT_NONE;
+  // history.version() when the history was last written to the snapshot
+  uint64_t snapshotHistoryVersion = 0;
+  Channel(size_t historyDepth) : history(historyDepth) {}
+};
+
+// Traffic and backlog of one connection at the time of a report
+struct ConnectionStats {
+  std::string nickname;
+  std::string address;
+  uint64_t bytesIn;
+  uint64_t messagesIn;
+  uint64_t bytesOut;
+  uint64_t messagesOut;
+  size_t queued;
+  size_t highWater;
+  // Nanoseconds from queueing a frame to having written it
+  uint64_t meanLatency;
+  uint64_t maxLatency;
+  // Nanoseconds since the last input
+  int64_t idle;
+  // Bytes held, see MemoryCategory
+  size_t memory;
 };
 
 class Server {
 private:
   MySocket *socket;
   std::string address;
+  ServerConfig config;
+  FanoutPool *fanoutPool;
+  MessageLog *messageLog = nullptr;
+  Snapshot snapshot;
+  TrafficCapture capture;
+  MetricsEndpoint metricsEndpoint;
+  // Worst consumers as of the scrape in progress, shared by the
+  // irc_connection_* gauges
+  std::vector<ConnectionStats> scrapedConsumers;
+  LoopWatch listenWatch{"listen"};
+  // Written to by wake() so the listen loop looks for new or blocked
+  // connections, read in every select of the loop
+  int wakeDescriptor;
+  SocketWithInfo *wakeInfo;
+  void wake();
+  Watchdog watchdog;
   std::mutex clientsMutex;
-  std::unordered_map<std::string, SocketWithInfo *> clients;
-  std::unordered_map<std::string, Channel *> channels;
+  std::unordered_map<Nickname, SocketWithInfo *> clients;
+  // Open connections per peer address, guarded by clientsMutex
+  std::unordered_map<std::string, size_t> connectionsPerAddress;
+  std::unordered_map<ChannelName, Channel *> channels;
+  std::mutex reclaimMutex;
+  std::vector<Channel *> reclaimQueue;
+  int64_t lastReclaim = 0;
+  std::atomic<size_t> channelCount{0};
+  std::atomic<size_t> channelBytes{0};
+  std::atomic<size_t> reclaimedChannels{0};
+  std::atomic<size_t> throttledFrames{0};
+  std::atomic<size_t> refusedConnections{0};
+  std::atomic<size_t> shedMessages{0};
   int nicknameCounter = 1;
-  std::string generateDefaultNickname();
-  bool checkAvaiableNickname(std::string nickName);
-  bool channelExists(std::string channelName);
+  Nickname generateDefaultNickname();
+  bool checkAvaiableNickname(const Nickname &nickName);
+  bool channelExists(const ChannelName &channelName);
   bool shouldBeAccepting = false;
   bool shouldBeListening = false;
-  std::thread *acceptThread;
-  std::thread *listenThread;
+  std::atomic<bool> shouldBeHandingOff{false};
+  // Configuration given to reload(), applied by the listen thread
+  std::mutex reloadMutex;
+  ServerConfig reloadedConfig;
+  std::atomic<bool> hasReloadedConfig{false};
+  void applyReloadedConfig();
+  std::thread *acceptThread = nullptr;
+  std::thread *listenThread = nullptr;
+  std::thread *handoffThread = nullptr;
+  void start();
+  void startMetrics();
+  void addConnectionGauges();
   void _accept();
   void _listen();
+  void _handoff();
+  void handOff(MySocket *peer);
+  std::string saveState(std::vector<int> &descriptors);
+  int restoreState(const std::string &state,
+                   const std::vector<int> &descriptors);
+  void restoreSnapshot(
+      SnapshotView &view,
+      std::unordered_map<uint32_t, SocketWithInfo *> &connections);
+  void openSnapshot();
+  void snapshotAll();
+  void snapshotClient(SocketWithInfo *client);
+  void snapshotChannel(Channel *channel);
+  void snapshotMembership(SocketWithInfo *client,
+                          const ChannelName &channelName);
+  void snapshotHistories();
   void closeClients();
   void closeClient(SocketWithInfo *client);
-  SocketWithInfo *clientInfo;
+  Membership *activeMembership(SocketWithInfo *client);
+  void addMembership(SocketWithInfo *client, Channel *channel, bool isAdmin);
+  void removeMembership(SocketWithInfo *client, ChannelName channelName);
+  void renameMember(SocketWithInfo *client, const Nickname &newNickname);
+  void handOverAdmin(Channel *channel);
+  void accountMemberships(SocketWithInfo *client);
+  // Member of channel called nickname, or nullptr
+  SocketWithInfo *findMember(Channel *channel, const Nickname &nickname);
+  void sendJoined(SocketWithInfo *client);
+  void replayHistory(SocketWithInfo *client, Channel *channel);
+  void acquireChannel(Channel *channel);
+  void releaseChannel(Channel *channel);
+  void reclaimChannels();
+  SocketWithInfo *clientInfo = nullptr;
   void handleMessage(SocketWithInfo *client, std::string message);
+  bool admitFrame(SocketWithInfo *client, int64_t now);
+  bool isOverBudget();
+  std::string connectionRefusal(std::string address);
+  void handleFrames(SocketWithInfo *client, int64_t now);
+  std::vector<Frame> encodeFrames(std::string message, std::string prefix);
+  void parallelFanout(Channel *channel, std::vector<Frame> frames,
+                      SocketWithInfo *sender, int64_t handledAt);
 
 public:
-  Server(std::string address);
+  Server(std::string address, ServerConfig config = ServerConfig());
   int init();
+  int takeOver(std::string handoffSocket);
   int stop();
+  // Switches to the limits of config (flood control, connection caps,
+  // outbound budget, fan-out sizes); other options need a restart
+  void reload(const ServerConfig &config);
   bool isRunning();
   bool shouldBeRunning = false;
-  std::string readMessage(MySocket *client);
   void sendMessage(std::string message, SocketWithInfo *client);
   void messageClient(std::string message, SocketWithInfo *client,
                      std::string preffix);
-  void multicastMessage(std::string message, std::string channel,
-                        std::string preffix);
+  // handledAt is when the message was taken in (Metrics::now()), to record
+  // its latency, or 0
+  void multicastMessage(std::string message, const ChannelName &channel,
+                        std::string preffix,
+                        SocketWithInfo *sender = nullptr,
+                        int64_t handledAt = 0);
   void acceptClients();
   void listenClients();
+  // Serves connection as a newly accepted client
+  SocketWithInfo *addClient(MySocket *connection);
+  // One pass of the listen loop, for callers driving the server themselves
+  // (see Simulation); returns 0 if it handled input, otherwise the
+  // nanoseconds until a throttled client is due (INT64_MAX if none)
+  int64_t pollClients(int timeout);
+  std::string stats();
+  // The count connections with the most frames queued, then the slowest
+  // to take them, worst first
+  std::vector<ConnectionStats> worstConsumers(size_t count);
+  std::vector<std::string> connectionReport(size_t count);
+  std::vector<std::string> scrollback(std::string channel, uint64_t from,
+                                      uint64_t to);
 };
 
 #endif
\ No newline at end of file
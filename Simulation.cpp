@@ -0,0 +1,337 @@
+#include "Simulation.hpp"
+#include "RateLimit.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int64_t Simulation::virtualTime = 0;
+
+int64_t Simulation::virtualClock() { return virtualTime; }
+
+Simulation::Simulation(ServerConfig config) {
+  // No fan-out workers are started: every channel is written to inline
+  config.fanoutThreshold = SIZE_MAX;
+  // Starts where a real clock would, so nothing looks due at time 0
+  virtualTime = TokenBucket::now();
+  TokenBucket::setClock(virtualClock);
+  this->server = new Server("localhost", config);
+}
+
+Simulation::~Simulation() {
+  this->server->stop();
+  delete this->server;
+  for (auto &client : clients) {
+    if (client.isOpen) {
+      close(client.descriptor);
+    }
+  }
+  TokenBucket::setClock(nullptr);
+}
+
+Simulation::Client *Simulation::find(const std::string &name,
+                                     std::string &error) {
+  auto found = clientsByName.find(name);
+  if (found == clientsByName.end()) {
+    error = "No client named " + name;
+    return nullptr;
+  }
+  return &clients[found->second];
+}
+
+int Simulation::connect(const std::string &name, std::string &error) {
+  if (clientsByName.count(name) != 0) {
+    error = "Client " + name + " already exists";
+    return -1;
+  }
+  if (clients.size() >= SIMULATION_MAX_CLIENTS) {
+    error = "At most " + std::to_string(SIMULATION_MAX_CLIENTS) +
+            " clients can be simulated";
+    return -1;
+  }
+
+  int descriptors[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, descriptors) == -1) {
+    error = "Error creating socketpair: " + std::string(strerror(errno));
+    return -1;
+  }
+  // Best effort: replies are drained after every pass, the buffers only
+  // need to hold what a single pass writes
+  int size = SIMULATION_SOCKET_BUFFER;
+  for (int descriptor : descriptors) {
+    setsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(descriptor, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+  }
+  fcntl(descriptors[1], F_SETFL, fcntl(descriptors[1], F_GETFL) | O_NONBLOCK);
+
+  Client client;
+  client.name = name;
+  client.descriptor = descriptors[1];
+  clientsByName[name] = clients.size();
+  clients.push_back(client);
+
+  server->addClient(MySocket::fromDescriptor(descriptors[0]));
+  return 0;
+}
+
+int Simulation::send(const std::string &name, const std::string &frame,
+                     std::string &error) {
+  Client *client = find(name, error);
+  if (client == nullptr) {
+    return -1;
+  }
+  if (!client->isOpen) {
+    error = "Client " + name + " was dropped";
+    return -1;
+  }
+
+  std::string bytes = frame + FRAME_DELIMITER;
+  size_t sent = 0;
+  while (sent < bytes.size()) {
+    ssize_t written = write(client->descriptor, bytes.data() + sent,
+                            bytes.size() - sent);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    // Input piles up until the next step, more than that is a script error
+    if (written < 0) {
+      error = "Error sending to the server as " + name + ": " +
+              std::string(strerror(errno));
+      return -1;
+    }
+    sent += written;
+  }
+  return 0;
+}
+
+// Collects what the server wrote to client, remembering its nickname
+void Simulation::drain(Client &client) {
+  if (!client.isOpen) {
+    return;
+  }
+
+  char buffer[SOCKET_READ_CHUNK];
+  ssize_t length;
+  while ((length = read(client.descriptor, buffer, sizeof buffer)) > 0 ||
+         (length < 0 && errno == EINTR)) {
+    if (length < 0) {
+      continue;
+    }
+    client.received.append(buffer, length);
+  }
+
+  size_t end;
+  while ((end = client.received.find(FRAME_DELIMITER, client.scanned)) !=
+         std::string::npos) {
+    size_t frame = client.scanned;
+    if (client.received.compare(frame, 8, "/youare ") == 0) {
+      client.nickname = client.received.substr(frame + 8, end - frame - 8);
+    }
+    client.scanned = end + 1;
+  }
+}
+
+void Simulation::step() {
+  while (true) {
+    int64_t nap = server->pollClients(0);
+    passes++;
+    for (auto &client : clients) {
+      drain(client);
+    }
+    if (nap > 0) {
+      return;
+    }
+  }
+}
+
+void Simulation::advance(int64_t milliseconds) {
+  virtualTime += milliseconds * 1000000;
+}
+
+int Simulation::expect(const std::string &name, const std::string &frame,
+                       std::string &error) {
+  Client *client = find(name, error);
+  if (client == nullptr) {
+    return -1;
+  }
+
+  size_t end = client->received.find(FRAME_DELIMITER, client->consumed);
+  if (end == std::string::npos) {
+    error = name + " expected \"" + frame + "\" but received nothing";
+    return -1;
+  }
+  std::string received =
+      client->received.substr(client->consumed, end - client->consumed);
+  client->consumed = end + 1;
+  if (received != frame) {
+    error = name + " expected \"" + frame + "\" but received \"" + received +
+            "\"";
+    return -1;
+  }
+  return 0;
+}
+
+int Simulation::drop(const std::string &name, std::string &error) {
+  Client *client = find(name, error);
+  if (client == nullptr) {
+    return -1;
+  }
+  if (client->isOpen) {
+    close(client->descriptor);
+    client->isOpen = false;
+  }
+  return 0;
+}
+
+std::vector<std::string> Simulation::pending(const std::string &name) {
+  std::vector<std::string> frames;
+  std::string error;
+  Client *client = find(name, error);
+  if (client == nullptr) {
+    return frames;
+  }
+
+  size_t frame = client->consumed;
+  size_t end;
+  while ((end = client->received.find(FRAME_DELIMITER, frame)) !=
+         std::string::npos) {
+    frames.push_back(client->received.substr(frame, end - frame));
+    frame = end + 1;
+  }
+  return frames;
+}
+
+std::string Simulation::nickname(const std::string &name) {
+  std::string error;
+  Client *client = find(name, error);
+  return client == nullptr ? "" : client->nickname;
+}
+
+std::vector<Simulation::Client *>
+Simulation::population(const std::string &prefix, std::string &error) {
+  std::vector<Client *> members;
+  auto found = populations.find(prefix);
+  if (found == populations.end()) {
+    error = "No population named " + prefix;
+    return members;
+  }
+  for (size_t i = 0; i < found->second; i++) {
+    members.push_back(find(prefix + std::to_string(i), error));
+  }
+  return members;
+}
+
+int Simulation::run(const std::string &command, std::string &error) {
+  std::istringstream words(command);
+  std::string verb, name;
+  words >> verb;
+  if (verb == "" || verb[0] == '#') {
+    return 0;
+  }
+  words >> name;
+  // The rest of the line, single space after the name removed
+  std::string rest;
+  std::getline(words, rest);
+  if (rest.size() > 0 && rest[0] == ' ') {
+    rest.erase(0, 1);
+  }
+
+  if (verb == "connect") {
+    return connect(name, error);
+  } else if (verb == "send") {
+    return send(name, rest, error);
+  } else if (verb == "step") {
+    step();
+    return 0;
+  } else if (verb == "advance") {
+    advance(strtoll(name.c_str(), nullptr, 10));
+    return 0;
+  } else if (verb == "expect") {
+    return expect(name, rest, error);
+  } else if (verb == "skip") {
+    Client *client = find(name, error);
+    if (client == nullptr) {
+      return -1;
+    }
+    client->consumed = client->received.size();
+    return 0;
+  } else if (verb == "drop") {
+    return drop(name, error);
+  } else if (verb == "print") {
+    for (auto &frame : pending(name)) {
+      std::cout << name << ": " << frame << std::endl;
+    }
+    return 0;
+  } else if (verb == "population") {
+    size_t count = strtoul(rest.c_str(), nullptr, 10);
+    for (size_t i = 0; i < count; i++) {
+      std::string member = name + std::to_string(i);
+      if (connect(member, error) != 0 ||
+          send(member, "/nickname " + member, error) != 0) {
+        return -1;
+      }
+    }
+    populations[name] = count;
+    step();
+    for (auto member : population(name, error)) {
+      member->consumed = member->received.size();
+    }
+    return 0;
+  } else if (verb == "each") {
+    std::vector<Client *> members = population(name, error);
+    if (members.empty()) {
+      return -1;
+    }
+    for (size_t i = 0; i < members.size(); i++) {
+      std::string frame = rest;
+      std::string index = std::to_string(i);
+      size_t at;
+      while ((at = frame.find("{i}")) != std::string::npos) {
+        frame.replace(at, 3, index);
+      }
+      if (send(members[i]->name, frame, error) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  error = "Unknown command: " + verb;
+  return -1;
+}
+
+int Simulation::runScript(std::istream &script, std::string &error) {
+  std::string line;
+  size_t number = 0;
+  while (std::getline(script, line)) {
+    number++;
+    if (run(line, error) != 0) {
+      error = "Line " + std::to_string(number) + ": " + error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+size_t Simulation::size() { return clients.size(); }
+
+uint64_t Simulation::listenPasses() { return passes; }
+
+uint64_t Simulation::bytesReceived() {
+  uint64_t bytes = 0;
+  for (auto &client : clients) {
+    bytes += client.received.size();
+  }
+  return bytes;
+}
+
+uint64_t Simulation::digest() {
+  uint64_t hash = 14695981039346656037ull;
+  for (auto &client : clients) {
+    for (char byte : client.received) {
+      hash = (hash ^ (uint8_t)byte) * 1099511628211ull;
+    }
+  }
+  return hash;
+}
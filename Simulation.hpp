@@ -0,0 +1,88 @@
+#ifndef _SIMULATION_HPP_
+#define _SIMULATION_HPP_
+
+#include "Server.hpp"
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Bytes each end of a simulated connection asks the kernel to buffer
+#define SIMULATION_SOCKET_BUFFER (1 << 20)
+// Connections a simulation may open: select() only watches descriptors
+// below FD_SETSIZE, and every connection takes two
+#define SIMULATION_MAX_CLIENTS 480
+
+// A Server driven one listen pass at a time from the calling thread, with
+// no listening socket and no threads of its own. Clients are socketpairs
+// and time is a virtual clock that only moves when told to, so a run
+// depends only on its commands: the same script gives the same bytes.
+//
+// Script commands, one per line ('#' starts a comment):
+//   connect <name>              new client
+//   send <name> <frame>         queue a frame from name, unhandled yet
+//   step                        let the server handle everything queued
+//   advance <ms>                move the virtual clock
+//   expect <name> <frame>       next frame name received must match
+//   skip <name>                 forget what name received so far
+//   drop <name>                 close name's end of the connection
+//   population <prefix> <n>     connect prefix0..prefix<n-1>, nicknamed
+//                               after themselves
+//   each <prefix> <frame>       send from every client of the population,
+//                               with {i} replaced by the client's index
+//   print <name>                show the frames name received
+class Simulation {
+private:
+  struct Client {
+    std::string name;
+    int descriptor;
+    // Nickname last reported by the server (/youare)
+    std::string nickname;
+    std::string received;
+    // Start of the first frame expect hasn't consumed
+    size_t consumed = 0;
+    // Start of the first frame not checked for a nickname yet
+    size_t scanned = 0;
+    bool isOpen = true;
+  };
+  Server *server;
+  std::vector<Client> clients;
+  std::unordered_map<std::string, size_t> clientsByName;
+  std::unordered_map<std::string, size_t> populations;
+  uint64_t passes = 0;
+  static int64_t virtualTime;
+  static int64_t virtualClock();
+
+  Client *find(const std::string &name, std::string &error);
+  void drain(Client &client);
+  std::vector<Client *> population(const std::string &prefix,
+                                   std::string &error);
+
+public:
+  // config is used as is, except that fan-out stays on this thread
+  explicit Simulation(ServerConfig config);
+  ~Simulation();
+  int connect(const std::string &name, std::string &error);
+  int send(const std::string &name, const std::string &frame,
+           std::string &error);
+  // Runs listen passes until no input is left and collects the replies
+  void step();
+  void advance(int64_t milliseconds);
+  int expect(const std::string &name, const std::string &frame,
+             std::string &error);
+  int drop(const std::string &name, std::string &error);
+  // Frames received by name not consumed by expect
+  std::vector<std::string> pending(const std::string &name);
+  // Current nickname of name's client, "" if unknown
+  std::string nickname(const std::string &name);
+  // Runs one script command. Returns 0, or -1 with error set.
+  int run(const std::string &command, std::string &error);
+  // Runs every command of script, stopping at the first failing one
+  int runScript(std::istream &script, std::string &error);
+  size_t size();
+  uint64_t listenPasses();
+  // Bytes the server wrote to every client
+  uint64_t bytesReceived();
+  // FNV-1a of every client's received bytes, in connection order
+  uint64_t digest();
+};
+
+#endif
@@ -0,0 +1,425 @@
+#include "Snapshot.hpp"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_INITIAL_CLIENTS 256
+#define SNAPSHOT_INITIAL_CHANNELS 64
+#define SNAPSHOT_INITIAL_MEMBERSHIPS 512
+#define SNAPSHOT_INITIAL_HISTORY (256 << 10)
+
+static const char SNAPSHOT_MAGIC[8] = {'I', 'R', 'C', 'S', 'N', 'A', 'P', '1'};
+
+static uint64_t align8(uint64_t offset) { return (offset + 7) & ~(uint64_t)7; }
+
+Snapshot::~Snapshot() { this->close(); }
+
+SnapshotHeader *Snapshot::header() { return (SnapshotHeader *)data; }
+
+SnapshotClient *Snapshot::clients() {
+  return (SnapshotClient *)(data + header()->clientTable);
+}
+
+SnapshotChannel *Snapshot::channels() {
+  return (SnapshotChannel *)(data + header()->channelTable);
+}
+
+SnapshotMembership *Snapshot::memberships() {
+  return (SnapshotMembership *)(data + header()->membershipTable);
+}
+
+void Snapshot::release() {
+  if (data != nullptr) {
+    munmap(data, size);
+    data = nullptr;
+    size = 0;
+  }
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+// Moves the snapshot to a new mapping with the given capacities, keeping
+// every record in its slot and compacting the history area. Files are
+// rebuilt beside the old one and renamed over it, so a crash leaves either
+// the old or the new layout.
+int Snapshot::relayout(uint32_t clientSlots, uint32_t channelSlots,
+                       uint32_t membershipSlots, size_t historyCapacity) {
+  uint64_t clientTable = align8(sizeof(SnapshotHeader));
+  uint64_t channelTable =
+      align8(clientTable + (uint64_t)clientSlots * sizeof(SnapshotClient));
+  uint64_t membershipTable =
+      align8(channelTable + (uint64_t)channelSlots * sizeof(SnapshotChannel));
+  uint64_t historyArea = align8(
+      membershipTable + (uint64_t)membershipSlots * sizeof(SnapshotMembership));
+  size_t newSize = historyArea + historyCapacity;
+
+  std::string temporaryPath = path + ".tmp";
+  int newFd = -1;
+  void *mapping;
+
+  if (path.empty()) {
+    mapping = mmap(nullptr, newSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    newFd = ::open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (newFd == -1 || ftruncate(newFd, (off_t)newSize) == -1) {
+      if (newFd != -1) {
+        ::close(newFd);
+      }
+      return -1;
+    }
+    mapping =
+        mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, newFd, 0);
+  }
+
+  if (mapping == MAP_FAILED) {
+    if (newFd != -1) {
+      ::close(newFd);
+    }
+    return -1;
+  }
+
+  char *newData = (char *)mapping;
+  SnapshotHeader *newHeader = (SnapshotHeader *)newData;
+  memcpy(newHeader->magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+  newHeader->clientSlots = clientSlots;
+  newHeader->channelSlots = channelSlots;
+  newHeader->membershipSlots = membershipSlots;
+  newHeader->clientTable = clientTable;
+  newHeader->channelTable = channelTable;
+  newHeader->membershipTable = membershipTable;
+  newHeader->historyArea = historyArea;
+  newHeader->historyEnd = historyArea;
+
+  uint32_t oldClientSlots = 0;
+  uint32_t oldChannelSlots = 0;
+  uint32_t oldMembershipSlots = 0;
+
+  if (data != nullptr) {
+    oldClientSlots = header()->clientSlots;
+    oldChannelSlots = header()->channelSlots;
+    oldMembershipSlots = header()->membershipSlots;
+
+    memcpy(newData + clientTable, clients(),
+           oldClientSlots * sizeof(SnapshotClient));
+    memcpy(newData + channelTable, channels(),
+           oldChannelSlots * sizeof(SnapshotChannel));
+    memcpy(newData + membershipTable, memberships(),
+           oldMembershipSlots * sizeof(SnapshotMembership));
+
+    SnapshotChannel *newChannels = (SnapshotChannel *)(newData + channelTable);
+    for (uint32_t slot = 0; slot < oldChannelSlots; slot++) {
+      SnapshotChannel &channel = newChannels[slot];
+      if (channel.inUse && channel.historyBytes > 0) {
+        memcpy(newData + newHeader->historyEnd, data + channel.historyOffset,
+               channel.historyBytes);
+        channel.historyOffset = newHeader->historyEnd;
+        newHeader->historyEnd += channel.historyBytes;
+      }
+    }
+  }
+
+  // Lowest slots are handed out first
+  for (uint32_t slot = clientSlots; slot-- > oldClientSlots;) {
+    freeClients.push_back(slot);
+  }
+  for (uint32_t slot = channelSlots; slot-- > oldChannelSlots;) {
+    freeChannels.push_back(slot);
+  }
+  for (uint32_t slot = membershipSlots; slot-- > oldMembershipSlots;) {
+    freeMemberships.push_back(slot);
+  }
+
+  if (!path.empty() && rename(temporaryPath.c_str(), path.c_str()) == -1) {
+    munmap(mapping, newSize);
+    ::close(newFd);
+    return -1;
+  }
+
+  release();
+  data = newData;
+  size = newSize;
+  fd = newFd;
+  return 0;
+}
+
+int Snapshot::create(std::string path) {
+  std::lock_guard<std::mutex> lock(mutex);
+  release();
+  this->path = path;
+  historyLive = 0;
+  freeClients.clear();
+  freeChannels.clear();
+  freeMemberships.clear();
+  return relayout(SNAPSHOT_INITIAL_CLIENTS, SNAPSHOT_INITIAL_CHANNELS,
+                  SNAPSHOT_INITIAL_MEMBERSHIPS, SNAPSHOT_INITIAL_HISTORY);
+}
+
+void Snapshot::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data != nullptr && fd != -1) {
+    msync(data, size, MS_SYNC);
+  }
+  release();
+}
+
+bool Snapshot::isOpen() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return data != nullptr;
+}
+
+// Pops a free slot, doubling the table it belongs to when there is none
+uint32_t Snapshot::allocate(std::vector<uint32_t> &freeSlots) {
+  if (freeSlots.empty()) {
+    SnapshotHeader *current = header();
+    uint32_t clientSlots = current->clientSlots;
+    uint32_t channelSlots = current->channelSlots;
+    uint32_t membershipSlots = current->membershipSlots;
+
+    if (&freeSlots == &freeClients) {
+      clientSlots *= 2;
+    } else if (&freeSlots == &freeChannels) {
+      channelSlots *= 2;
+    } else {
+      membershipSlots *= 2;
+    }
+
+    if (relayout(clientSlots, channelSlots, membershipSlots,
+                 size - current->historyArea) != 0) {
+      return SNAPSHOT_NONE;
+    }
+  }
+
+  uint32_t slot = freeSlots.back();
+  freeSlots.pop_back();
+  return slot;
+}
+
+uint32_t Snapshot::putClient(uint32_t slot, const Nickname &nickname,
+                             uint32_t activeChannel) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data == nullptr) {
+    return SNAPSHOT_NONE;
+  }
+  if (slot == SNAPSHOT_NONE &&
+      (slot = allocate(freeClients)) == SNAPSHOT_NONE) {
+    return SNAPSHOT_NONE;
+  }
+
+  SnapshotClient &record = clients()[slot];
+  record.inUse = 1;
+  record.activeChannel = activeChannel;
+  record.nicknameLength =
+      (uint32_t)std::min(nickname.size(), (size_t)SNAPSHOT_NICKNAME_SIZE);
+  memcpy(record.nickname, nickname.data(), record.nicknameLength);
+  return slot;
+}
+
+uint32_t Snapshot::putChannel(uint32_t slot, const ChannelName &name,
+                              const Nickname &admin) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data == nullptr) {
+    return SNAPSHOT_NONE;
+  }
+  if (slot == SNAPSHOT_NONE &&
+      (slot = allocate(freeChannels)) == SNAPSHOT_NONE) {
+    return SNAPSHOT_NONE;
+  }
+
+  SnapshotChannel &record = channels()[slot];
+  record.inUse = 1;
+  record.nameLength =
+      (uint32_t)std::min(name.size(), (size_t)SNAPSHOT_CHANNEL_SIZE);
+  memcpy(record.name, name.data(), record.nameLength);
+  record.adminLength =
+      (uint32_t)std::min(admin.size(), (size_t)SNAPSHOT_NICKNAME_SIZE);
+  memcpy(record.admin, admin.data(), record.adminLength);
+  return slot;
+}
+
+uint32_t Snapshot::putMembership(uint32_t slot, uint32_t client,
+                                 uint32_t channel, uint32_t flags) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data == nullptr) {
+    return SNAPSHOT_NONE;
+  }
+  if (slot == SNAPSHOT_NONE &&
+      (slot = allocate(freeMemberships)) == SNAPSHOT_NONE) {
+    return SNAPSHOT_NONE;
+  }
+
+  SnapshotMembership &record = memberships()[slot];
+  record.inUse = 1;
+  record.client = client;
+  record.channel = channel;
+  record.flags = flags;
+  return slot;
+}
+
+void Snapshot::putHistory(uint32_t channel,
+                          const std::vector<const std::string *> &frames) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data == nullptr || channel >= header()->channelSlots) {
+    return;
+  }
+
+  size_t total = 0;
+  for (auto frame : frames) {
+    total += frame->size();
+  }
+
+  if (header()->historyEnd + total > size) {
+    size_t capacity =
+        std::max((size_t)SNAPSHOT_INITIAL_HISTORY, 2 * (historyLive + total));
+    if (relayout(header()->clientSlots, header()->channelSlots,
+                 header()->membershipSlots, capacity) != 0) {
+      return;
+    }
+  }
+
+  SnapshotChannel &record = channels()[channel];
+  historyLive -= record.historyBytes;
+
+  char *destination = data + header()->historyEnd;
+  for (auto frame : frames) {
+    memcpy(destination, frame->data(), frame->size());
+    destination += frame->size();
+  }
+
+  record.historyOffset = total == 0 ? 0 : header()->historyEnd;
+  record.historyBytes = total;
+  record.historyFrames = (uint32_t)frames.size();
+  header()->historyEnd += total;
+  historyLive += total;
+}
+
+void Snapshot::removeClient(uint32_t slot) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data != nullptr && slot < header()->clientSlots) {
+    clients()[slot].inUse = 0;
+    freeClients.push_back(slot);
+  }
+}
+
+void Snapshot::removeChannel(uint32_t slot) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data != nullptr && slot < header()->channelSlots) {
+    SnapshotChannel &record = channels()[slot];
+    historyLive -= record.historyBytes;
+    record.inUse = 0;
+    record.historyOffset = 0;
+    record.historyBytes = 0;
+    record.historyFrames = 0;
+    freeChannels.push_back(slot);
+  }
+}
+
+void Snapshot::removeMembership(uint32_t slot) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data != nullptr && slot < header()->membershipSlots) {
+    memberships()[slot].inUse = 0;
+    freeMemberships.push_back(slot);
+  }
+}
+
+void Snapshot::sync() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data != nullptr && fd != -1) {
+    msync(data, size, MS_ASYNC);
+  }
+}
+
+std::string Snapshot::image() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (data == nullptr) {
+    return "";
+  }
+  return std::string(data, header()->historyEnd);
+}
+
+SnapshotView::~SnapshotView() {
+  if (isMapped) {
+    munmap((void *)data, size);
+  }
+}
+
+int SnapshotView::attach(const char *data, size_t size) {
+  if (size < sizeof(SnapshotHeader)) {
+    return -1;
+  }
+
+  const SnapshotHeader *header = (const SnapshotHeader *)data;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC) != 0 ||
+      header->clientTable + (uint64_t)header->clientSlots *
+                                sizeof(SnapshotClient) > size ||
+      header->channelTable + (uint64_t)header->channelSlots *
+                                 sizeof(SnapshotChannel) > size ||
+      header->membershipTable + (uint64_t)header->membershipSlots *
+                                    sizeof(SnapshotMembership) > size ||
+      header->historyArea > header->historyEnd || header->historyEnd > size) {
+    return -1;
+  }
+
+  this->data = data;
+  this->size = size;
+  return 0;
+}
+
+int SnapshotView::map(std::string path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1 || info.st_size == 0) {
+    ::close(fd);
+    return -1;
+  }
+
+  void *mapping =
+      mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    return -1;
+  }
+
+  if (attach((const char *)mapping, (size_t)info.st_size) != 0) {
+    munmap(mapping, (size_t)info.st_size);
+    return -1;
+  }
+  isMapped = true;
+  return 0;
+}
+
+const SnapshotHeader *SnapshotView::header() {
+  return (const SnapshotHeader *)data;
+}
+
+const SnapshotClient *SnapshotView::clients() {
+  return (const SnapshotClient *)(data + header()->clientTable);
+}
+
+const SnapshotChannel *SnapshotView::channels() {
+  return (const SnapshotChannel *)(data + header()->channelTable);
+}
+
+const SnapshotMembership *SnapshotView::memberships() {
+  return (const SnapshotMembership *)(data + header()->membershipTable);
+}
+
+const char *SnapshotView::history(const SnapshotChannel &channel,
+                                  size_t &length) {
+  length = 0;
+  if (channel.historyBytes == 0 ||
+      channel.historyOffset < header()->historyArea ||
+      channel.historyOffset + channel.historyBytes > header()->historyEnd) {
+    return nullptr;
+  }
+  length = channel.historyBytes;
+  return data + channel.historyOffset;
+}
@@ -0,0 +1,138 @@
+#ifndef _SNAPSHOT_HPP_
+#define _SNAPSHOT_HPP_
+
+#include "InlineString.hpp"
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Slot number of an object that has no record in the snapshot
+#define SNAPSHOT_NONE UINT32_MAX
+#define SNAPSHOT_NICKNAME_SIZE 64
+#define SNAPSHOT_CHANNEL_SIZE 208
+static_assert(NICKNAME_CAPACITY <= SNAPSHOT_NICKNAME_SIZE &&
+                  CHANNEL_NAME_CAPACITY <= SNAPSHOT_CHANNEL_SIZE,
+              "snapshot records must hold the longest names");
+
+#define SNAPSHOT_ADMIN 1
+#define SNAPSHOT_MUTED 2
+
+// A snapshot is a header followed by three tables of fixed-size records
+// (clients, channels, memberships) and a history area. Records refer to
+// each other by slot number, so a loader can use the tables in place.
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t clientSlots;
+  uint32_t channelSlots;
+  uint32_t membershipSlots;
+  uint32_t padding;
+  uint64_t clientTable;
+  uint64_t channelTable;
+  uint64_t membershipTable;
+  uint64_t historyArea;
+  // End of the used part of the history area
+  uint64_t historyEnd;
+};
+
+struct SnapshotClient {
+  uint32_t inUse;
+  // Slot of the active channel or SNAPSHOT_NONE
+  uint32_t activeChannel;
+  uint32_t nicknameLength;
+  char nickname[SNAPSHOT_NICKNAME_SIZE];
+};
+
+struct SnapshotChannel {
+  uint32_t inUse;
+  uint32_t nameLength;
+  uint32_t adminLength;
+  // Frames stored back to back at historyOffset, each one delimited
+  uint32_t historyFrames;
+  uint64_t historyOffset;
+  uint64_t historyBytes;
+  char name[SNAPSHOT_CHANNEL_SIZE];
+  char admin[SNAPSHOT_NICKNAME_SIZE];
+};
+
+struct SnapshotMembership {
+  uint32_t inUse;
+  uint32_t client;
+  uint32_t channel;
+  // SNAPSHOT_ADMIN and SNAPSHOT_MUTED bits
+  uint32_t flags;
+};
+
+// Live snapshot kept up to date record by record. Every put or remove
+// rewrites only the record concerned in an mmap'ed file (or anonymous
+// memory when no path is given); histories are appended to the history
+// area and the file is rebuilt only when a table or that area is full.
+class Snapshot {
+private:
+  std::mutex mutex;
+  std::string path;
+  int fd = -1;
+  char *data = nullptr;
+  size_t size = 0;
+  // Bytes of the history area still referenced by a channel
+  size_t historyLive = 0;
+  std::vector<uint32_t> freeClients;
+  std::vector<uint32_t> freeChannels;
+  std::vector<uint32_t> freeMemberships;
+
+  SnapshotHeader *header();
+  SnapshotClient *clients();
+  SnapshotChannel *channels();
+  SnapshotMembership *memberships();
+  void release();
+  int relayout(uint32_t clientSlots, uint32_t channelSlots,
+               uint32_t membershipSlots, size_t historyCapacity);
+  uint32_t allocate(std::vector<uint32_t> &freeSlots);
+
+public:
+  ~Snapshot();
+  // Starts an empty snapshot in the file at path, truncating it, or in
+  // memory when path is empty. Returns 0 on success or -1 on error.
+  int create(std::string path);
+  void close();
+  bool isOpen();
+  // put* write the record in slot, or in a new slot when slot is
+  // SNAPSHOT_NONE, and return the slot used. They do nothing and return
+  // SNAPSHOT_NONE while the snapshot is closed.
+  uint32_t putClient(uint32_t slot, const Nickname &nickname,
+                     uint32_t activeChannel);
+  uint32_t putChannel(uint32_t slot, const ChannelName &name,
+                      const Nickname &admin);
+  uint32_t putMembership(uint32_t slot, uint32_t client, uint32_t channel,
+                         uint32_t flags);
+  void putHistory(uint32_t channel,
+                  const std::vector<const std::string *> &frames);
+  void removeClient(uint32_t slot);
+  void removeChannel(uint32_t slot);
+  void removeMembership(uint32_t slot);
+  // Schedules the write-back of the file
+  void sync();
+  // Copy of the whole snapshot, e.g. to send it to another process
+  std::string image();
+};
+
+// Read-only access to a snapshot image, from a file mapped with mmap or
+// from memory. Records are used where they lie, without decoding.
+class SnapshotView {
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+  bool isMapped = false;
+
+public:
+  ~SnapshotView();
+  // Returns 0 if data holds a well-formed snapshot, -1 otherwise
+  int attach(const char *data, size_t size);
+  int map(std::string path);
+  const SnapshotHeader *header();
+  const SnapshotClient *clients();
+  const SnapshotChannel *channels();
+  const SnapshotMembership *memberships();
+  // History frames of channel, back to back; nullptr when it has none
+  const char *history(const SnapshotChannel &channel, size_t &length);
+};
+
+#endif
@@ -1,5 +1,5 @@
 #include "Socket.hpp"
-#include "interface.hpp"
+#include "Metrics.hpp"
 #include "util.hpp"
 
 
@@ -97,6 +97,14 @@
  *   - shutdown(): desativa uma parte específica de uma conexão de socket.
  */
 
+#include <sys/uio.h>
+/*
+ * Biblioteca para operações de entrada e saída com múltiplos buffers.
+ *
+ * Estruturas:
+ *   - iovec: descreve um buffer (endereço e tamanho) usado por sendmsg().
+ */
+
 #include <sys/un.h>
 /*
  * Biblioteca para manipulação de sockets UNIX.
@@ -150,6 +158,53 @@ MySocket::MySocket(int domain, int type, int protocol) {
   ipAddress = "";
 }
 
+// Parâmetros:
+//   - socketFD: descritor de um socket já existente, por exemplo recebido de outro processo.
+//
+// Retorno:
+//   - adopted: novo MySocket que passa a ser dono do descritor.
+//
+// Comportamento:
+//   - Utiliza o construtor privado, que não cria um novo socket.
+//   - Chama a função getsockname() para descobrir a família do socket e getsockopt() com SO_TYPE para descobrir o tipo.
+//   - Chama a função getpeername() e, se o socket estiver conectado, guarda o endereço IP do outro lado no formato numérico.
+//   - Em caso de erro, chama a função safeExitFailure() para lidar com o erro.
+MySocket *MySocket::fromDescriptor(int socketFD) {
+  struct sockaddr_storage address;
+  socklen_t addressLength = sizeof address;
+  int type;
+  socklen_t typeLength = sizeof type;
+
+  if (getsockname(socketFD, (struct sockaddr *)&address, &addressLength) ==
+          -1 ||
+      getsockopt(socketFD, SOL_SOCKET, SO_TYPE, &type, &typeLength) == -1) {
+    safeExitFailure("Error adopting socket: " + std::string(strerror(errno)),
+                    errno);
+  }
+
+  MySocket *adopted = new MySocket();
+  adopted->socketFD = socketFD;
+  adopted->addressInfo.ai_family = address.ss_family;
+  adopted->addressInfo.ai_socktype = type;
+
+  addressLength = sizeof address;
+  char host[NI_MAXHOST];
+  if (getpeername(socketFD, (struct sockaddr *)&address, &addressLength) ==
+          0 &&
+      getnameinfo((struct sockaddr *)&address, addressLength, host,
+                  sizeof host, NULL, 0, NI_NUMERICHOST) == 0) {
+    adopted->ipAddress = host;
+  }
+  return adopted;
+}
+
+MySocket::MySocket() {
+  memset(&addressInfo, 0, sizeof addressInfo);
+  socketFD = -1;
+  portNumber = "";
+  ipAddress = "";
+}
+
 // MySocket::socketbind()
 //
 // Descrição: Associa o endereço IP e a porta especificados ao socket.
@@ -400,9 +455,9 @@ MySocket *MySocket::accept() {
 //   - Verifica se ocorreu um erro na chamada à função getsockopt() ou se o código de erro não é zero.
 //     - Em caso afirmativo, retorna -2 para indicar um erro.
 //   - Chama a função send() para enviar a mensagem pelo socket, passando o socketFD, a mensagem convertida para uma sequência de caracteres, o tamanho da mensagem e a flag 0.
-//   - Verifica se ocorreu um erro na chamada à função send(). Em caso afirmativo, chama a função safeExitFailure() para lidar com o erro.
+//   - Verifica se ocorreu um erro na chamada à função send(). Em caso afirmativo, retorna -2 com errno indicando o erro (por exemplo EPIPE quando o par já fechou a conexão), sem encerrar o programa.
 //   - Retorna o valor de status, que representa o número de bytes enviados.
-int MySocket::socketWrite(std::string message) {
+int MySocket::socketWrite(const std::string &message) {
 
   int error = 0;
   socklen_t len = sizeof(error);
@@ -412,44 +467,138 @@ int MySocket::socketWrite(std::string message) {
     return -2;
   }
 
-  int status = (int)send(socketFD, message.c_str(), message.size(), 0);
+  int status;
+  do {
+    status = (int)send(socketFD, message.c_str(), message.size(), MSG_NOSIGNAL);
+  } while (status == -1 && errno == EINTR);
 
-  if (status == -1) {
-    safeExitFailure("Error writing to socket: " + std::string(strerror(errno)),
-                    errno);
+  return status == -1 ? -2 : status;
+}
+
+// Parâmetros:
+//   - messages: mensagens a serem enviadas pelo socket, na ordem do vetor.
+//   - offset: bytes do início da primeira mensagem que já foram enviados e são pulados.
+//
+// Retorno:
+//   - total: número de bytes enviados em caso de sucesso e -2 se o socket tiver um erro pendente ou se o envio falhar. Em um socket não-bloqueante, pode ser menor que o tamanho das mensagens (até 0) se o socket encher.
+//
+// Comportamento:
+//   - Monta um vetor de iovec apontando para o conteúdo de cada mensagem, sem copiá-las.
+//   - Chama a função sendmsg() com até IOV_MAX buffers por vez, de modo que todas as mensagens saiam em uma única escrita sempre que possível.
+//   - Em caso de envio parcial, descarta os buffers já enviados, ajusta o primeiro buffer restante e repete o envio.
+//   - Se sendmsg() falhar com EAGAIN ou EWOULDBLOCK, para e retorna o que já foi enviado; o chamador envia o resto quando o socket puder ser escrito.
+//   - Verifica se ocorreu um erro na chamada à função sendmsg(). Em caso afirmativo (por exemplo EPIPE ou ECONNRESET), retorna -2 com errno indicando o erro; EINTR apenas repete o envio.
+int MySocket::socketWriteBatch(
+    const std::vector<const std::string *> &messages, size_t offset) {
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  int ret = getsockopt(socketFD, SOL_SOCKET, SO_ERROR, &error, &len);
+
+  if (ret != 0 || error != 0) {
+    return -2;
   }
-  return status;
+
+  std::vector<struct iovec> buffers;
+  for (auto message : messages) {
+    if (message->size() > offset) {
+      struct iovec buffer;
+      buffer.iov_base = (void *)(message->data() + offset);
+      buffer.iov_len = message->size() - offset;
+      buffers.push_back(buffer);
+    }
+    offset = 0;
+  }
+
+  int total = 0;
+  size_t first = 0;
+  while (first < buffers.size()) {
+    struct msghdr header;
+    memset(&header, 0, sizeof header);
+    header.msg_iov = &buffers[first];
+    header.msg_iovlen = std::min(buffers.size() - first, (size_t)IOV_MAX);
+
+    ssize_t sent = sendmsg(socketFD, &header, MSG_NOSIGNAL);
+
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return total;
+      }
+      return -2;
+    }
+    total += (int)sent;
+
+    while (sent > 0) {
+      if ((size_t)sent >= buffers[first].iov_len) {
+        sent -= buffers[first].iov_len;
+        first++;
+      } else {
+        buffers[first].iov_base = (char *)buffers[first].iov_base + sent;
+        buffers[first].iov_len -= sent;
+        sent = 0;
+      }
+    }
+  }
+  return total;
+}
+
+// Parâmetros:
+//   - buffer: buffer do chamador onde os dados lidos serão armazenados.
+//   - length: tamanho do buffer.
+//
+// Retorno:
+//   - status: número de bytes lidos; SOCKET_EOF (0) se o par fechou a conexão, SOCKET_AGAIN se ainda não há dados e SOCKET_ERROR em caso de erro, com errno indicando o erro.
+//
+// Comportamento:
+//   - Chama a função recv() diretamente sobre o buffer do chamador, sem alocar, zerar ou copiar memória.
+//   - EAGAIN, EWOULDBLOCK e EINTR resultam em SOCKET_AGAIN; qualquer outro erro (por exemplo ECONNRESET) resulta em SOCKET_ERROR, sem encerrar o programa.
+ssize_t MySocket::socketReadInto(char *buffer, size_t length) {
+  ssize_t status = recv(socketFD, buffer, length, 0);
+  if (status >= 0) {
+    return status;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+             ? SOCKET_AGAIN
+             : SOCKET_ERROR;
 }
 
+// Parâmetros:
+//   - buffers: vetor de iovec do chamador, preenchidos em ordem.
+//   - count: número de elementos de buffers.
+//
+// Retorno:
+//   - status: o mesmo de socketReadInto(), com o total de bytes lidos em todos os buffers.
+//
+// Comportamento:
+//   - Chama a função readv() para preencher vários buffers com uma única chamada de sistema, por exemplo o final de um buffer parcial seguido de um buffer novo.
+ssize_t MySocket::socketReadVector(const struct iovec *buffers, int count) {
+  ssize_t status = readv(socketFD, buffers, count);
+  if (status >= 0) {
+    return status;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+             ? SOCKET_AGAIN
+             : SOCKET_ERROR;
+}
 
 // Parâmetros:
 //   - buffer: referência para uma string onde os dados lidos serão armazenados.
 //   - length: tamanho máximo a ser lido do socket.
 //
 // Retorno:
-//   - status: Retorna o número de bytes lidos em caso de sucesso e -1 em caso de erro.
+//   - status: o mesmo de socketReadInto().
 //
 // Comportamento:
-//   - Aloca um buffer temporário de caracteres (char) com o tamanho especificado.
-//   - Limpa o buffer temporário.
-//   - Chama a função recv() para ler dados do socket, passando o socketFD, o buffer temporário, o tamanho a ser lido (length - 1) e a flag 0.
-//   - Verifica se ocorreu um erro na chamada à função recv(). Em caso afirmativo, chama a função safeExitFailure() para lidar com o erro.
-//   - Copia o conteúdo do buffer temporário para a string de destino (buffer).
-//   - Libera a memória alocada para o buffer temporário.
-//   - Retorna o valor de status, que representa o número de bytes lidos.
-
+//   - Lê até length - 1 bytes em um buffer na pilha com socketReadInto() e copia para buffer apenas os bytes lidos; buffer fica vazio se nada foi lido.
 int MySocket::socketRead(std::string &buffer, int length) {
-  char *buff = new char[length];
-  memset(buff, 0, length);
-  int status = (int)recv(socketFD, buff, length - 1, 0);
-  if (status == -1) {
-    safeExitFailure(
-        "Error reading from socket: " + std::string(strerror(errno)), errno);
-  }
-
-  buffer = std::string(buff);
-  delete[] buff;
-  return status;
+  char chunk[SOCKET_READ_CHUNK];
+  ssize_t status =
+      socketReadInto(chunk, std::min((size_t)length - 1, sizeof chunk));
+  buffer.assign(chunk, status > 0 ? status : 0);
+  return (int)status;
 }
 
 // Parâmetros:
@@ -458,43 +607,24 @@ int MySocket::socketRead(std::string &buffer, int length) {
 //   - timeout: tempo máximo em segundos para esperar por dados no socket.
 //
 // Retorno:
-//   - status: inteiro representando o resultado da operação. Retorna o número de bytes lidos em caso de sucesso, -1 em caso de timeout e -2 em caso de erro.
+//   - status: o mesmo de socketRead(); SOCKET_AGAIN também em caso de timeout.
 //
 // Comportamento:
 //   - Cria um vetor de ponteiros SocketWithInfo para leitura (reads) e adiciona um elemento ao vetor contendo informações do socket atual.
 //   - Chama a função select() para esperar até que o socket esteja pronto para leitura, usando o vetor reads, nullptr para o vetor de escrita (writes) e exceção (excepts), e o tempo limite especificado.
-//   - Verifica se ocorreu um timeout, retornando -1 se nenhum socket estiver pronto para leitura.
-//   - Aloca um buffer temporário de caracteres (char) com o tamanho especificado.
-//   - Limpa o buffer temporário.
-//   - Chama a função recv() para ler dados do socket, passando o socketFD, o buffer temporário, o tamanho a ser lido (length - 1) e a flag 0.
-//   - Verifica se ocorreu um erro na chamada à função recv(). Em caso afirmativo, chama a função safeExitFailure() para lidar com o erro.
-//   - Copia o conteúdo do buffer temporário para a string de destino (buffer).
-//   - Libera a memória alocada para o buffer temporário.
-//   - Retorna o valor de status, que representa o número de bytes lidos.
+//   - Verifica se ocorreu um timeout, retornando SOCKET_AGAIN se nenhum socket estiver pronto para leitura.
+//   - Caso contrário, lê com socketRead().
 int MySocket::socketSafeRead(std::string &buffer, int length, int timeout) {
   std::vector<SocketWithInfo *> reads;
-  auto clientInfo = new SocketWithInfo(this, false);
-  reads.push_back(clientInfo);
+  SocketWithInfo clientInfo(this, false);
+  reads.push_back(&clientInfo);
   int count = MySocket::select(&reads, nullptr, nullptr, timeout);
 
-  delete clientInfo;
-
   if (count < 1) {
-
     buffer = "";
-    return -1;
-  }
-
-  char *buff = new char[length];
-  memset(buff, 0, length);
-  int status = (int)recv(socketFD, buff, length - 1, 0);
-  if (status < 0) {
-    safeExitFailure(
-        "Error reading from socket: " + std::string(strerror(errno)), errno);
+    return SOCKET_AGAIN;
   }
-  buffer = std::string(buff);
-  delete[] buff;
-  return status;
+  return socketRead(buffer, length);
 }
 
 // Parâmetros:
@@ -545,7 +675,11 @@ int MySocket::socketGetOpt(int level, int optName, void *optVal) {
 
 // Comportamento:
 //   - Chama a função close() para fechar o socketFD.
-void MySocket::close() { ::close(socketFD); }
+//   - Atribui -1 a socketFD, já que o número pode ser reutilizado pelo próximo socket aberto.
+void MySocket::close() {
+  ::close(socketFD);
+  socketFD = -1;
+}
 
 
 // Parâmetros:
@@ -599,19 +733,11 @@ int MySocket::setBlocking(bool blocking) {
 //
 // Comportamento:
 //   - Chama a função shutdown() para desligar uma parte da conexão do socket, passando o socketFD e a parte da conexão (how).
-//   - Verifica se ocorreu um erro na chamada à função shutdown(). Em caso afirmativo, chama a função safeExitFailure() para lidar com o erro.
+//   - Em caso de erro, retorna -1 com errno indicando o erro. Um par que já desconectou (ENOTCONN) não é motivo para encerrar o programa.
 //   - Retorna o valor de status, que representa o resultado da operação.
 
 
-int MySocket::socketShutdown(int how) {
-  int status = ::shutdown(socketFD, how);
-
-  if (status < 0) {
-    safeExitFailure(
-        "Error shutting down socket: " + std::string(strerror(errno)), errno);
-  }
-  return status;
-}
+int MySocket::socketShutdown(int how) { return ::shutdown(socketFD, how); }
 
 // Descrição: Espera até que um ou mais sockets estejam prontos para leitura, escrita ou exceção.
 //
@@ -639,13 +765,24 @@ int MySocket::select(std::vector<SocketWithInfo *> *reads,
                      std::vector<SocketWithInfo *> *excepts, int timeout) {
 
   struct timeval timeValue;
+  timeValue.tv_sec = timeout;
+  timeValue.tv_usec = 0;
+  return MySocket::select(reads, writes, excepts, timeValue);
+}
+
+// Descrição: O mesmo que o select() acima, com o tempo máximo de espera em uma estrutura timeval, para esperas de frações de segundo.
+//
+// Parâmetros:
+//   - timeout: tempo máximo a esperar pelos sockets; zero não espera.
+int MySocket::select(std::vector<SocketWithInfo *> *reads,
+                     std::vector<SocketWithInfo *> *writes,
+                     std::vector<SocketWithInfo *> *excepts,
+                     struct timeval timeValue) {
+
   fd_set readFDs;
   fd_set writeFDs;
   fd_set exceptFDs;
 
-  timeValue.tv_sec = timeout;
-  timeValue.tv_usec = 0;
-
   FD_ZERO(&readFDs);
 
   FD_ZERO(&writeFDs);
@@ -740,6 +877,30 @@ std::string MySocket::getIpAddress() {
   return std::string(ip);
 }
 
+// Retorno:
+//   - ip: string contendo o endereço IP do outro lado da conexão, ou uma string vazia se não for possível obtê-lo.
+//
+// Comportamento:
+//   - Se o endereço já é conhecido (socket aceito ou conectado por este processo), retorna-o.
+//   - Caso contrário (por exemplo, um socket recebido com fromDescriptor()), chama getpeername() e converte o endereço com getnameinfo(), guardando o resultado.
+std::string MySocket::getPeerAddress() {
+  if (ipAddress != "") {
+    return ipAddress;
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  char host[NI_MAXHOST];
+
+  if (getpeername(socketFD, (struct sockaddr *)&addr, &len) == -1 ||
+      getnameinfo((struct sockaddr *)&addr, len, host, sizeof host, NULL, 0,
+                  NI_NUMERICHOST) != 0) {
+    return "";
+  }
+  ipAddress = host;
+  return ipAddress;
+}
+
 // Parâmetros:
 //   - socket: um ponteiro para o objeto MySocket associado ao SocketWithInfo.
 //   - isClient: um valor booleano que indica se o SocketWithInfo representa um cliente ou não.
@@ -750,4 +911,21 @@ std::string MySocket::getIpAddress() {
 SocketWithInfo::SocketWithInfo(MySocket *socket, bool isClient) {
   this->socket = socket;
   this->isClient = isClient;
-}
\ No newline at end of file
+  this->lastActivity = Metrics::now();
+  this->outbound.setAccount(&memory);
+}
+
+// Comportamento:
+//   - Incrementa pins, impedindo que o descritor seja fechado enquanto quem o chamou ainda pode escrever nele.
+void SocketWithInfo::pin() { pins++; }
+
+// Comportamento:
+//   - Decrementa pins e, se foi a última referência, fecha o socket e libera a conexão com tudo o que ela guarda.
+//   - Só a última referência pode ser solta depois que as filas de saída foram fechadas (OutboundLanes::close()); quem a soltar não pode mais usar o objeto.
+void SocketWithInfo::unpin() {
+  if (--pins == 0) {
+    socket->close();
+    delete socket;
+    delete this;
+  }
+}
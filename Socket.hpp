@@ -1,8 +1,14 @@
 #ifndef _SOCKET_HPP_
 #define _SOCKET_HPP_
 
+#include "InlineString.hpp"
+#include "Outbound.hpp"
+#include "RateLimit.hpp"
+#include "Snapshot.hpp"
 #include <bits/stdc++.h>
 #include <netdb.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 /*
  * Biblioteca fornece funções e estruturas relacionadas à resolução de nomes de host,
  * obtenção de informações de endereço IP e outros recursos de rede. 
@@ -13,14 +19,67 @@
 
 class MySocket;
 
+// What a read returns instead of a byte count: the peer closed the
+// connection, there is no data yet (EAGAIN, EINTR or timeout), or the read
+// failed with errno set
+enum SocketReadStatus { SOCKET_EOF = 0, SOCKET_AGAIN = -1, SOCKET_ERROR = -2 };
+// Size of the stack buffer socketRead() and socketSafeRead() read into
+#define SOCKET_READ_CHUNK 8192
+
+// Per-channel state of a connection, one for every channel it has joined
+struct Membership {
+  bool isAdmin = false;
+  bool isMuted = false;
+  uint32_t snapshotSlot = SNAPSHOT_NONE;
+};
+
 struct SocketWithInfo {
-  std::string nickname;
+  Nickname nickname;
   MySocket *socket;
   bool isClient;
+  // Role in the active channel, as last reported by the server
   bool isAdmin = false;
   bool isMuted = false;
-  std::string channel = "";
+  // Active channel: target of /m and of the admin commands
+  ChannelName channel;
+  // Every channel this connection belongs to, keyed by channel name
+  std::unordered_map<ChannelName, Membership> memberships;
+  // Bytes received after the last complete frame
+  std::string readBuffer;
+  // Set once an oversized frame was dropped: input is discarded up to the
+  // next delimiter, where that frame ends
+  bool isDiscardingFrame = false;
+  // Fan-out jobs of messages sent by this connection not yet delivered
+  std::atomic<int> pendingFanouts{0};
+  // Holders of the connection: the server until it closes it, plus every
+  // fan-out job it sends or receives frames in. The last one to let go
+  // closes the descriptor and deletes the connection, so a job never
+  // writes to a reused number or freed memory.
+  std::atomic<int> pins{1};
+  // Set once the server closed the connection; nothing is sent to it then
+  std::atomic<bool> isClosed{false};
+  uint32_t snapshotSlot = SNAPSHOT_NONE;
+  // ID in the server's traffic capture, 0 until it is first captured
+  uint32_t captureId = 0;
+  // Flood control, owned by the server's listen thread
+  TokenBucket floodBuckets[FLOOD_CLASSES];
+  // TokenBucket::now() time before which the connection isn't read, 0
+  // while it isn't throttled
+  int64_t throttledUntil = 0;
+  // CPU receiving the connection's packets, -1 if not steered
+  int incomingCpu = -1;
+  // Frames waiting to be written, by priority
+  OutboundLanes outbound;
+  // Input of the connection, counted by the server's listen thread
+  std::atomic<uint64_t> bytesIn{0};
+  std::atomic<uint64_t> messagesIn{0};
+  // Metrics::now() of the last input, or of the connection until then
+  std::atomic<int64_t> lastActivity{0};
+  // Memory held by the connection; charged by the server for its clients
+  MemoryAccount memory;
   SocketWithInfo(MySocket *socket, bool isClient);
+  void pin();
+  void unpin();
 };
 
 class MySocket {
@@ -28,17 +87,26 @@ private:
   std::string ipAddress;
   std::string portNumber;
   struct addrinfo addressInfo;
+  MySocket();
   //parte da biblioteca netdb.h. Essa biblioteca fornece funções e estruturas relacionadas à resolução de nomes de host, obtenção de informações de endereço IP e outros recursos de rede. A estrutura addrinfo é usada para armazenar informações de endereço retornadas por funções como getaddrinfo().
 
 public:
   int socketFD;
 
   MySocket(int domain, int type, int protocol);
+  static MySocket *fromDescriptor(int socketFD);
   int socketbind(std::string ip, std::string port);
   int socketConnect(std::string ip, std::string port);
   int socketListen(int maxQueue);
   MySocket *accept();
-  int socketWrite(std::string msg);
+  int socketWrite(const std::string &msg);
+  int socketWriteBatch(const std::vector<const std::string *> &messages,
+                       size_t offset = 0);
+  ssize_t socketReadInto(char *buffer, size_t length);
+  template <size_t Length> ssize_t socketReadInto(char (&buffer)[Length]) {
+    return socketReadInto(buffer, Length);
+  }
+  ssize_t socketReadVector(const struct iovec *buffers, int count);
   int socketRead(std::string &buffer, int length);
   int socketSafeRead(std::string &buffer, int length, int timeout);
   int socketSetOpt(int level, int optName, void *optVal);
@@ -49,7 +117,12 @@ public:
   static int select(std::vector<SocketWithInfo *> *reads,
                     std::vector<SocketWithInfo *> *writes,
                     std::vector<SocketWithInfo *> *excepts, int timeout);
+  static int select(std::vector<SocketWithInfo *> *reads,
+                    std::vector<SocketWithInfo *> *writes,
+                    std::vector<SocketWithInfo *> *excepts,
+                    struct timeval timeout);
   std::string getIpAddress();
+  std::string getPeerAddress();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef _SPSC_QUEUE_HPP_
+#define _SPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. push() fails instead of waiting when the queue is full.
+template <typename T> class SpscQueue {
+private:
+  std::vector<T> slots;
+  size_t mask;
+  // Next slot to pop, written by the consumer only
+  std::atomic<size_t> head{0};
+  // Keeps head and tail on different cache lines
+  char padding[64 - sizeof(std::atomic<size_t>)];
+  // Next slot to push, written by the producer only
+  std::atomic<size_t> tail{0};
+
+public:
+  // Capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  bool push(T value) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    if (position - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    slots[position & mask] = std::move(value);
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    size_t position = head.load(std::memory_order_relaxed);
+    if (position == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slots[position & mask]);
+    head.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() { return mask + 1; }
+};
+
+#endif
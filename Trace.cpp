@@ -0,0 +1,132 @@
+#include "Trace.hpp"
+#include <errno.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Tracer::Buffer {
+  // Taken by the owning thread per span and by dump(), so it is almost
+  // never contended
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+  size_t next = 0;
+  long tid;
+  std::string threadName;
+};
+
+static thread_local uint64_t currentTrace = 0;
+
+std::mutex Tracer::buffersMutex;
+std::vector<Tracer::Buffer *> Tracer::buffers;
+std::atomic<size_t> Tracer::sampleEvery{0};
+std::atomic<uint64_t> Tracer::nextTrace{1};
+
+Tracer::Buffer *Tracer::threadBuffer() {
+  static thread_local Buffer *buffer = nullptr;
+
+  if (buffer == nullptr) {
+    buffer = new Buffer();
+    buffer->tid = syscall(SYS_gettid);
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffers.push_back(buffer);
+  }
+  return buffer;
+}
+
+void Tracer::setSampling(size_t every) { sampleEvery = every; }
+
+uint64_t Tracer::sample() {
+  static thread_local size_t reads = 0;
+  size_t every = sampleEvery.load(std::memory_order_relaxed);
+
+  if (every == 0 || ++reads % every != 0) {
+    return 0;
+  }
+  return nextTrace++;
+}
+
+uint64_t Tracer::current() { return currentTrace; }
+
+void Tracer::setCurrent(uint64_t trace) { currentTrace = trace; }
+
+void Tracer::record(const char *name, uint64_t trace, int64_t start,
+                    int64_t end) {
+  Buffer *buffer = threadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+
+  TraceEvent event = {name, trace, start, end};
+  if (buffer->events.size() < TRACE_BUFFER_EVENTS) {
+    buffer->events.push_back(event);
+  } else {
+    buffer->events[buffer->next] = event;
+  }
+  buffer->next = (buffer->next + 1) % TRACE_BUFFER_EVENTS;
+}
+
+void Tracer::nameThread(const char *name) {
+  Buffer *buffer = threadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  buffer->threadName = name;
+}
+
+static std::string microseconds(int64_t nanoseconds) {
+  char text[32];
+  snprintf(text, sizeof text, "%lld.%03lld",
+           (long long)(nanoseconds / 1000), (long long)(nanoseconds % 1000));
+  return text;
+}
+
+int Tracer::dump(std::string path) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return -1;
+  }
+
+  std::string pid = std::to_string(getpid());
+  bool isFirst = true;
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+
+  std::lock_guard<std::mutex> lock(buffersMutex);
+  for (auto buffer : buffers) {
+    std::vector<TraceEvent> events;
+    std::string threadName;
+    {
+      std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+      events = buffer->events;
+      threadName = buffer->threadName;
+    }
+    std::string tid = std::to_string(buffer->tid);
+
+    if (threadName != "") {
+      fprintf(file,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%s,"
+              "\"tid\":%s,\"args\":{\"name\":\"%s\"}}",
+              isFirst ? "" : ",", pid.c_str(), tid.c_str(),
+              threadName.c_str());
+      isFirst = false;
+    }
+
+    for (auto &event : events) {
+      fprintf(file,
+              "%s\n{\"name\":\"%s\",\"cat\":\"irc\",\"ph\":\"X\",\"ts\":%s,"
+              "\"dur\":%s,\"pid\":%s,\"tid\":%s,\"args\":{\"trace\":%llu}}",
+              isFirst ? "" : ",", event.name,
+              microseconds(event.start).c_str(),
+              microseconds(event.end - event.start).c_str(), pid.c_str(),
+              tid.c_str(), (unsigned long long)event.trace);
+      isFirst = false;
+    }
+  }
+
+  fputs("\n]}\n", file);
+  if (fclose(file) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int64_t Tracer::now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
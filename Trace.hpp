@@ -0,0 +1,111 @@
+#ifndef _TRACE_HPP_
+#define _TRACE_HPP_
+
+#include <bits/stdc++.h>
+#include <stdint.h>
+
+// Spans each thread keeps, the oldest being overwritten first
+#define TRACE_BUFFER_EVENTS 8192
+
+// Static probes for perf and bpftrace (provider "irc"), e.g.
+//   bpftrace -e 'usdt:./server:irc:multicast { @[str(arg0)] = count(); }'
+// Probes: multicast (channel, members), read (descriptor, bytes), message
+// (descriptor, length), fanout_job (recipients), write (descriptor, bytes)
+// Built as no-ops when systemtap's sys/sdt.h is not installed.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IRC_HAS_SDT 1
+#endif
+#endif
+
+#ifdef IRC_HAS_SDT
+#define IRC_PROBE1(name, a) DTRACE_PROBE1(irc, name, a)
+#define IRC_PROBE2(name, a, b) DTRACE_PROBE2(irc, name, a, b)
+#else
+#define IRC_PROBE1(name, a)                                                    \
+  do {                                                                         \
+    (void)(a);                                                                 \
+  } while (0)
+#define IRC_PROBE2(name, a, b)                                                 \
+  do {                                                                         \
+    (void)(a);                                                                 \
+    (void)(b);                                                                 \
+  } while (0)
+#endif
+
+struct TraceEvent {
+  // String literal
+  const char *name;
+  uint64_t trace;
+  int64_t start;
+  int64_t end;
+};
+
+// Sampled tracing of messages through the server. A thread that starts
+// handling input asks sample() whether to trace it; while a TraceContext
+// with a trace id is alive, TraceSpans on that thread are recorded in its
+// buffer. Unsampled input costs a thread-local check per span.
+class Tracer {
+private:
+  struct Buffer;
+  static std::mutex buffersMutex;
+  // Buffers of exited threads stay, their spans are still worth dumping
+  static std::vector<Buffer *> buffers;
+  static std::atomic<size_t> sampleEvery;
+  static std::atomic<uint64_t> nextTrace;
+  static Buffer *threadBuffer();
+
+public:
+  // Traces one read out of every; 0 turns tracing off
+  static void setSampling(size_t every);
+  // Id of a new trace, or 0 when this one isn't sampled
+  static uint64_t sample();
+  // Trace the calling thread is working for, 0 if none
+  static uint64_t current();
+  static void setCurrent(uint64_t trace);
+  static void record(const char *name, uint64_t trace, int64_t start,
+                     int64_t end);
+  // Shown as the thread's name in the trace viewer
+  static void nameThread(const char *name);
+  // Writes every buffered span as Chrome trace-event JSON (chrome://tracing
+  // or ui.perfetto.dev). Returns 0 on success or -1 with errno set.
+  static int dump(std::string path);
+  static int64_t now();
+};
+
+// Makes trace the current one of the thread until destroyed
+class TraceContext {
+private:
+  uint64_t previous;
+
+public:
+  TraceContext(uint64_t trace) {
+    previous = Tracer::current();
+    Tracer::setCurrent(trace);
+  }
+  ~TraceContext() { Tracer::setCurrent(previous); }
+};
+
+// Records the time from its construction to its destruction under name,
+// if the thread is working for a sampled trace
+class TraceSpan {
+private:
+  const char *name;
+  uint64_t trace;
+  int64_t start = 0;
+
+public:
+  TraceSpan(const char *name) : name(name), trace(Tracer::current()) {
+    if (trace != 0) {
+      start = Tracer::now();
+    }
+  }
+  ~TraceSpan() {
+    if (trace != 0) {
+      Tracer::record(name, trace, start, Tracer::now());
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "Watchdog.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <execinfo.h>
+#include <signal.h>
+#include <string.h>
+
+// Filled by the signal handler in the stalled thread. The watchdog
+// captures one stack at a time, so a single set is enough.
+static void *stackFrames[WATCHDOG_STACK_DEPTH];
+static volatile sig_atomic_t stackDepth = 0;
+static std::atomic<bool> isStackCaptured{false};
+
+static void captureStack(int) {
+  stackDepth = backtrace(stackFrames, WATCHDOG_STACK_DEPTH);
+  isStackCaptured = true;
+}
+
+void LoopWatch::attach() {
+  thread = pthread_self();
+  isAttached = true;
+}
+
+void LoopWatch::begin() {
+  {
+    std::lock_guard<std::mutex> lock(activityMutex);
+    activityLength = 0;
+  }
+  busySince.store(Metrics::now(), std::memory_order_relaxed);
+}
+
+void LoopWatch::end() {
+  int64_t since = busySince.exchange(0, std::memory_order_relaxed);
+  if (since != 0) {
+    Metrics::record(METRIC_LOOP_LAG, Metrics::now() - since);
+  }
+}
+
+void LoopWatch::setActivity(const Nickname &who, const std::string &what) {
+  std::lock_guard<std::mutex> lock(activityMutex);
+  activityLength = std::min(who.size(), (size_t)WATCHDOG_ACTIVITY_SIZE);
+  memcpy(activity, who.data(), activityLength);
+
+  if (activityLength + 2 < WATCHDOG_ACTIVITY_SIZE) {
+    memcpy(activity + activityLength, ": ", 2);
+    activityLength += 2;
+    size_t length =
+        std::min(what.size(), WATCHDOG_ACTIVITY_SIZE - activityLength);
+    memcpy(activity + activityLength, what.data(), length);
+    activityLength += length;
+  }
+}
+
+std::string LoopWatch::currentActivity() {
+  std::lock_guard<std::mutex> lock(activityMutex);
+  return std::string(activity, activityLength);
+}
+
+Watchdog::~Watchdog() { this->stop(); }
+
+void Watchdog::add(LoopWatch *loop) { loops.push_back(loop); }
+
+void Watchdog::start(size_t thresholdMs) {
+  if (thresholdMs == 0 || isRunning) {
+    return;
+  }
+  threshold = (int64_t)thresholdMs * 1000000;
+
+  // The first backtrace() may load libgcc, which is not safe in a signal
+  // handler, so it happens here
+  void *frame;
+  backtrace(&frame, 1);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof action);
+  action.sa_handler = captureStack;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(WATCHDOG_SIGNAL, &action, nullptr);
+
+  isRunning = true;
+  thread = new std::thread(&Watchdog::_watch, this);
+}
+
+void Watchdog::stop() {
+  isRunning = false;
+  if (thread != nullptr) {
+    thread->join();
+    delete thread;
+    thread = nullptr;
+  }
+}
+
+void Watchdog::_watch() {
+  while (isRunning) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(threshold / 2));
+
+    for (auto loop : loops) {
+      int64_t since = loop->busySince.load(std::memory_order_relaxed);
+      int64_t stalledFor = Metrics::now() - since;
+
+      if (since != 0 && stalledFor > threshold &&
+          since != loop->reportedSince && loop->isAttached) {
+        loop->reportedSince = since;
+        this->report(loop, stalledFor);
+      }
+    }
+  }
+}
+
+void Watchdog::report(LoopWatch *loop, int64_t stalledFor) {
+  Metrics::count(METRIC_LOOP_STALLS);
+  std::string activity = loop->currentActivity();
+  LOG_WARNING("The {} loop is stalled for {} ms, handling \"{}\"", loop->name,
+              stalledFor / 1000000, activity == "" ? "nothing" : activity);
+
+  isStackCaptured = false;
+  if (pthread_kill(loop->thread, WATCHDOG_SIGNAL) != 0) {
+    return;
+  }
+  for (int i = 0; i < 100 && !isStackCaptured; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (!isStackCaptured) {
+    LOG_WARNING("Could not capture the stack of the {} loop", loop->name);
+    return;
+  }
+
+  // The first frames are the signal handler's
+  char **symbols = backtrace_symbols(stackFrames, stackDepth);
+  for (int i = 0; symbols != nullptr && i < stackDepth; i++) {
+    LOG_WARNING("  #{} {}", i, symbols[i]);
+  }
+  free(symbols);
+}
@@ -0,0 +1,66 @@
+#ifndef _WATCHDOG_HPP_
+#define _WATCHDOG_HPP_
+
+#include "InlineString.hpp"
+#include <bits/stdc++.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// Bytes of the command being handled kept for stall reports
+#define WATCHDOG_ACTIVITY_SIZE 96
+// Deepest stack captured from a stalled thread
+#define WATCHDOG_STACK_DEPTH 32
+// Signal interrupting a stalled thread to capture its stack
+#define WATCHDOG_SIGNAL SIGUSR2
+
+// Heartbeat of an event loop. The loop marks when it starts working
+// (begin) and when it goes back to waiting (end); each busy stretch is
+// recorded in the loop-lag histogram and the Watchdog reports the ones
+// that last too long.
+class LoopWatch {
+  friend class Watchdog;
+
+private:
+  const char *name;
+  pthread_t thread;
+  std::atomic<bool> isAttached{false};
+  // Start of the current busy stretch, 0 while waiting
+  std::atomic<int64_t> busySince{0};
+  std::mutex activityMutex;
+  char activity[WATCHDOG_ACTIVITY_SIZE];
+  size_t activityLength = 0;
+  // busySince of the last stall reported, so each is reported once
+  int64_t reportedSince = 0;
+  std::string currentActivity();
+
+public:
+  LoopWatch(const char *name) : name(name) {}
+  // Called by the loop's thread before it starts looping
+  void attach();
+  void begin();
+  void end();
+  // What the loop is doing, e.g. "alice: /join #channel"
+  void setActivity(const Nickname &who, const std::string &what);
+};
+
+// Thread checking LoopWatches for stalls. A loop busy longer than the
+// threshold gets its stack captured by a signal handler in its own thread
+// and logged with the command it was handling.
+class Watchdog {
+private:
+  std::vector<LoopWatch *> loops;
+  int64_t threshold = 0;
+  std::atomic<bool> isRunning{false};
+  std::thread *thread = nullptr;
+  void _watch();
+  void report(LoopWatch *loop, int64_t stalledFor);
+
+public:
+  ~Watchdog();
+  void add(LoopWatch *loop);
+  // Starts checking every threshold / 2 ms; a threshold of 0 does nothing
+  void start(size_t thresholdMs);
+  void stop();
+};
+
+#endif
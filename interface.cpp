@@ -10,6 +10,12 @@
 #define COMMAND_WINDOW_Y_POS (LINES - COMMAND_WINDOW_HEIGHT)
 #define MIN_WINDOW_HEIGHT                                                      \
   (COMMAND_WINDOW_HEIGHT + SUGGESTION_WINDOW_HEIGHT + CONTENT_WINDOW_MIN_HEIGHT)
+// Lines of the message window kept in memory
+#define SCROLLBACK_LINES 1000
+// Lines each thread may have waiting to be drawn
+#define RENDER_QUEUE_LINES 4096
+// Shortest time between two repaints of the message window (60 Hz)
+#define RENDER_FRAME_MS 16
 
 #include "interface.hpp"
 #include "Socket.hpp"
@@ -30,10 +36,14 @@
 #include <wchar.h>
 #include <wctype.h>
 
-GUI::GUI(std::string commandString) { this->commandString = commandString; }
+GUI::GUI(std::string commandString) : contentLines(SCROLLBACK_LINES) {
+  this->commandString = commandString;
+}
 
 GUI *GUI::singleton = nullptr;
 std::mutex GUI::singletonMutex;
+std::mutex GUI::renderQueuesMutex;
+std::vector<SpscQueue<RenderEvent> *> GUI::renderQueues;
 
 GUI *GUI::GetInstance(std::string commandString) {
 
@@ -102,9 +112,37 @@ void GUI::forwardToReadline(char c) {
   rl_callback_read_char();
 }
 
+// Draws only the new line: the window scrolls the older ones up by itself
+void GUI::appendLine(std::string line) {
+  if (contentLines.size() > 0) {
+    CHECK_NCURSES(waddch, contentWindow, '\n');
+  }
+  CHECK_NCURSES(waddstr, contentWindow, line.c_str());
+  contentLines.push(line);
+}
+
+// Lays out again the newest lines that fit in the message window. Only
+// needed when its size changed, so it is bounded by the window height.
 void GUI::redisplayMessage(bool isResizing) {
+  int height = getmaxy(contentWindow);
+  int width = std::max(1, getmaxx(contentWindow));
+  size_t first = contentLines.size();
+  int rows = 0;
+
+  while (first > 0 && rows < height) {
+    first--;
+    size_t lineWidth = strwidth(contentLines.at(first).c_str(), 0);
+    rows += std::max(1, (int)((lineWidth + width - 1) / width));
+  }
+
   CHECK_NCURSES(werase, contentWindow);
-  CHECK_NCURSES(mvwaddstr, contentWindow, 0, 0, this->contentString.c_str());
+  CHECK_NCURSES(wmove, contentWindow, 0, 0);
+  for (size_t i = first; i < contentLines.size(); i++) {
+    if (i > first) {
+      CHECK_NCURSES(waddch, contentWindow, '\n');
+    }
+    CHECK_NCURSES(waddstr, contentWindow, contentLines.at(i).c_str());
+  }
 
   if (isResizing) {
     CHECK_NCURSES(wnoutrefresh, contentWindow);
@@ -116,25 +154,76 @@ void GUI::redisplayMessage(bool isResizing) {
 }
 
 void GUI::log(std::string message) {
-  std::lock_guard<std::mutex> lock(singletonMutex);
   if (singleton == nullptr || !singleton->isInGUI) {
+    std::lock_guard<std::mutex> lock(singletonMutex);
     std::cout << message << std::endl;
   } else {
     addToWindow("LOG: " + message);
   }
 }
 
+// Pushes event to the queue of the calling thread, created the first time
+// it is needed. A full queue makes the thread wait for the next frame
+// rather than lose the event.
+void GUI::queueRenderEvent(RenderEvent event) {
+  thread_local SpscQueue<RenderEvent> *queue = nullptr;
+  if (queue == nullptr) {
+    queue = new SpscQueue<RenderEvent>(RENDER_QUEUE_LINES);
+    std::lock_guard<std::mutex> lock(renderQueuesMutex);
+    renderQueues.push_back(queue);
+  }
+
+  while (!queue->push(event) && singleton->isRunning) {
+    std::this_thread::yield();
+  }
+}
+
+// Safe from any thread: the message is drawn by the UI thread with the
+// next frame
 void GUI::addToWindow(std::string message) {
 
   if (singleton == nullptr || !singleton->isInGUI) {
     safeExitFailure("Written to GUI window without initializing it", 1);
   }
 
-  if (singleton->contentString.size() > 0) {
-    singleton->contentString += "\n";
+  queueRenderEvent(RenderEvent{RenderEvent::LINE, message});
+}
+
+// Applies what every thread queued since the last frame, in one repaint
+void GUI::drawQueuedEvents() {
+  std::vector<SpscQueue<RenderEvent> *> queues;
+  {
+    std::lock_guard<std::mutex> lock(renderQueuesMutex);
+    queues = renderQueues;
+  }
+
+  bool hasDrawn = false;
+  RenderEvent event;
+
+  for (auto queue : queues) {
+    while (queue->pop(event)) {
+      hasDrawn = true;
+
+      if (event.kind == RenderEvent::PROMPT) {
+        commandString = event.text;
+        rl_set_prompt(commandString.c_str());
+        continue;
+      }
+
+      size_t begin = 0;
+      size_t end;
+      while ((end = event.text.find('\n', begin)) != std::string::npos) {
+        appendLine(event.text.substr(begin, end - begin));
+        begin = end + 1;
+      }
+      appendLine(event.text.substr(begin));
+    }
+  }
+
+  if (hasDrawn) {
+    CHECK_NCURSES(wrefresh, contentWindow);
+    windowRedisplay(false);
   }
-  singleton->contentString += message;
-  singleton->redisplayMessage(false);
 }
 
 void GUI::setSuggestions(std::string suggestions) {
@@ -287,7 +376,7 @@ void GUI::initReadline() {
 
 void GUI::closeReadline() { rl_callback_handler_remove(); }
 
-char GUI::readFromGUI() { return wgetch(commandWindow); }
+int GUI::readFromGUI() { return wgetch(commandWindow); }
 
 void GUI::implementCommand(std::string command, commandFnT fn) {
   commands[command] = fn;
@@ -317,9 +406,7 @@ void GUI::updatePrompt(SocketWithInfo *user) {
 
   newString += "> ";
 
-  singleton->commandString = newString;
-  rl_set_prompt(singleton->commandString.c_str());
-  singleton->windowRedisplay(false);
+  queueRenderEvent(RenderEvent{RenderEvent::PROMPT, newString});
 }
 
 char *GUI::commandIterator(const char *text, int state) {
@@ -411,6 +498,11 @@ void GUI::init() {
     return;
   }
 
+  // Errors deep in the sockets must give the terminal back before exiting
+  setExitHandler([this](std::string message, int code) {
+    this->exitFailing(message, code);
+  });
+
   this->initSignalHandler();
   this->initNCurses();
   this->initReadline();
@@ -438,11 +530,25 @@ void GUI::run() {
 
   this->isRunning = true;
 
+  // Input is polled once per frame so queued lines get drawn even while
+  // nothing is typed
+  wtimeout(commandWindow, RENDER_FRAME_MS);
+  auto nextFrame = std::chrono::steady_clock::now();
+
   do {
 
     int c = this->readFromGUI();
 
+    auto now = std::chrono::steady_clock::now();
+    if (now >= nextFrame) {
+      drawQueuedEvents();
+      nextFrame = now + std::chrono::milliseconds(RENDER_FRAME_MS);
+    }
+
     switch (c) {
+    case ERR:
+      break;
+
     case KEY_RESIZE:
       resize();
       break;
@@ -457,5 +563,6 @@ void GUI::run() {
     }
   } while (!shouldClose);
 
+  drawQueuedEvents();
   this->isRunning = false;
 }
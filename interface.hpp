@@ -4,7 +4,9 @@
 #ifndef _RLNCURSES_HPP_
 #define _RLNCURSES_HPP_
 
+#include "LineRing.hpp"
 #include "Socket.hpp"
+#include "SpscQueue.hpp"
 #include "util.hpp"
 #include <bits/stdc++.h>
 #include <curses.h>
@@ -17,6 +19,12 @@
   if (fn() == ERR)                                                             \
     this->exitFailing(#fn " failed!", EXIT_FAILURE);
 
+// Change to the screen requested by any thread, applied by the UI thread
+struct RenderEvent {
+  enum Kind { LINE, PROMPT } kind;
+  std::string text;
+};
+
 class GUI {
 public:
   using argsT = std::vector<std::string>;
@@ -41,6 +49,11 @@ public:
 private:
   static GUI *singleton;
   static std::mutex singletonMutex;
+  // One queue of changes to draw per thread that wrote to the window; only
+  // the UI thread pops them and touches ncurses
+  static std::mutex renderQueuesMutex;
+  static std::vector<SpscQueue<RenderEvent> *> renderQueues;
+  static void queueRenderEvent(RenderEvent event);
 
   GUI(std::string);
 
@@ -53,8 +66,8 @@ private:
   // Suggestion window
   WINDOW *suggestionWindow;
 
-  // String displayed in the message window
-  std::string contentString;
+  // Latest lines of the message window, kept to lay them out again on resize
+  LineRing contentLines;
   // Input character for readline
   unsigned char input;
   // Used to signal "no more input" after feeding a character to readline
@@ -62,8 +75,8 @@ private:
   // Keeps track of the terminal mode so we can reset the terminal if needed
   // on errors
   bool isInGUI = false;
-  bool shouldClose = false;
-  bool isRunning = false;
+  std::atomic<bool> shouldClose{false};
+  std::atomic<bool> isRunning{false};
   std::string commandString;
   // GNU readline function types
   using commandCompletionFunction = char **(const char *, int, int);
@@ -80,6 +93,8 @@ private:
   size_t strwidth(const char *, size_t);
   static int readlineInputAvailable();
   static int readlineGetc(FILE *);
+  void appendLine(std::string);
+  void drawQueuedEvents();
   void redisplayMessage(bool);
   void setSuggestions(std::string);
   static void handleCommand(char *);
@@ -93,7 +108,7 @@ private:
   void closeNCurses();
   void closeSignalHandler();
   void forwardToReadline(char);
-  char readFromGUI();
+  int readFromGUI();
 };
 
 #endif
\ No newline at end of file
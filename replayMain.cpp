@@ -0,0 +1,244 @@
+#include "Capture.hpp"
+#include "ClientCore.hpp"
+#include "RateLimit.hpp"
+#include "util.hpp"
+#include <signal.h>
+
+using namespace std;
+
+// Replies the server gives to a channel message it won't deliver
+static const std::set<std::string> messageRejections = {
+    "Message is too long!", "You must be in a channel to send messages!",
+    "You can't send messages while muted!",
+    "Server is busy, message dropped!"};
+
+// A captured connection being replayed
+struct ReplayConnection {
+  uint32_t id;
+  // Bytes sent after the last complete frame
+  std::string partial;
+  // When each channel message still unanswered was completed, oldest first
+  std::deque<int64_t> sent;
+  // Its capture ended with a close, already passed on
+  bool isClosing = false;
+};
+
+struct ReplayStats {
+  size_t records = 0;
+  size_t bytes = 0;
+  size_t frames = 0;
+  size_t connections = 0;
+  size_t failedConnections = 0;
+  size_t closedByServer = 0;
+  size_t unanswered = 0;
+  // Nanoseconds the replay fell behind its schedule, at most
+  int64_t maxLag = 0;
+  // Nanoseconds from sending a channel message to its echo or rejection
+  std::vector<int64_t> latencies;
+};
+
+static void answer(ClientConnection *connection, ReplayStats &stats) {
+  ReplayConnection *replay = (ReplayConnection *)connection->userData;
+  if (!replay->sent.empty()) {
+    stats.latencies.push_back(TokenBucket::now() - replay->sent.front());
+    replay->sent.pop_front();
+  }
+}
+
+static double milliseconds(int64_t nanoseconds) {
+  return nanoseconds / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  std::string file = "";
+  std::string address = "localhost";
+  double speed = 1;
+  int64_t drainMs = 2000;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    std::string key = arg.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+
+    if (key == "--file") {
+      file = value;
+    } else if (key == "--address") {
+      address = value;
+    } else if (key == "--speed") {
+      speed = value == "max" ? 0 : strtod(value.c_str(), nullptr);
+    } else if (key == "--drain-ms") {
+      drainMs = strtoll(value.c_str(), nullptr, 10);
+    } else {
+      exitFailure("Invalid option: " + arg, EXIT_FAILURE);
+    }
+  }
+  if (file == "" || speed < 0) {
+    exitFailure("Try: replay --file=<capture> [--address=localhost] "
+                "[--speed=1|<n>|max] [--drain-ms=2000]\n"
+                "The server should run with --message-rate=0 "
+                "--command-rate=0, or flood control is what gets measured",
+                EXIT_FAILURE);
+  }
+
+  CaptureReader reader;
+  std::string error;
+  if (reader.open(file, error) != 0) {
+    exitFailure(error, EXIT_FAILURE);
+  }
+  // The server may close a connection while we write to it
+  signal(SIGPIPE, SIG_IGN);
+
+  ReplayStats stats;
+  std::unordered_map<uint32_t, ClientConnection *> connections;
+  std::unordered_set<uint32_t> failed;
+
+  ClientEvents events;
+  events.onMessage = [&stats](ClientConnection *connection,
+                              std::string sender, std::string) {
+    if (sender.compare(0, connection->info.nickname.size() + 1,
+                       connection->info.nickname + "@") == 0) {
+      answer(connection, stats);
+    }
+  };
+  events.onNotice = [&stats](ClientConnection *connection, std::string text) {
+    if (messageRejections.count(text) != 0) {
+      answer(connection, stats);
+    }
+  };
+  events.onDisconnected = [&](ClientConnection *connection) {
+    ReplayConnection *replay = (ReplayConnection *)connection->userData;
+    if (!replay->isClosing) {
+      stats.closedByServer++;
+    }
+    stats.unanswered += replay->sent.size();
+    connections.erase(replay->id);
+    failed.insert(replay->id);
+    delete replay;
+  };
+  ClientCore core(events);
+
+  CaptureRecord record;
+  int result;
+  int64_t started = TokenBucket::now();
+  int64_t firstTime = -1;
+
+  while ((result = reader.next(record)) == 1) {
+    if (firstTime < 0) {
+      firstTime = record.time;
+    }
+    int64_t due =
+        speed == 0 ? 0
+                   : started + (int64_t)((record.time - firstTime) / speed);
+    int64_t wait;
+    while ((wait = due - TokenBucket::now()) > 0) {
+      core.poll((int)std::min(wait / 1000000, (int64_t)1000));
+    }
+    if (speed != 0) {
+      stats.maxLag = std::max(stats.maxLag, -wait);
+    }
+    core.poll(0);
+    stats.records++;
+
+    if (failed.count(record.connection) != 0) {
+      continue;
+    }
+    auto found = connections.find(record.connection);
+
+    // The server sees the end of input after everything sent before, as it
+    // did live, and what it answers meanwhile is still read
+    if (record.type == CAPTURE_CLOSE) {
+      if (found != connections.end()) {
+        ((ReplayConnection *)found->second->userData)->isClosing = true;
+        found->second->info.socket->socketShutdown(SHUT_WR);
+      }
+      continue;
+    }
+
+    // Only what the capture holds is sent, its own /whoami included
+    if (found == connections.end()) {
+      int status;
+      ClientConnection *connection =
+          core.connect(address, DEFAULT_PORT, status, false);
+      if (connection == nullptr) {
+        stats.failedConnections++;
+        failed.insert(record.connection);
+        continue;
+      }
+      ReplayConnection *replay = new ReplayConnection();
+      replay->id = record.connection;
+      connection->userData = replay;
+      found = connections.emplace(record.connection, connection).first;
+      stats.connections++;
+    }
+
+    ClientConnection *connection = found->second;
+    ReplayConnection *replay = (ReplayConnection *)connection->userData;
+    int64_t now = TokenBucket::now();
+    std::string frame;
+    replay->partial += record.data;
+    while (popFrame(replay->partial, frame)) {
+      stats.frames++;
+      if (frame.compare(0, 3, "/m ") == 0) {
+        replay->sent.push_back(now);
+      }
+    }
+
+    connection->info.socket->socketWrite(record.data);
+    stats.bytes += record.data.size();
+  }
+  if (result < 0) {
+    std::cerr << file << " ends inside a record" << std::endl;
+  }
+  int64_t sentAt = TokenBucket::now();
+
+  // Waits for the answers to the last messages
+  int64_t drainUntil = sentAt + drainMs * 1000000;
+  while (TokenBucket::now() < drainUntil) {
+    size_t waiting = 0;
+    for (auto &entry : connections) {
+      waiting += ((ReplayConnection *)entry.second->userData)->sent.size();
+    }
+    if (waiting == 0) {
+      break;
+    }
+    core.poll(10);
+  }
+  int64_t finished = TokenBucket::now();
+
+  for (auto &entry : connections) {
+    ReplayConnection *replay = (ReplayConnection *)entry.second->userData;
+    stats.unanswered += replay->sent.size();
+    delete replay;
+    core.close(entry.second);
+  }
+
+  std::vector<int64_t> &latencies = stats.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  double sendSeconds = (sentAt - started) / 1e9;
+
+  std::cout << "records: " << stats.records << "\nconnections: "
+            << stats.connections << " (" << stats.failedConnections
+            << " failed, " << stats.closedByServer << " closed by the server)"
+            << "\nframes: " << stats.frames << "\nbytes: " << stats.bytes
+            << "\nsend time: " << sendSeconds << " s"
+            << "\nframes/s: "
+            << (sendSeconds > 0 ? stats.frames / sendSeconds : 0)
+            << "\nmax lag behind schedule: " << milliseconds(stats.maxLag)
+            << " ms\ntotal time: " << (finished - started) / 1e9 << " s"
+            << "\nmessages answered: " << latencies.size()
+            << ", unanswered: " << stats.unanswered << std::endl;
+  if (!latencies.empty()) {
+    int64_t total = 0;
+    for (int64_t latency : latencies) {
+      total += latency;
+    }
+    std::cout << "message latency ms: mean "
+              << milliseconds(total / (int64_t)latencies.size()) << ", p50 "
+              << milliseconds(latencies[latencies.size() / 2]) << ", p99 "
+              << milliseconds(latencies[latencies.size() * 99 / 100])
+              << ", max " << milliseconds(latencies.back()) << std::endl;
+  }
+  return 0;
+}
@@ -1,21 +1,100 @@
+#include "Daemon.hpp"
+#include "Logger.hpp"
 #include "Server.hpp"
+#include "Trace.hpp"
 #include "interface.hpp"
 #include "util.hpp"
 
 using namespace std;
 
-int main() {
+int main(int argc, char *argv[]) {
+  // Read --option=value arguments into the server configuration
+  ServerConfig config;
+  std::vector<std::string> args(argv + 1, argv + argc);
+  std::string error;
+  if (config.parse(args, error) != 0) {
+    exitFailure(error, EXIT_FAILURE);
+  }
+
+  // Without a terminal, run until a signal stops the server
+  if (config.daemon) {
+    Daemon daemon(args, config);
+    Server *server = new Server("localhost", config);
+
+    if (config.takeover != "") {
+      server->takeOver(config.takeover);
+    } else {
+      server->init();
+    }
+    return daemon.run(server);
+  }
+
   // Create an instance of the Server class
-  Server *server = new Server("localhost");
+  Server *server = new Server("localhost", config);
 
   // Create an instance of the GUI class
   GUI *serverUI = GUI::GetInstance("<Server> ");
 
   // Initialize the GUI
   serverUI->init();
+  Logger::addSink([](int, int64_t, const std::string &text) {
+    GUI::log(text);
+  });
+  Logger::start();
+  // Lines still in the logger go out before the GUI closes
+  setExitHandler([serverUI](std::string message, int code) {
+    Logger::stop();
+    serverUI->exitFailing(message, code);
+  });
+
+  // Add a command to show channel and memory statistics
+  serverUI->implementCommand("/stats", [server](const GUI::argsT &) {
+    GUI::log(server->stats());
+    return 0;
+  });
+
+  // Add a command to list the connections slowest to drain their queues
+  serverUI->implementCommand("/connections", [server](const GUI::argsT &args) {
+    size_t count = args.size() > 1 ? strtoul(args[1].c_str(), nullptr, 10)
+                                   : 10;
+    for (auto &line : server->connectionReport(count)) {
+      GUI::log(line);
+    }
+    return 0;
+  });
+
+  // Add a command to write the sampled message traces
+  serverUI->implementCommand("/trace", [config](const GUI::argsT &args) {
+    std::string path = args.size() > 1 ? args[1] : config.traceFile;
+    if (Tracer::dump(path) != 0) {
+      GUI::log("Could not write trace to " + path + ": " + strerror(errno));
+      return 1;
+    }
+    GUI::log("Trace written to " + path);
+    return 0;
+  });
+
+  // Add a command to read a range of the persistent message log
+  serverUI->implementCommand("/scrollback", [server](const GUI::argsT &args) {
+    if (args.size() != 4) {
+      GUI::log("Try: /scrollback <channel> <from> <to>\nHint: Shows logged "
+               "messages by sequence number");
+      return 1;
+    }
+    uint64_t from = strtoull(args[2].c_str(), nullptr, 10);
+    uint64_t to = strtoull(args[3].c_str(), nullptr, 10);
+    for (auto &line : server->scrollback(args[1], from, to)) {
+      GUI::log(line);
+    }
+    return 0;
+  });
 
-  // Initialize the server
-  server->init();
+  // Initialize the server, or take over the one already running
+  if (config.takeover != "") {
+    server->takeOver(config.takeover);
+  } else {
+    server->init();
+  }
 
   // Create a thread to run the server
   std::thread *serverThread = new std::thread([server, serverUI]() {
@@ -34,6 +113,7 @@ int main() {
 
   // Stop the server
   server->stop();
+  Logger::stop();
 
   // Close the GUI
   serverUI->close();
@@ -0,0 +1,160 @@
+#include "Logger.hpp"
+#include "Simulation.hpp"
+#include "util.hpp"
+#include <signal.h>
+
+using namespace std;
+
+// Options of the simulation itself, the others configure the server
+struct SimulationOptions {
+  std::string script = "";
+  std::string workload = "";
+  size_t clients = 100;
+  size_t channels = 4;
+  size_t rounds = 100;
+  size_t seed = 1;
+  size_t roundMs = 200;
+  bool verbose = false;
+};
+
+// Scripted chat between clients spread over channels. Every round each
+// client sends a message, or sometimes joins another channel, changes its
+// nickname or kicks someone, chosen by a generator seeded with seed, then
+// the server handles it all and the virtual clock moves roundMs ahead.
+static int runChat(Simulation &simulation, const SimulationOptions &options,
+                   std::string &error) {
+  std::mt19937 random(options.seed);
+  std::string command;
+
+  if (simulation.run("population c " + std::to_string(options.clients),
+                     error) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < options.clients; i++) {
+    command = "send c" + std::to_string(i) + " /join #" +
+              std::to_string(i % options.channels);
+    if (simulation.run(command, error) != 0) {
+      return -1;
+    }
+  }
+  simulation.step();
+
+  for (size_t round = 0; round < options.rounds; round++) {
+    for (size_t i = 0; i < options.clients; i++) {
+      std::string name = "c" + std::to_string(i);
+      std::string frame;
+      unsigned action = random() % 100;
+
+      if (action < 85) {
+        frame = "/m round " + std::to_string(round) + " from " + name;
+      } else if (action < 93) {
+        frame = "/join #" + std::to_string(random() % options.channels);
+      } else if (action < 97) {
+        frame = "/nickname " + name + "_" + std::to_string(round);
+      } else {
+        std::string target =
+            simulation.nickname("c" + std::to_string(random() %
+                                                     options.clients));
+        frame = "/kick " + target;
+      }
+      if (simulation.send(name, frame, error) != 0) {
+        return -1;
+      }
+    }
+    simulation.step();
+    simulation.advance(options.roundMs);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  SimulationOptions options;
+  std::vector<std::string> serverArgs;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    std::string key = arg.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+
+    if (key == "--script") {
+      options.script = value;
+    } else if (key == "--workload") {
+      options.workload = value;
+    } else if (key == "--clients") {
+      options.clients = strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--channels") {
+      options.channels = std::max(1ul, strtoul(value.c_str(), nullptr, 10));
+    } else if (key == "--rounds") {
+      options.rounds = strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--seed") {
+      options.seed = strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--round-ms") {
+      options.roundMs = strtoul(value.c_str(), nullptr, 10);
+    } else if (key == "--verbose") {
+      options.verbose = value == "1";
+    } else {
+      serverArgs.push_back(arg);
+    }
+  }
+
+  ServerConfig config;
+  std::string error;
+  if (config.parse(serverArgs, error) != 0) {
+    exitFailure(error, EXIT_FAILURE);
+  }
+  if (options.workload != "" && options.workload != "chat") {
+    exitFailure("Unknown workload: " + options.workload, EXIT_FAILURE);
+  }
+
+  // A dropped client must not kill the simulation
+  signal(SIGPIPE, SIG_IGN);
+  if (options.verbose) {
+    Logger::addSink([](int level, int64_t time, const std::string &text) {
+      std::cerr << Logger::line(level, time, text) << std::endl;
+    });
+    Logger::start();
+  }
+  // Default nicknames are drawn from rand()
+  srand(options.seed);
+
+  auto started = std::chrono::steady_clock::now();
+  int result;
+  {
+    Simulation simulation(config);
+
+    if (options.workload == "chat") {
+      result = runChat(simulation, options, error);
+    } else if (options.script != "") {
+      std::ifstream script(options.script);
+      if (!script) {
+        exitFailure("Could not open " + options.script, EXIT_FAILURE);
+      }
+      result = simulation.runScript(script, error);
+    } else {
+      result = simulation.runScript(std::cin, error);
+    }
+
+    double wallMs = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - started)
+                        .count();
+    uint64_t rate =
+        wallMs > 0 ? (uint64_t)(simulation.bytesReceived() * 1000 / wallMs) : 0;
+    std::cout << "clients: " << simulation.size()
+              << "\nlisten passes: " << simulation.listenPasses()
+              << "\nbytes received: " << simulation.bytesReceived()
+              << "\nwall time: " << wallMs << " ms"
+              << "\nbytes/s: " << rate
+              << "\ndigest: " << std::hex << simulation.digest() << std::dec
+              << std::endl;
+  }
+
+  if (options.verbose) {
+    Logger::stop();
+  }
+  if (result != 0) {
+    exitFailure(error, EXIT_FAILURE);
+  }
+  return 0;
+}
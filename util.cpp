@@ -1,5 +1,8 @@
 #include "util.hpp"
-#include "interface.hpp"
+#include <iostream>
+#include <stdlib.h>
+
+static std::function<void(std::string, int)> exitHandler = exitFailure;
 
 char *readLine(FILE *stream) {
   char *string = NULL;
@@ -37,12 +40,25 @@ std::string readLineCpp(FILE *stream) {
   return line;
 }
 
+bool popFrame(std::string &buffer, std::string &frame) {
+  size_t end = buffer.find(FRAME_DELIMITER);
+  if (end == std::string::npos) {
+    return false;
+  }
+  frame.assign(buffer, 0, end);
+  buffer.erase(0, end + 1);
+  return true;
+}
+
 void exitFailure(std::string message, int code) {
   std::cerr << message << std::endl;
   exit(code);
 }
 
 void safeExitFailure(std::string message, int code) {
-  GUI *gui = GUI::GetInstance("<IRC> ");
-  gui->exitFailing(message, code);
-}
\ No newline at end of file
+  exitHandler(message, code);
+}
+
+void setExitHandler(std::function<void(std::string, int)> handler) {
+  exitHandler = handler;
+}
@@ -5,6 +5,11 @@
 
 #define UNUSED(x) (void)x;
 
+// Terminates every message on the wire, in both directions
+#define FRAME_DELIMITER '\n'
+
+#include <functional>
+#include <stddef.h>
 #include <stdio.h>
 #include <string>
 
@@ -18,4 +23,25 @@ void exitFailure(std::string message, int code);
 
 void safeExitFailure(std::string message, int code);
 
+// Replaces what safeExitFailure does, e.g. to restore the terminal before
+// exiting. Until then it is exitFailure.
+void setExitHandler(std::function<void(std::string, int)> handler);
+
+// Moves the first complete frame of buffer, without its delimiter, into
+// frame. Returns false when buffer holds no complete frame yet.
+bool popFrame(std::string &buffer, std::string &frame);
+
+// Gives back the buckets of a hash map that shrank, e.g. after mass removal
+template <typename Map> void shrinkMap(Map &map) {
+  if (map.bucket_count() > 4 * map.size() + 16) {
+    map.rehash(0);
+  }
+}
+
+// Rough heap footprint of a hash map: bucket array plus one node per entry
+template <typename Map> size_t mapMemoryUsage(const Map &map) {
+  return map.bucket_count() * sizeof(void *) +
+         map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void *));
+}
+
 #endif